@@ -0,0 +1,256 @@
+/*LC-3 block storage device*/
+
+#include<stdio.h>
+#include<stdint.h>
+#include<string.h>
+/* unix only */
+#include<stdlib.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<pthread.h>
+#include<sys/stat.h>
+#include<sys/uio.h>
+
+#include "lc3.h"
+
+// BLOCK DEVICE
+/*
+    A disk of 256-word blocks at MR_BLK_BLOCK (0xFE30), backed by the host file given with --disk:
+        FE30  block number
+        FE31  guest address of the 256-word buffer, which must end below the device page
+        FE32  command: write BLK_READ or BLK_WRITE to transfer one block, plus BLK_ASYNC to not wait
+        FE33  status: BLK_READY once nothing is in flight, BLK_FAILED if the last command failed
+        FE34  blocks on the disk, 0 without one
+    A command moves the whole block in one operation. Without BLK_ASYNC it is done before the
+    instruction writing it retires: a read goes straight from the file into the buffer's (at most two)
+    pages with one preadv. With BLK_ASYNC the worker thread does the transfer through a bounce buffer
+    in the VM, so it never touches guest pages the VM may be changing (copy-on-write, dedup) meanwhile:
+    a write takes its copy of the buffer when the command is given, a read lands in memory the first
+    time the guest reads the status after the transfer is done, the status then shows BLK_READY. Until
+    then the buffer must be left alone. A command given while one is in flight waits for it first.
+    The file holds the words in host order, little-endian on the hosts this runs on.
+*/
+#define BLOCK_WORDS PAGE_SIZE
+#define BLOCK_BYTES (BLOCK_WORDS * sizeof(uint16_t))
+
+struct {
+    int fd;
+    int writable;
+    uint16_t blocks;
+    pthread_t worker;
+    int running;
+    pthread_mutex_t lock;
+    pthread_cond_t work;   /* signalled when a request is queued */
+    pthread_cond_t done;   /* signalled when one is finished */
+    struct vm* head;       /* queued asynchronous requests, linked through blk.next */
+    struct vm* tail;
+    uint64_t transfers, failures;
+} disk = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER };
+
+/* one block between the file and `buf` */
+int block_transfer(int write, uint16_t block, struct iovec* iov, int iov_count) {
+    __atomic_fetch_add(&disk.transfers, 1, __ATOMIC_RELAXED);
+    off_t offset = (off_t) block * BLOCK_BYTES;
+    ssize_t n = write ? pwritev(disk.fd, iov, iov_count, offset) : preadv(disk.fd, iov, iov_count, offset);
+    if (n == (ssize_t) BLOCK_BYTES) return 1;
+    __atomic_fetch_add(&disk.failures, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void* block_worker(void* arg) {
+    (void) arg;
+    pthread_mutex_lock(&disk.lock);
+    while (disk.running) {
+        struct vm* vm = disk.head;
+        if (!vm) {
+            pthread_cond_wait(&disk.work, &disk.lock);
+            continue;
+        }
+        disk.head = vm->blk.next;
+        if (!disk.head) disk.tail = NULL;
+        pthread_mutex_unlock(&disk.lock);
+
+        int write = (vm->blk.cmd & BLK_COMMAND) == BLK_WRITE;
+        struct iovec iov = { vm->blk.buf, BLOCK_BYTES };
+        int ok = block_transfer(write, vm->blk.block, &iov, 1);
+
+        pthread_mutex_lock(&disk.lock);
+        __atomic_store_n(&vm->blk.state, ok ? (write ? 0 : BLK_DELIVER) : BLK_FAILED, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&disk.done);
+    }
+    pthread_mutex_unlock(&disk.lock);
+    return NULL;
+}
+
+/* back the device with `path`, read-only if it cannot be written; 0 if it cannot be used */
+int block_open(const char* path) {
+    int fd = open(path, O_RDWR);
+    int writable = fd >= 0;
+    if (fd < 0) fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return 0;
+    }
+    off_t blocks = st.st_size / BLOCK_BYTES;
+    disk.blocks = blocks > 0xFFFF ? 0xFFFF : (uint16_t) blocks;
+    disk.fd = fd;
+    disk.writable = writable;
+    disk.running = 1;
+    if (pthread_create(&disk.worker, NULL, block_worker, NULL) != 0) {
+        disk.running = 0;
+        block_close();
+        return 0;
+    }
+    return 1;
+}
+
+/* every VM must be done with the device (block_release) */
+void block_close() {
+    if (disk.running) {
+        pthread_mutex_lock(&disk.lock);
+        disk.running = 0;
+        pthread_cond_signal(&disk.work);
+        pthread_mutex_unlock(&disk.lock);
+        pthread_join(disk.worker, NULL);
+    }
+    if (disk.fd >= 0) close(disk.fd);
+    disk.fd = -1;
+    disk.blocks = 0;
+}
+
+/* wait for the VM's transfer in flight, if any */
+void block_release(struct vm* vm) {
+    if (!(__atomic_load_n(&vm->blk.state, __ATOMIC_ACQUIRE) & BLK_BUSY)) return;
+    pthread_mutex_lock(&disk.lock);
+    while (vm->blk.state & BLK_BUSY) pthread_cond_wait(&disk.done, &disk.lock);
+    pthread_mutex_unlock(&disk.lock);
+}
+
+/* the device registers of `from` in `to`, for vm_clone and vm_fork */
+void block_copy(struct vm* to, struct vm* from) {
+    to->blk.block = from->blk.block;
+    to->blk.addr = from->blk.addr;
+    to->blk.cmd = from->blk.cmd;
+    to->blk.state = block_settle(from);
+}
+
+/* the buffer as at most two runs of words inside private pages, for a transfer into memory */
+int block_buffer(struct vm* vm, struct iovec* iov) {
+    uint16_t address = vm->blk.addr;
+    int count = 0;
+    for (int left = BLOCK_WORDS; left > 0; ++ count) {
+        uint16_t p = address >> PAGE_BITS;
+        int words = PAGE_SIZE - (address & PAGE_MASK);
+        if (words > left) words = left;
+        if (vm->page_kind[p] != PG_PRIVATE) page_make_private(vm, p);
+        vm->page_hot[p] = 1;
+        iov[count].iov_base = &vm->page[p][address & PAGE_MASK];
+        iov[count].iov_len = words * sizeof(uint16_t);
+        address += words;
+        left -= words;
+    }
+    return count;
+}
+
+/* the bounce buffer of a finished asynchronous read into memory */
+void block_deliver(struct vm* vm) {
+    struct iovec iov[2];
+    int count = block_buffer(vm, iov);
+    memcpy(iov[0].iov_base, vm->blk.buf, iov[0].iov_len);
+    if (count > 1) memcpy(iov[1].iov_base, (char*) vm->blk.buf + iov[0].iov_len, iov[1].iov_len);
+    vm->blk.state = 0;
+}
+
+/* the state once the VM is done waiting, with a finished read in memory */
+uint16_t block_settle(struct vm* vm) {
+    block_release(vm);
+    if (vm->blk.state & BLK_DELIVER) block_deliver(vm);
+    return vm->blk.state;
+}
+
+void block_command(struct vm* vm, uint16_t cmd) {
+    block_settle(vm);
+    vm->blk.cmd = cmd;
+    int write = (cmd & BLK_COMMAND) == BLK_WRITE;
+    if (((cmd & BLK_COMMAND) != BLK_READ && !write) || disk.fd < 0 || (write && !disk.writable) ||
+        vm->blk.block >= disk.blocks || (uint32_t) vm->blk.addr + BLOCK_WORDS > DEVICE_BASE) {
+        vm->blk.state = BLK_FAILED;
+        return;
+    }
+    struct iovec iov[2];
+    if (!(cmd & BLK_ASYNC)) {
+        /* a write reads the buffer through the page table without copying any page */
+        int count;
+        if (write) {
+            count = 0;
+            for (uint16_t a = vm->blk.addr; a < vm->blk.addr + BLOCK_WORDS; a = (a | PAGE_MASK) + 1, ++ count) {
+                uint16_t end = (a | PAGE_MASK) + 1;
+                if (end > vm->blk.addr + BLOCK_WORDS) end = vm->blk.addr + BLOCK_WORDS;
+                iov[count].iov_base = &vm->page[a >> PAGE_BITS][a & PAGE_MASK];
+                iov[count].iov_len = (size_t) (end - a) * sizeof(uint16_t);
+            }
+        } else {
+            count = block_buffer(vm, iov);
+        }
+        vm->blk.state = block_transfer(write, vm->blk.block, iov, count) ? 0 : BLK_FAILED;
+        return;
+    }
+    if (!vm->blk.buf) vm->blk.buf = malloc(BLOCK_BYTES);
+    if (!vm->blk.buf) {
+        vm->blk.state = BLK_FAILED;
+        return;
+    }
+    if (write) {
+        for (int i = 0; i < BLOCK_WORDS; ++ i) vm->blk.buf[i] = mem_read(vm, vm->blk.addr + i);
+    }
+    pthread_mutex_lock(&disk.lock);
+    vm->blk.state = BLK_BUSY;
+    vm->blk.next = NULL;
+    if (disk.tail) disk.tail->blk.next = vm; else disk.head = vm;
+    disk.tail = vm;
+    pthread_cond_signal(&disk.work);
+    pthread_mutex_unlock(&disk.lock);
+}
+
+uint16_t block_read(struct vm* vm, uint16_t address) {
+    switch (address) {
+        case MR_BLK_BLOCK:
+            return vm->blk.block;
+        case MR_BLK_ADDR:
+            return vm->blk.addr;
+        case MR_BLK_CMD:
+            return vm->blk.cmd;
+        case MR_BLK_STATUS:
+            {
+                uint16_t state = __atomic_load_n(&vm->blk.state, __ATOMIC_ACQUIRE);
+                if (state & BLK_BUSY) return 0;
+                if (state & BLK_DELIVER) state = block_settle(vm);
+                return BLK_READY | (state & BLK_FAILED);
+            }
+        default:
+            return disk.blocks;
+    }
+}
+
+void block_write(struct vm* vm, uint16_t address, uint16_t data) {
+    switch (address) {
+        case MR_BLK_BLOCK:
+            vm->blk.block = data;
+            break;
+        case MR_BLK_ADDR:
+            vm->blk.addr = data;
+            break;
+        case MR_BLK_CMD:
+            block_command(vm, data);
+            break;
+    }
+}
+
+void block_print_stats(FILE* file) {
+    if (disk.fd < 0) return;
+    fprintf(file, "disk: %u blocks, %llu transfers, %llu failed\n", disk.blocks,
+        (unsigned long long) disk.transfers, (unsigned long long) disk.failures);
+}
@@ -0,0 +1,109 @@
+/*LC-3 embedding: running a VM from a host's event loop*/
+
+#include<stdio.h>
+#include<stdint.h>
+#include<string.h>
+/* unix only */
+#include<stdlib.h>
+
+#include "lc3.h"
+
+// EMBEDDING
+/*
+    For a host that cannot let a thread sleep in the guest's GETC: the keys come from the host
+    (embed_feed) instead of the terminal, the output goes to a buffer (embed_output) instead of
+    stdout, and embed_run always comes back instead of waiting:
+        VM_INPUT   the guest wants a key and none was fed: feed some, then run again
+        VM_OUTPUT  a trap printed: take the output, then run again
+        VM_BUDGET  the budget is spent, run again when it suits the host
+        VM_THROTTLED  out of tokens (quota_set), run another VM until quota_ready_us
+        VM_QUOTA   the VM's total is spent
+        VM_HALTED  done, the output has the guest's last words
+    Everything about the guest stays in the VM between runs: a run that stopped for input undoes the
+    instruction asking (vm_input_stop), one that stopped for output ends after the trap, so running
+    again simply continues. A C++20 coroutine wrapper is a loop around embed_run that co_awaits
+    the host's read on VM_INPUT and its write on VM_OUTPUT.
+    Each VM opened for it has its own feed and output: the keys fed to one never reach another, and
+    what one prints is kept apart. embed_run puts them in place of the terminal's for the run and
+    the terminal's back after it, so one thread can keep many VMs going, one run at a time.
+
+        struct vm* vm = vm_create();
+        embed_open(vm);
+        for (int status; (status = embed_run(vm, &engines[0], 1 << 20)) != VM_HALTED; ) {
+            if (status == VM_OUTPUT) { send(embed_output(vm, &size), size); embed_output_clear(vm); }
+            if (status == VM_INPUT) return; // call embed_feed and run again when data arrives
+        }
+*/
+
+struct embed {
+    struct input_state* input;
+    struct capture* output;
+};
+
+/* the VM's input and output in place of the process's, or back */
+void embed_swap(struct vm* vm) {
+    input_swap(vm->embed->input);
+    out_capture_swap(vm->embed->output);
+}
+
+/* keys from the VM's feed and output to its buffer from now on, returns 0 if out of memory */
+int embed_open(struct vm* vm) {
+    if (vm->embed) return 1;
+    struct embed* embed = calloc(1, sizeof(struct embed));
+    if (!embed) return 0;
+    embed->input = input_state_new();
+    embed->output = out_capture_new();
+    vm->embed = embed;
+    if (!embed->input || !embed->output || !embed_feed(vm, "", 0)) {
+        embed_close(vm);
+        return 0;
+    }
+    return 1;
+}
+
+/* forget the VM's feed and output, nothing if it was not open */
+void embed_close(struct vm* vm) {
+    if (!vm->embed) return;
+    input_state_free(vm->embed->input);
+    out_capture_free(vm->embed->output);
+    free(vm->embed);
+    vm->embed = NULL;
+}
+
+int embed_feed(struct vm* vm, const char* keys, size_t size) {
+    embed_swap(vm);
+    int ok = input_feed(keys, size);
+    embed_swap(vm);
+    return ok;
+}
+
+/* the keys fed so far are all there will be, the guest sees the end of input after them */
+void embed_feed_end(struct vm* vm) {
+    embed_swap(vm);
+    input_feed_end();
+    embed_swap(vm);
+}
+
+/* run `vm` on `engine` for at most `budget` instructions, until it wants input or has printed */
+int embed_run(struct vm* vm, const struct engine* engine, uint64_t budget) {
+    embed_swap(vm);
+    vm->output_yield = 1;
+    int status = vm_run_throttled(vm, engine, budget);
+    vm->output_yield = 0;
+    embed_swap(vm);
+    return status;
+}
+
+/* what the guest printed since the last embed_output_clear */
+const char* embed_output(struct vm* vm, size_t* size) {
+    embed_swap(vm);
+    const char* output = out_captured(size);
+    embed_swap(vm);
+    return output;
+}
+
+void embed_output_clear(struct vm* vm) {
+    embed_swap(vm);
+    out_capture_truncate(0);
+    embed_swap(vm);
+}
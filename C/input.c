@@ -0,0 +1,312 @@
+/*LC-3 input: the terminal and the key queue*/
+
+#include<stdio.h>
+#include<stdint.h>
+#include<string.h>
+/* unix only */
+#include<stdlib.h>
+#include<unistd.h>
+#include<sys/time.h>
+#include<sys/types.h>
+#include<sys/termios.h>
+
+#include "lc3.h"
+
+/* Input Buffering (?? wtf) */
+struct termios original_tio;
+
+void disable_input_buffering()
+{
+    tcgetattr(STDIN_FILENO, &original_tio);
+    struct termios new_tio = original_tio;
+    new_tio.c_lflag &= ~ICANON & ~ECHO;
+    tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+}
+
+void restore_input_buffering()
+{
+    tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+}
+
+/* where the keys come from, stdin unless the embedding program says otherwise */
+int input_fd = STDIN_FILENO;
+
+
+/* block until the input has something, up to `timeout_us` (-1 = forever) */
+int wait_key(int64_t timeout_us) {
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    FD_SET(input_fd, &readfds);
+
+    struct timeval timeout;
+    timeout.tv_sec = timeout_us / 1000000;
+    timeout.tv_usec = timeout_us % 1000000;
+    return select(input_fd + 1, &readfds, NULL, NULL, timeout_us < 0 ? NULL : &timeout) > 0;
+}
+
+// INPUT
+/*
+    Keys are read from stdin in bulk, not one getchar at a time, and decoded into a queue:
+    - plain bytes become one key each
+    - known escape sequences (arrows and friends) are recognised as a whole, so they can be remapped
+      to guest keys with --keymap (e.g. up=w), unmapped sequences still reach the guest byte by byte
+    TRAP_GETC, TRAP_IN and MR_KBDR all take keys from the queue, so a burst of typing or an arrow key
+    costs one read instead of a syscall and a trip through the KBSR loop per byte.
+*/
+#define INPUT_QUEUE 256
+#define INPUT_READ 64
+#define ESC_WAIT_US 5000 /* how long to wait for the rest of an escape sequence */
+
+enum {
+    KEY_UP = 0x100,
+    KEY_DOWN,
+    KEY_RIGHT,
+    KEY_LEFT,
+    KEY_HOME,
+    KEY_END,
+    KEY_INSERT,
+    KEY_DELETE,
+    KEY_PAGE_UP,
+    KEY_PAGE_DOWN,
+    KEY_COUNT
+};
+
+const struct {
+    const char* seq;
+    uint16_t key;
+    const char* name;
+} key_seqs[] = {
+    { "\x1b[A", KEY_UP, "up" },
+    { "\x1b[B", KEY_DOWN, "down" },
+    { "\x1b[C", KEY_RIGHT, "right" },
+    { "\x1b[D", KEY_LEFT, "left" },
+    { "\x1bOA", KEY_UP, "up" }, /* the same keys in application cursor mode */
+    { "\x1bOB", KEY_DOWN, "down" },
+    { "\x1bOC", KEY_RIGHT, "right" },
+    { "\x1bOD", KEY_LEFT, "left" },
+    { "\x1b[H", KEY_HOME, "home" },
+    { "\x1b[F", KEY_END, "end" },
+    { "\x1b[1~", KEY_HOME, "home" },
+    { "\x1b[2~", KEY_INSERT, "insert" },
+    { "\x1b[3~", KEY_DELETE, "delete" },
+    { "\x1b[4~", KEY_END, "end" },
+    { "\x1b[5~", KEY_PAGE_UP, "pageup" },
+    { "\x1b[6~", KEY_PAGE_DOWN, "pagedown" },
+};
+#define KEY_SEQ_COUNT (sizeof(key_seqs) / sizeof(key_seqs[0]))
+
+struct input_state {
+    uint16_t queue[INPUT_QUEUE];
+    uint64_t arrived[INPUT_QUEUE]; /* when each key was read, for the key wait metric */
+    uint32_t head, tail;
+    char raw[INPUT_READ];  /* read but not decoded yet: the start of an escape sequence */
+    int raw_len;
+    int eof;
+    const char* script; /* keys from memory instead of input_fd, see input_script */
+    size_t script_size, script_at;
+    int script_more;
+    char* feed;         /* the script of input_feed, owned here */
+    size_t feed_cap;
+    uint16_t map[KEY_COUNT]; /* guest key for a byte or named key, 0 = unchanged */
+    int fd;             /* input_fd, while the stream is swapped out */
+} input;
+
+/* read keys from `fd` from now on, dropping whatever was queued from the old one */
+void input_open(int fd) {
+    input_fd = fd;
+    input.head = input.tail = 0;
+    input.raw_len = 0;
+    input.eof = 0;
+    input.script = NULL;
+}
+
+/*
+    Keys from memory, for running a recorded session: the `size` bytes at `keys` are there at once,
+    then the input ends. The bytes are decoded like the terminal's, so escape sequences and the key
+    map work the same, and the caller keeps them alive while the guest runs.
+    With `more` the input does not end but runs dry: the guest asking for a key then stops the run
+    with VM_INPUT, and the next script continues the same stream. An escape sequence is only taken
+    apart at the real end, so one cut between two scripts still arrives as one key.
+*/
+void input_script(const char* keys, size_t size, int more) {
+    input_open(-1);
+    input.script = keys;
+    input.script_size = size;
+    input.script_at = 0;
+    input.script_more = more;
+}
+
+/*
+    Keys handed over as they arrive, for a host running the guest from its event loop (embed.c):
+    a script with more promised, but each call adds to the same stream instead of starting a new one,
+    so keys already queued or half a cut escape sequence are kept. Returns 0 if out of memory.
+*/
+int input_feed(const char* keys, size_t size) {
+    if (input.script != input.feed || !input.feed) {
+        input_open(-1);
+        input.script_size = input.script_at = 0;
+    }
+    if (input.script_at) {
+        /* drop what was read already */
+        memmove(input.feed, input.feed + input.script_at, input.script_size - input.script_at);
+        input.script_size -= input.script_at;
+        input.script_at = 0;
+    }
+    if (!input.feed || input.script_size + size > input.feed_cap) {
+        size_t cap = input.feed_cap ? input.feed_cap * 2 : 256;
+        while (cap < input.script_size + size) cap *= 2;
+        char* feed = realloc(input.feed, cap);
+        if (!feed) return 0;
+        input.feed = feed;
+        input.feed_cap = cap;
+    }
+    memcpy(input.feed + input.script_size, keys, size);
+    input.script = input.feed;
+    input.script_size += size;
+    input.script_more = 1;
+    return 1;
+}
+
+/* no more keys will be fed: once the guest has read the ones there, the input ends */
+void input_feed_end() {
+    input.script_more = 0;
+}
+
+/*
+    A key stream of its own, for a VM that gets its keys apart from the others (embed.c): swapped
+    in with input_swap around everything that feeds or runs it, the key map stays the process's.
+*/
+struct input_state* input_state_new() {
+    struct input_state* state = calloc(1, sizeof(struct input_state));
+    if (state) state->fd = -1;
+    return state;
+}
+
+void input_state_free(struct input_state* state) {
+    if (!state) return;
+    free(state->feed);
+    free(state);
+}
+
+/* exchange the stream being read with `other`, calling it again swaps them back */
+void input_swap(struct input_state* other) {
+    struct input_state current = input;
+    current.fd = input_fd;
+    input = *other;
+    input_fd = input.fd;
+    memcpy(input.map, current.map, sizeof(input.map));
+    *other = current;
+}
+
+/* bytes of the script taken but not decoded yet (a cut escape sequence), the next script repeats them */
+size_t input_script_unread() {
+    return input.raw_len;
+}
+
+void input_push(uint16_t key) {
+    if (input.tail - input.head < INPUT_QUEUE) {
+        input.arrived[input.tail % INPUT_QUEUE] = now_us();
+        input.queue[input.tail ++ % INPUT_QUEUE] = key;
+    }
+}
+
+/* `final`: no more bytes are coming soon, so an incomplete sequence is just bytes */
+void input_decode(int final) {
+    int i = 0;
+    while (i < input.raw_len) {
+        if (input.raw[i] == 0x1b) {
+            int partial = 0, done = 0;
+            for (size_t k = 0; k < KEY_SEQ_COUNT && !done; ++ k) {
+                int m = strlen(key_seqs[k].seq);
+                int have = input.raw_len - i < m ? input.raw_len - i : m;
+                if (memcmp(input.raw + i, key_seqs[k].seq, have) != 0) continue;
+                if (have < m) {
+                    partial = 1;
+                } else if (input.map[key_seqs[k].key]) {
+                    input_push(input.map[key_seqs[k].key]);
+                    i += m;
+                    done = 1;
+                }
+            }
+            if (done) continue;
+            if (partial && !final) break; /* wait for the rest */
+        }
+        uint8_t b = input.raw[i ++];
+        input_push(input.map[b] ? input.map[b] : b);
+    }
+    memmove(input.raw, input.raw + i, input.raw_len - i);
+    input.raw_len -= i;
+}
+
+int input_read() {
+    if (input.script) {
+        size_t n = input.script_size - input.script_at;
+        if (n > (size_t) (INPUT_READ - input.raw_len)) n = INPUT_READ - input.raw_len;
+        memcpy(input.raw + input.raw_len, input.script + input.script_at, n);
+        input.script_at += n;
+        input.raw_len += n;
+        if (input.script_at == input.script_size && !input.script_more) input.eof = 1;
+        return n > 0;
+    }
+    ssize_t n = read(input_fd, input.raw + input.raw_len, INPUT_READ - input.raw_len);
+    if (n == 0) input.eof = 1;
+    if (n > 0) input.raw_len += n;
+    return n > 0;
+}
+
+/* stdin is readable: take what is there, and the rest of an escape sequence if it was cut */
+void input_fill() {
+    input_read();
+    input_decode(input.eof);
+    if (input.script) return; /* all of it is there, nothing to wait for */
+    if (input.raw_len && wait_key(ESC_WAIT_US)) input_read();
+    input_decode(1);
+}
+
+/* a key can be taken without blocking */
+int input_pending() {
+    return input.tail != input.head || input.eof;
+}
+
+/* wait up to `timeout_us` (-1 = forever, 0 = just look) for a key */
+int input_wait(int64_t timeout_us) {
+    if (input_pending()) return 1;
+    if (!input.script && !wait_key(timeout_us)) return 0;
+    input_fill();
+    return input_pending();
+}
+
+/* the script is used up but more was promised: nothing to give the guest now */
+int input_dry() {
+    if (!input.script || !input.script_more) return 0;
+    if (input.tail == input.head) input_fill();
+    return input.tail == input.head && input.script_at == input.script_size;
+}
+
+uint16_t input_pop() {
+    if (input.tail == input.head) return KEY_EOF;
+    if (metrics_self) metrics_key_wait(now_us() - input.arrived[input.head % INPUT_QUEUE]);
+    return input.queue[input.head ++ % INPUT_QUEUE];
+}
+
+/* "up=w,down=s,x=y": map named keys or single bytes to guest keys (a character or a number) */
+int input_parse_keymap(const char* spec) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", spec);
+    for (char* item = strtok(buf, ","); item; item = strtok(NULL, ",")) {
+        char* eq = strchr(item, '=');
+        if (!eq || eq == item || !eq[1]) return 0;
+        *eq = 0;
+        int from = -1;
+        if (strlen(item) == 1) from = (uint8_t) item[0];
+        for (size_t k = 0; k < KEY_SEQ_COUNT && from < 0; ++ k) {
+            if (strcmp(item, key_seqs[k].name) == 0) from = key_seqs[k].key;
+        }
+        if (from < 0) return 0;
+        const char* to = eq + 1;
+        input.map[from] = strlen(to) == 1 ? (uint8_t) to[0] : (uint16_t) strtol(to, NULL, 0);
+    }
+    return 1;
+}
+
+
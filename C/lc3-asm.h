@@ -0,0 +1,39 @@
+/*LC-3 instruction encoding, for programs assembled by hand in C*/
+
+#ifndef LC3_ASM_H
+#define LC3_ASM_H
+
+#include "lc3.h"
+
+/*
+    Each macro gives the 16-bit word of one instruction. Offsets are in words and relative to the
+    instruction after this one (the PC is already incremented when the offset is added):
+        offset = target - (address + 1)
+    so a branch back to itself is -1.
+*/
+#define ASM_ADD(dr, sr1, sr2)   ((OP_ADD << 12) | ((dr) << 9) | ((sr1) << 6) | (sr2))
+#define ASM_ADDI(dr, sr1, imm)  ((OP_ADD << 12) | ((dr) << 9) | ((sr1) << 6) | 0x20 | ((imm) & 0x1F))
+#define ASM_AND(dr, sr1, sr2)   ((OP_AND << 12) | ((dr) << 9) | ((sr1) << 6) | (sr2))
+#define ASM_ANDI(dr, sr1, imm)  ((OP_AND << 12) | ((dr) << 9) | ((sr1) << 6) | 0x20 | ((imm) & 0x1F))
+#define ASM_NOT(dr, sr)         ((OP_NOT << 12) | ((dr) << 9) | ((sr) << 6) | 0x3F)
+#define ASM_BR(nzp, off)        ((OP_BR << 12) | ((nzp) << 9) | ((off) & 0x1FF))
+#define ASM_JMP(base)           ((OP_JMP << 12) | ((base) << 6))
+#define ASM_RET                 ASM_JMP(R_R7)
+#define ASM_JSR(off)            ((OP_JSR << 12) | 0x800 | ((off) & 0x7FF))
+#define ASM_JSRR(base)          ((OP_JSR << 12) | ((base) << 6))
+#define ASM_LD(dr, off)         ((OP_LD << 12) | ((dr) << 9) | ((off) & 0x1FF))
+#define ASM_LDI(dr, off)        ((OP_LDI << 12) | ((dr) << 9) | ((off) & 0x1FF))
+#define ASM_LDR(dr, base, off)  ((OP_LDR << 12) | ((dr) << 9) | ((base) << 6) | ((off) & 0x3F))
+#define ASM_LEA(dr, off)        ((OP_LEA << 12) | ((dr) << 9) | ((off) & 0x1FF))
+#define ASM_ST(sr, off)         ((OP_ST << 12) | ((sr) << 9) | ((off) & 0x1FF))
+#define ASM_STI(sr, off)        ((OP_STI << 12) | ((sr) << 9) | ((off) & 0x1FF))
+#define ASM_STR(sr, base, off)  ((OP_STR << 12) | ((sr) << 9) | ((base) << 6) | ((off) & 0x3F))
+#define ASM_TRAP(vector)        ((OP_TRAP << 12) | ((vector) & 0xFF))
+
+/* the condition bits of ASM_BR */
+#define BR_N 4
+#define BR_Z 2
+#define BR_P 1
+#define BR_NZP 7
+
+#endif
@@ -0,0 +1,503 @@
+/*Batch runner for lc3-vm*/
+
+/*
+    Runs one program against many recorded sessions: each script file holds the keys of one session,
+    the guest gets them as if typed and then the end of input, and runs until it halts or its budget
+    is spent. For each script it reports the exit state, the instructions executed and a hash of
+    everything the guest printed.
+    The result only depends on the loaded memory, the keys and the budget, so it is remembered:
+    with --cache DIR a result is stored under a hash of the three, and the next batch that asks for
+    the same run reads it back instead of executing. --verify PCT runs that percentage of the hits
+    anyway and compares, a difference means the program (or the VM) is not deterministic and is
+    reported as MISMATCH, with exit status 1.
+
+    [Usage]: lc3-batch [options] --image FILE [--image FILE ...] SCRIPT...
+*/
+
+#include<stdio.h>
+#include<stdint.h>
+#include<string.h>
+/* unix only */
+#include<stdlib.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<sys/stat.h>
+
+#include "lc3.h"
+
+#define RUN_SLICE (1 << 22)
+#define IMAGES_MAX 16
+
+// RESULT CACHE
+/*
+    One file per result, DIR/<key>.res: the header, then the output. The key is FNV-1a over the
+    format and VM versions, the image hash, the keys and the budget; the header repeats what went
+    into it, so a collision reads as a miss. A result is written to a temporary file and renamed, so batches can share a cache.
+*/
+#define BATCH_MAGIC 0x5233434C /* "LC3R" */
+#define BATCH_VERSION 2
+
+struct batch_result {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t status;       /* VM_HALTED, VM_BUDGET, ... */
+    uint32_t vm_version;   /* LC3_VM_VERSION */
+    uint32_t reserved;
+    uint64_t image_hash;
+    uint64_t input_hash;
+    uint64_t budget;
+    uint64_t instructions;
+    uint64_t output_size;
+};
+
+struct batch_script {
+    const char* path;
+    char* keys;
+    size_t size;
+    struct batch_result r; /* from the cache, or of the run */
+    char* output;
+    int cached;            /* r and output came from the cache */
+    int run;               /* a miss, or a hit picked for verification */
+    const char* source;    /* for the report */
+    int next;              /* the next script ending on the same tree node, -1 = none */
+};
+struct {
+    const char* cache_dir;
+    const char* out_dir;
+    double verify;         /* percent of the hits that run anyway */
+    uint64_t budget;
+    const struct engine* engine;
+    int tree;              /* run the scripts as a prefix tree */
+    uint64_t image_hash;
+    struct batch_script* scripts;
+    int script_count;
+    uint64_t instructions; /* executed, shared prefixes once */
+    int runs, hits, verified, mismatches, failures;
+} batch;
+
+uint64_t batch_key(uint64_t input_hash) {
+    const uint32_t version[2] = { BATCH_VERSION, LC3_VM_VERSION };
+    uint64_t h = fnv1a(version, sizeof(version), FNV_OFFSET);
+    h = fnv1a(&batch.image_hash, sizeof(uint64_t), h);
+    h = fnv1a(&input_hash, sizeof(uint64_t), h);
+    return fnv1a(&batch.budget, sizeof(uint64_t), h);
+}
+
+void batch_path(char* path, size_t size, uint64_t key, const char* suffix) {
+    snprintf(path, size, "%s/%016llx%s", batch.cache_dir, (unsigned long long) key, suffix);
+}
+
+/* the stored result for `r->input_hash` and its output, allocated; 0 on a miss */
+int batch_lookup(struct batch_result* r, char** output) {
+    if (!batch.cache_dir) return 0;
+    char path[4096];
+    batch_path(path, sizeof(path), batch_key(r->input_hash), ".res");
+    FILE* file = fopen(path, "rb");
+    if (!file) return 0;
+    struct batch_result h;
+    int ok = fread(&h, sizeof(h), 1, file) == 1 && h.magic == BATCH_MAGIC && h.version == BATCH_VERSION &&
+        h.vm_version == LC3_VM_VERSION && h.image_hash == batch.image_hash && h.input_hash == r->input_hash && h.budget == batch.budget;
+    char* data = ok ? malloc(h.output_size + 1) : NULL;
+    ok = data && fread(data, 1, h.output_size, file) == h.output_size;
+    fclose(file);
+    if (!ok) {
+        free(data);
+        return 0;
+    }
+    *r = h;
+    *output = data;
+    return 1;
+}
+
+void batch_store(const struct batch_result* r, const char* output) {
+    if (!batch.cache_dir) return;
+    char tmp[4096], path[4096];
+    uint64_t key = batch_key(r->input_hash);
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%d.tmp", (int) getpid());
+    batch_path(tmp, sizeof(tmp), key, suffix);
+    batch_path(path, sizeof(path), key, ".res");
+    FILE* file = fopen(tmp, "wb");
+    if (!file) return;
+    fwrite(r, sizeof(*r), 1, file);
+    fwrite(output, 1, r->output_size, file);
+    if (fclose(file) == 0) rename(tmp, path); else unlink(tmp);
+}
+
+// RUNNING
+
+/* run until the guest halts, spends the budget or wants a key the script does not have */
+int batch_run(struct vm* vm) {
+    int status;
+    do {
+        uint64_t left = batch.budget - vm->instructions;
+        status = batch.engine->run(vm, left < RUN_SLICE ? left : RUN_SLICE);
+    } while (status == VM_BUDGET && vm->instructions < batch.budget);
+    return status;
+}
+
+/* `vm` finished the run of `s`, with what was captured as its output */
+void batch_done(struct batch_script* s, struct vm* vm, int status) {
+    size_t size;
+    const char* output = out_captured(&size);
+    struct batch_result r = { BATCH_MAGIC, BATCH_VERSION, status, LC3_VM_VERSION, 0, batch.image_hash,
+        s->r.input_hash, batch.budget, vm->instructions, size };
+    batch.runs ++;
+    if (s->cached) {
+        batch.verified ++;
+        s->source = "verified";
+        if (r.status != s->r.status || r.instructions != s->r.instructions ||
+            r.output_size != s->r.output_size || memcmp(output, s->output, size) != 0) {
+            s->source = "MISMATCH";
+            batch.mismatches ++;
+        }
+        return;
+    }
+    s->r = r;
+    s->output = malloc(size + 1);
+    if (!s->output) {
+        printf("Failed to allocate memory\n");
+        exit(1);
+    }
+    memcpy(s->output, output, size);
+    s->source = "run";
+    batch_store(&s->r, s->output);
+}
+
+/* every script on its own VM */
+void batch_run_each() {
+    for (int i = 0; i < batch.script_count; ++ i) {
+        struct batch_script* s = &batch.scripts[i];
+        if (!s->run) continue;
+        struct vm* vm = vm_create();
+        if (!vm) {
+            printf("Failed to allocate memory\n");
+            exit(1);
+        }
+        input_script(s->keys, s->size, 0);
+        out_capture_truncate(0);
+        int status = batch_run(vm);
+        batch.instructions += vm->instructions;
+        batch_done(s, vm, status);
+        vm_destroy(vm);
+    }
+}
+
+// PREFIX TREE
+/*
+    With --tree the scripts to run go into a radix tree first, an edge for each run of keys that a
+    group of scripts has in common, and each edge is run once:
+    - the root's VM starts the program and runs until it asks for a key that no script agrees on
+      (the script of an edge ends with more promised, so the guest stops there with VM_INPUT)
+    - the VM is then forked, one copy for each child edge and one for the scripts ending at the
+      node, sharing all of its pages copy-on-write (vm_fork), and each copy goes on with its keys
+    - a VM that halts or spends its budget before the end of its edge is the result of every
+      script below it
+    The guest cannot tell: it stops before the instruction that asked, and the copies run that
+    instruction again with the next key there, exactly as in a run of the whole script. So the
+    work grows with the number of distinct edges instead of the total length of the scripts.
+*/
+struct tree_node {
+    int child, sibling;    /* first child, next sibling, -1 = none */
+    int script;            /* whose keys label the edge into this node */
+    size_t from, to;       /* the edge is those keys [from, to), `to` is the node's depth */
+    int ends;              /* first script ending here, -1 = none */
+};
+
+struct {
+    struct tree_node* nodes;
+    int count, cap;
+    int forks;
+} tree;
+
+int tree_node_new(int script, size_t from, size_t to) {
+    if (tree.count == tree.cap) {
+        tree.cap = tree.cap ? tree.cap * 2 : 64;
+        tree.nodes = realloc(tree.nodes, tree.cap * sizeof(struct tree_node));
+        if (!tree.nodes) {
+            printf("Failed to allocate memory\n");
+            exit(1);
+        }
+    }
+    struct tree_node* n = &tree.nodes[tree.count];
+    n->child = n->sibling = n->ends = -1;
+    n->script = script;
+    n->from = from;
+    n->to = to;
+    return tree.count ++;
+}
+
+const char* tree_keys(int n) {
+    return tree.nodes[n].script < 0 ? "" : batch.scripts[tree.nodes[n].script].keys;
+}
+
+void tree_insert(int i) {
+    struct batch_script* s = &batch.scripts[i];
+    int node = 0;
+    size_t depth = 0;
+    for (;;) {
+        if (depth == s->size) {
+            s->next = tree.nodes[node].ends;
+            tree.nodes[node].ends = i;
+            return;
+        }
+        int* link = &tree.nodes[node].child;
+        while (*link >= 0 && tree_keys(*link)[tree.nodes[*link].from] != s->keys[depth]) link = &tree.nodes[*link].sibling;
+        if (*link < 0) {
+            /* nobody went this way: a leaf with the rest of the keys */
+            int leaf = tree_node_new(i, depth, s->size);
+            *link = leaf;
+            s->next = -1;
+            tree.nodes[leaf].ends = i;
+            return;
+        }
+        int c = *link;
+        const char* keys = tree_keys(c);
+        size_t at = tree.nodes[c].from;
+        while (at < tree.nodes[c].to && depth < s->size && keys[at] == s->keys[depth]) {
+            ++ at;
+            ++ depth;
+        }
+        if (at < tree.nodes[c].to) {
+            /* the script leaves the edge halfway: split it there */
+            int mid = tree_node_new(tree.nodes[c].script, tree.nodes[c].from, at);
+            tree.nodes[mid].child = c;
+            tree.nodes[mid].sibling = tree.nodes[c].sibling;
+            tree.nodes[c].sibling = -1;
+            tree.nodes[c].from = at;
+            *link = mid;
+            c = mid;
+        }
+        node = c;
+    }
+}
+
+/* the VM stopped for good: that is the result of every script at or below `n` */
+void tree_done(int n, struct vm* vm, int status) {
+    for (int i = tree.nodes[n].ends; i >= 0; i = batch.scripts[i].next) batch_done(&batch.scripts[i], vm, status);
+    for (int c = tree.nodes[n].child; c >= 0; c = tree.nodes[c].sibling) tree_done(c, vm, status);
+}
+
+struct vm* tree_fork(struct vm* vm) {
+    struct vm* copy = vm_fork(vm);
+    if (!copy) {
+        printf("Failed to allocate memory\n");
+        exit(1);
+    }
+    tree.forks ++;
+    return copy;
+}
+
+/* run the edge into `n` on `vm`, which is where its parent stopped with `unread` keys taken but not decoded */
+void tree_run(int n, struct vm* vm, size_t unread) {
+    struct tree_node* node = &tree.nodes[n];
+    const char* keys = tree_keys(n);
+    input_script(keys + node->from - unread, node->to - node->from + unread, node->child >= 0);
+    uint64_t before = vm->instructions;
+    int status = batch_run(vm);
+    batch.instructions += vm->instructions - before;
+    if (status != VM_INPUT) {
+        tree_done(n, vm, status);
+        vm_destroy(vm);
+        return;
+    }
+
+    /* every way on starts from here, the last one takes the VM itself */
+    size_t output_size;
+    out_captured(&output_size);
+    unread = input_script_unread();
+    int ways = node->ends >= 0;
+    for (int c = node->child; c >= 0; c = tree.nodes[c].sibling) ++ ways;
+    if (node->ends >= 0) {
+        struct vm* copy = -- ways ? tree_fork(vm) : vm;
+        input_script(keys + node->to - unread, unread, 0);
+        before = copy->instructions;
+        status = batch_run(copy);
+        batch.instructions += copy->instructions - before;
+        for (int i = node->ends; i >= 0; i = batch.scripts[i].next) batch_done(&batch.scripts[i], copy, status);
+        vm_destroy(copy);
+        out_capture_truncate(output_size);
+    }
+    for (int c = node->child; c >= 0; c = tree.nodes[c].sibling) {
+        tree_run(c, -- ways ? tree_fork(vm) : vm, unread);
+        out_capture_truncate(output_size);
+    }
+}
+
+void batch_run_tree() {
+    tree_node_new(-1, 0, 0);
+    int runs = 0;
+    for (int i = 0; i < batch.script_count; ++ i) {
+        if (!batch.scripts[i].run) continue;
+        tree_insert(i);
+        ++ runs;
+    }
+    if (!runs) return;
+    struct vm* vm = vm_create();
+    if (!vm) {
+        printf("Failed to allocate memory\n");
+        exit(1);
+    }
+    out_capture_truncate(0);
+    tree_run(0, vm, 0);
+}
+
+// REPORT
+void batch_save_output(const char* script, const char* output, size_t size) {
+    if (!batch.out_dir) return;
+    const char* name = strrchr(script, '/');
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s.out", batch.out_dir, name ? name + 1 : script);
+    FILE* file = fopen(path, "wb");
+    if (!file || fwrite(output, 1, size, file) != size || fclose(file) != 0) {
+        fprintf(stderr, "Failed to write %s\n", path);
+        batch.failures ++;
+    }
+}
+
+char* read_file(const char* path, size_t* size) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return NULL;
+    fseek(file, 0, SEEK_END);
+    long n = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* data = malloc(n > 0 ? n : 1);
+    if (!data || fread(data, 1, n, file) != (size_t) n) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    *size = n;
+    return data;
+}
+
+/* read the script and look it up: whether it has to run is decided here */
+void batch_prepare(struct batch_script* s) {
+    s->keys = read_file(s->path, &s->size);
+    if (!s->keys) {
+        batch.failures ++;
+        return;
+    }
+    s->r.input_hash = fnv1a(s->keys, s->size, FNV_OFFSET);
+    if (batch_lookup(&s->r, &s->output)) {
+        batch.hits ++;
+        s->cached = 1;
+        s->source = "cached";
+        s->run = batch.verify > 0 && rand() % 10000 < batch.verify * 100;
+    } else {
+        s->run = 1;
+    }
+}
+
+/* one line of the report: script, exit state, instructions, output hash, where the result came from */
+void batch_report(FILE* report, struct batch_script* s) {
+    if (!s->keys) {
+        fprintf(report, "%-24s failed to read\n", s->path);
+        return;
+    }
+    batch_save_output(s->path, s->output, s->r.output_size);
+    fprintf(report, "%-24s %-9s %14llu %016llx %s\n", s->path, vm_status_name(s->r.status),
+        (unsigned long long) s->r.instructions, (unsigned long long) fnv1a(s->output, s->r.output_size, FNV_OFFSET),
+        s->source);
+}
+
+void usage() {
+    printf("[Usage]: lc3-batch [options] --image FILE [--image FILE ...] SCRIPT...\n");
+    printf("  --image FILE       load this image, in order, before every run\n");
+    printf("  --budget M         million guest instructions per script at most (default 100)\n");
+    printf("  --engine NAME      run with engine NAME: switch (default) or threaded\n");
+    printf("  --cache DIR        keep results in DIR and reuse them for the same image, keys and budget\n");
+    printf("  --verify PCT       run PCT percent of the cached results again and compare\n");
+    printf("  --tree             run the keys scripts start with in common once, forking where they differ\n");
+    printf("  --out DIR          write what each script printed to DIR/SCRIPT.out\n");
+    exit(2);
+}
+
+int main(int argc, const char* argv[]) {
+    const char* images[IMAGES_MAX];
+    int image_count = 0;
+    batch.budget = 100;
+    batch.engine = &engines[0];
+    int j = 1;
+    for (; j < argc && strncmp(argv[j], "--", 2) == 0; ++ j) {
+        if (strcmp(argv[j], "--image") == 0 && j + 1 < argc && image_count < IMAGES_MAX) {
+            images[image_count ++] = argv[++ j];
+        } else if (strcmp(argv[j], "--budget") == 0 && j + 1 < argc) {
+            batch.budget = strtoull(argv[++ j], NULL, 10);
+        } else if (strcmp(argv[j], "--engine") == 0 && j + 1 < argc) {
+            ++ j;
+            batch.engine = NULL;
+            for (int e = 0; e < engine_count; ++ e) {
+                if (strcmp(argv[j], engines[e].name) == 0) batch.engine = &engines[e];
+            }
+            if (!batch.engine) {
+                printf("Unknown engine: %s\n", argv[j]);
+                exit(2);
+            }
+        } else if (strcmp(argv[j], "--cache") == 0 && j + 1 < argc) {
+            batch.cache_dir = argv[++ j];
+        } else if (strcmp(argv[j], "--verify") == 0 && j + 1 < argc) {
+            batch.verify = atof(argv[++ j]);
+        } else if (strcmp(argv[j], "--tree") == 0) {
+            batch.tree = 1;
+        } else if (strcmp(argv[j], "--out") == 0 && j + 1 < argc) {
+            batch.out_dir = argv[++ j];
+        } else {
+            usage();
+        }
+    }
+    if (!image_count || j >= argc || batch.budget == 0) usage();
+    batch.budget *= 1000000;
+    if (batch.cache_dir) mkdir(batch.cache_dir, 0777);
+    if (batch.out_dir) mkdir(batch.out_dir, 0777);
+
+    if (!image_alloc()) {
+        printf("Failed to allocate memory\n");
+        exit(1);
+    }
+    for (int i = 0; i < image_count; ++ i) {
+        if (!read_image(images[i])) {
+            printf("Failed to load image: %s\n", images[i]);
+            exit(1);
+        }
+    }
+    image_seal();
+    /* the whole memory as loaded, so the order of the images and where they overlap count too */
+    batch.image_hash = fnv1a(image, MEMORY_MAX * sizeof(uint16_t), FNV_OFFSET);
+    srand(now_us());
+
+    /* the guest's output is only captured, the report goes to the real stdout */
+    FILE* report = fdopen(dup(STDOUT_FILENO), "w");
+    int null = open("/dev/null", O_WRONLY);
+    if (!report || null < 0) {
+        printf("Failed to redirect the guest's output\n");
+        exit(1);
+    }
+    fflush(stdout);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+    string_kernels_init();
+
+    batch.script_count = argc - j;
+    batch.scripts = calloc(batch.script_count, sizeof(struct batch_script));
+    if (!batch.scripts) {
+        printf("Failed to allocate memory\n");
+        exit(1);
+    }
+    uint64_t start = now_us();
+    for (int i = 0; i < batch.script_count; ++ i) {
+        batch.scripts[i].path = argv[j + i];
+        batch_prepare(&batch.scripts[i]);
+    }
+    out_capture(1);
+    if (batch.tree) batch_run_tree(); else batch_run_each();
+    out_capture(0);
+    for (int i = 0; i < batch.script_count; ++ i) batch_report(report, &batch.scripts[i]);
+    fflush(report);
+    fprintf(stderr, "lc3-batch: %d scripts, %d from the cache, %d runs (%d to verify), %d mismatched, "
+        "%llu instructions executed, %.1f ms\n", batch.script_count, batch.hits, batch.runs, batch.verified,
+        batch.mismatches, (unsigned long long) batch.instructions, (now_us() - start) / 1000.0);
+    if (batch.tree) fprintf(stderr, "lc3-batch: prefix tree of %d nodes, %d forks\n", tree.count, tree.forks);
+    fclose(report);
+    return batch.mismatches || batch.failures ? 1 : 0;
+}
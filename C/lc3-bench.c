@@ -0,0 +1,456 @@
+/*Benchmark suite for lc3-vm*/
+
+/*
+    Runs a fixed mix of workloads through the VM library and reports millions of guest instructions per second:
+    - the bundled games, 2048.obj and rogue.obj, playing a scripted sequence of keys
+    - small hand-assembled kernels, each stressing one part of the dispatch loop
+    - a parallel kernel, on one core and on several (--cores), for the speedup of the multi-core mode
+    The PGO build trains on exactly this run, so the profile sees the same mix that is measured.
+    With --check the kernels' results are compared against C and the exit status tells whether they matched,
+    this is what ctest runs.
+
+    [Usage]: lc3-bench [--images DIR] [--budget MILLIONS] [--rounds N] [--cores N] [--check]
+*/
+
+#include<stdio.h>
+#include<stdint.h>
+#include<string.h>
+#include<math.h>
+/* unix only */
+#include<stdlib.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<time.h>
+
+#include "lc3.h"
+#include "lc3-asm.h"
+
+// KERNELS
+/*
+    Every kernel starts at PC_START, loops N times and halts. The word at `n_at` holds N,
+    so the same code serves the short --check run and the long measured one.
+*/
+const uint16_t kernel_alu[] = {
+    ASM_LD(R_R1, 7),             /* 0: R1 = N */
+    ASM_ADD(R_R0, R_R0, R_R1),   /* 1: loop */
+    ASM_ANDI(R_R2, R_R0, 7),
+    ASM_ADD(R_R0, R_R0, R_R2),
+    ASM_NOT(R_R3, R_R0),
+    ASM_ADDI(R_R1, R_R1, -1),
+    ASM_BR(BR_P, -6),            /* 6: back to 1 */
+    ASM_TRAP(TRAP_HALT),
+    0                            /* 8: N */
+};
+
+const uint16_t kernel_memory[] = {
+    ASM_LD(R_R4, 16),            /* 0: R4 = BASE */
+    ASM_LD(R_R1, 16),            /* 1: R1 = N */
+    ASM_ADD(R_R2, R_R1, R_R1),   /* 2: fill, BASE[k] = 3 * (N - k) */
+    ASM_ADD(R_R2, R_R2, R_R1),
+    ASM_STR(R_R2, R_R4, 0),
+    ASM_ADDI(R_R4, R_R4, 1),
+    ASM_ADDI(R_R1, R_R1, -1),
+    ASM_BR(BR_P, -6),            /* 7: back to 2 */
+    ASM_LD(R_R4, 8),             /* 8: R4 = BASE */
+    ASM_LD(R_R1, 8),             /* 9: R1 = N */
+    ASM_ANDI(R_R0, R_R0, 0),
+    ASM_LDR(R_R2, R_R4, 0),      /* 11: sum */
+    ASM_ADD(R_R0, R_R0, R_R2),
+    ASM_ADDI(R_R4, R_R4, 1),
+    ASM_ADDI(R_R1, R_R1, -1),
+    ASM_BR(BR_P, -5),            /* 15: back to 11 */
+    ASM_TRAP(TRAP_HALT),
+    0x4000,                      /* 17: BASE */
+    0                            /* 18: N */
+};
+
+const uint16_t kernel_calls[] = {
+    ASM_LD(R_R1, 4),             /* 0: R1 = N */
+    ASM_JSR(4),                  /* 1: loop, call 6 */
+    ASM_ADDI(R_R1, R_R1, -1),
+    ASM_BR(BR_P, -3),            /* 3: back to 1 */
+    ASM_TRAP(TRAP_HALT),
+    0,                           /* 5: N */
+    ASM_ADDI(R_R0, R_R0, 3),     /* 6: the subroutine */
+    ASM_RET
+};
+
+const uint16_t kernel_indirect[] = {
+    ASM_LD(R_R1, 8),             /* 0: R1 = N */
+    ASM_LDI(R_R2, 6),            /* 1: loop, R2 = *PTR */
+    ASM_ADDI(R_R2, R_R2, 1),
+    ASM_STI(R_R2, 4),            /* 3: *PTR = R2 */
+    ASM_ADDI(R_R1, R_R1, -1),
+    ASM_BR(BR_P, -5),            /* 5: back to 1 */
+    ASM_LDI(R_R0, 1),            /* 6: R0 = *PTR */
+    ASM_TRAP(TRAP_HALT),
+    0x5000,                      /* 8: PTR */
+    0                            /* 9: N */
+};
+
+const uint16_t kernel_strings[] = {
+    ASM_LD(R_R1, 5),             /* 0: R1 = N */
+    ASM_LEA(R_R0, 5),            /* 1: loop, R0 = STR */
+    ASM_TRAP(TRAP_PUTS),
+    ASM_ADDI(R_R1, R_R1, -1),
+    ASM_BR(BR_P, -4),            /* 4: back to 1 */
+    ASM_TRAP(TRAP_HALT),
+    0,                           /* 6: N */
+    'h', 'e', 'l', 'l', 'o', ',', ' ', 'w', 'o', 'r', 'l', 'd', '\n', 0 /* 7: STR */
+};
+
+/*
+    Every core runs the loop of kernel_alu ROUNDS times and adds its result to TOTAL with the atomic
+    device, then counts itself in DONE; core 0 waits for all of them before it halts. The rounds are
+    split between the cores, so the same work is done on one core or on many.
+*/
+const uint16_t kernel_parallel[] = {
+    ASM_LD(R_R4, 26),            /* 0: atomics on TOTAL */
+    ASM_STI(R_R4, 29),
+    ASM_LD(R_R7, 27),            /* 2: R7 = ROUNDS */
+    ASM_ANDI(R_R0, R_R0, 0),
+    ASM_LD(R_R1, 24),            /* 4: round, R1 = N */
+    ASM_ADD(R_R0, R_R0, R_R1),   /* 5: loop */
+    ASM_ANDI(R_R2, R_R0, 7),
+    ASM_ADD(R_R0, R_R0, R_R2),
+    ASM_ADDI(R_R1, R_R1, -1),
+    ASM_BR(BR_P, -5),            /* 9: back to 5 */
+    ASM_ADDI(R_R7, R_R7, -1),
+    ASM_BR(BR_P, -8),            /* 11: back to 4 */
+    ASM_STI(R_R0, 19),           /* 12: TOTAL += R0 */
+    ASM_LD(R_R4, 14),            /* 13: atomics on DONE */
+    ASM_STI(R_R4, 16),
+    ASM_ANDI(R_R3, R_R3, 0),
+    ASM_ADDI(R_R3, R_R3, 1),
+    ASM_STI(R_R3, 14),           /* 17: DONE += 1 */
+    ASM_LDI(R_R6, 14),           /* 18: core 0 waits, the others halt */
+    ASM_BR(BR_NZP ^ BR_Z, 6),
+    ASM_LDI(R_R5, 13),           /* 20: R5 = -cores */
+    ASM_NOT(R_R5, R_R5),
+    ASM_ADDI(R_R5, R_R5, 1),
+    ASM_LDI(R_R3, 8),            /* 23: wait, R3 = DONE (an atomic load) */
+    ASM_ADD(R_R3, R_R3, R_R5),
+    ASM_BR(BR_N, -3),            /* 25: back to 23 */
+    ASM_TRAP(TRAP_HALT),
+    0x4000,                      /* 27: TOTAL */
+    0x4001,                      /* 28: DONE */
+    0,                           /* 29: N */
+    0,                           /* 30: ROUNDS */
+    MR_ATOMIC_ADDR,
+    MR_ATOMIC_FADD,
+    MR_CORE_ID,
+    MR_CORE_COUNT
+};
+#define PARALLEL_N 29
+#define PARALLEL_ROUNDS 30
+
+/* the expected results, computed the long way */
+int check_alu(struct vm* vm, uint16_t n) {
+    uint16_t r0 = 0;
+    for (uint16_t r1 = n; r1; -- r1) {
+        r0 += r1;
+        r0 += r0 & 7;
+    }
+    uint16_t r3 = ~r0;
+    return vm->reg[R_R0] == r0 && vm->reg[R_R3] == r3 && vm->reg[R_R1] == 0;
+}
+
+int check_memory(struct vm* vm, uint16_t n) {
+    uint16_t sum = 0;
+    for (uint16_t k = 0; k < n; ++ k) {
+        uint16_t expected = 3 * (n - k);
+        if (mem_read(vm, 0x4000 + k) != expected) return 0;
+        sum += expected;
+    }
+    return vm->reg[R_R0] == sum;
+}
+
+int check_calls(struct vm* vm, uint16_t n) {
+    return vm->reg[R_R0] == (uint16_t) (3 * n) && vm->reg[R_R1] == 0;
+}
+
+int check_indirect(struct vm* vm, uint16_t n) {
+    return vm->reg[R_R0] == n && mem_read(vm, 0x5000) == n;
+}
+
+int check_strings(struct vm* vm, uint16_t n) {
+    (void) n;
+    return vm->reg[R_R0] == PC_START + 7 && vm->reg[R_R1] == 0;
+}
+
+/* what TOTAL holds once `cores` cores ran `rounds` rounds each */
+uint16_t parallel_total(int cores, uint16_t n, uint16_t rounds) {
+    uint16_t r0 = 0;
+    for (uint16_t round = 0; round < rounds; ++ round) {
+        for (uint16_t r1 = n; r1; -- r1) {
+            r0 += r1;
+            r0 += r0 & 7;
+        }
+    }
+    return (uint16_t) (cores * r0);
+}
+
+#define KERNEL(name, n_at, slow) { #name, kernel_##name, sizeof(kernel_##name) / sizeof(uint16_t), n_at, slow, check_##name }
+
+const struct kernel {
+    const char* name;
+    const uint16_t* code;
+    size_t size;
+    size_t n_at;
+    int slow;          /* spends its time in the host, not the dispatch loop: a tenth of the budget is enough */
+    int (*check)(struct vm* vm, uint16_t n);
+} kernels[] = {
+    KERNEL(alu, 8, 0),
+    KERNEL(memory, 18, 0),
+    KERNEL(calls, 5, 0),
+    KERNEL(indirect, 9, 0),
+    KERNEL(strings, 6, 1),
+};
+#define KERNEL_COUNT (sizeof(kernels) / sizeof(kernels[0]))
+
+// GAMES
+/* the keys a player types, after the script ends the guest sees the end of input */
+const struct {
+    const char* file;
+    const char* keys;
+} games[] = {
+    { "2048.obj", "ywasdwasdwasdwwwwsssaaaaddddwdsawdsawdsaasdwsadwsssaaawww" },
+    { "rogue.obj", "xwwwdddssssaaaddddssssdddwwwaaaaddssdddwwwwddddssssaaaa" },
+};
+#define GAME_COUNT (sizeof(games) / sizeof(games[0]))
+
+// RUNNING
+/*
+    Time is the CPU time of the thread, not the wall clock: on a busy or virtualised host the wall clock
+    also counts the time other processes had the CPU, which is most of the noise between runs.
+*/
+uint64_t cpu_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct result {
+    uint64_t instructions;
+    uint64_t us;
+    int ok;
+};
+
+/* a fresh image holding only the kernel, at PC_START */
+void load_kernel(const struct kernel* k, uint16_t n) {
+    uint16_t code[64];
+    memcpy(code, k->code, k->size * sizeof(uint16_t));
+    code[k->n_at] = n;
+    if (!image_alloc()) {
+        printf("Failed to allocate memory\n");
+        exit(1);
+    }
+    image_load_words(PC_START, code, k->size);
+    image_seal();
+}
+
+/* run the kernel to its halt again and again until `budget` instructions are spent */
+struct result run_kernel(const struct kernel* k, uint16_t n, uint64_t budget) {
+    struct result r = { 0, 0, 1 };
+    load_kernel(k, n);
+    if (k->slow) budget /= 10;
+    while (r.instructions < budget) {
+        struct vm* vm = vm_create();
+        if (!vm) {
+            printf("Failed to allocate memory\n");
+            exit(1);
+        }
+        uint64_t start = cpu_us();
+        int status = vm_run(vm, budget - r.instructions);
+        r.us += cpu_us() - start;
+        r.instructions += vm->instructions;
+        if (status == VM_HALTED && !k->check(vm, n)) r.ok = 0;
+        vm_destroy(vm);
+    }
+    image_free();
+    return r;
+}
+
+/* play the game with its script on a pipe for `budget` instructions, or until it quits */
+struct result run_game(const char* dir, int g, uint64_t budget) {
+    struct result r = { 0, 0, 0 };
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, games[g].file);
+    if (!image_alloc()) {
+        printf("Failed to allocate memory\n");
+        exit(1);
+    }
+    if (!read_image(path)) {
+        image_free();
+        return r;
+    }
+    image_seal();
+
+    int fds[2];
+    if (pipe(fds) != 0) {
+        image_free();
+        return r;
+    }
+    size_t len = strlen(games[g].keys);
+    r.ok = write(fds[1], games[g].keys, len) == (ssize_t) len;
+    close(fds[1]);
+    input_open(fds[0]);
+
+    struct vm* vm = vm_create();
+    if (!vm) {
+        printf("Failed to allocate memory\n");
+        exit(1);
+    }
+    uint64_t start = cpu_us();
+    vm_run(vm, budget);
+    r.us = cpu_us() - start;
+    r.instructions = vm->instructions;
+    vm_destroy(vm);
+    close(fds[0]);
+    image_free();
+    return r;
+}
+
+/* the wall clock, for the parallel kernel: the CPU time of one thread misses the others */
+uint64_t wall_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* the parallel kernel to its halt on `cores` cores, `rounds` rounds split between them */
+struct result run_parallel(int cores, uint16_t n, uint16_t rounds) {
+    struct result r = { 0, 0, 1 };
+    uint16_t code[64];
+    size_t size = sizeof(kernel_parallel) / sizeof(uint16_t);
+    memcpy(code, kernel_parallel, sizeof(kernel_parallel));
+    code[PARALLEL_N] = n;
+    code[PARALLEL_ROUNDS] = rounds / cores;
+    if (!image_alloc()) {
+        printf("Failed to allocate memory\n");
+        exit(1);
+    }
+    image_load_words(PC_START, code, size);
+    image_seal();
+    struct vm* vm = smp_create(cores);
+    if (!vm) {
+        printf("Failed to allocate memory\n");
+        exit(1);
+    }
+    uint64_t start = wall_us();
+    r.ok = smp_run(&engines[0]);
+    r.us = wall_us() - start;
+    /* core 0's waiting counts too, it is small next to the work */
+    for (int c = 0; c < cores; ++ c) r.instructions += smp_core(c)->instructions;
+    r.ok = r.ok && mem_read(vm, 0x4000) == parallel_total(cores, n, rounds / cores) &&
+        mem_read(vm, 0x4001) == cores;
+    smp_destroy();
+    image_free();
+    return r;
+}
+
+double mips(struct result r) {
+    return r.us ? (double) r.instructions / r.us : 0.0;
+}
+
+void usage() {
+    printf("[Usage]: lc3-bench [--images DIR] [--budget MILLIONS] [--rounds N] [--cores N] [--check]\n");
+    printf("  --images DIR       where 2048.obj and rogue.obj are (default .)\n");
+    printf("  --budget M         million guest instructions per workload (default 50)\n");
+    printf("  --rounds N         run everything N times and keep the best (default 3)\n");
+    printf("  --cores N          cores for the parallel kernel (default 4)\n");
+    printf("  --check            short run that only verifies the kernels' results\n");
+    exit(2);
+}
+
+int main(int argc, const char* argv[]) {
+    const char* dir = ".";
+    uint64_t budget = 50;
+    int rounds = 3;
+    int check = 0;
+    int cores = 4;
+    for (int j = 1; j < argc; ++ j) {
+        if (strcmp(argv[j], "--images") == 0 && j + 1 < argc) {
+            dir = argv[++ j];
+        } else if (strcmp(argv[j], "--budget") == 0 && j + 1 < argc) {
+            budget = strtoull(argv[++ j], NULL, 10);
+        } else if (strcmp(argv[j], "--rounds") == 0 && j + 1 < argc) {
+            rounds = atoi(argv[++ j]);
+        } else if (strcmp(argv[j], "--cores") == 0 && j + 1 < argc) {
+            cores = atoi(argv[++ j]);
+        } else if (strcmp(argv[j], "--check") == 0) {
+            check = 1;
+        } else {
+            usage();
+        }
+    }
+    if (budget == 0 || rounds <= 0 || cores < 1 || cores > SMP_MAX) usage();
+    budget *= 1000000;
+    /* N: long enough that creating the VM does not show in the measurement */
+    uint16_t n = 30000;
+    if (check) {
+        budget = 1000000;
+        rounds = 1;
+        n = 1000;
+    }
+
+    /* the guest's output goes nowhere, the report goes to the real stdout */
+    FILE* report = fdopen(dup(STDOUT_FILENO), "w");
+    int null = open("/dev/null", O_WRONLY);
+    if (!report || null < 0) {
+        printf("Failed to redirect the guest's output\n");
+        exit(1);
+    }
+    fflush(stdout);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+    string_kernels_init();
+
+    struct result best[GAME_COUNT + KERNEL_COUNT] = {0};
+    struct result parallel[2] = {0}; /* on one core, on `cores` */
+    /* about the budget in rounds of N, a multiple of the cores; R7 counts them down with BRp */
+    uint64_t parallel_rounds = budget / (5 * (uint64_t) n);
+    if (parallel_rounds > 0x7FFF) parallel_rounds = 0x7FFF;
+    parallel_rounds -= parallel_rounds % cores;
+    if (parallel_rounds == 0) parallel_rounds = cores;
+    for (int round = 0; round < rounds; ++ round) {
+        for (size_t i = 0; i < GAME_COUNT + KERNEL_COUNT; ++ i) {
+            struct result r = i < GAME_COUNT ? run_game(dir, i, budget) : run_kernel(&kernels[i - GAME_COUNT], n, budget);
+            if (round == 0 || mips(r) > mips(best[i])) best[i] = r;
+            if (!r.ok) best[i].ok = 0;
+        }
+        for (int i = 0; i < 2; ++ i) {
+            struct result r = run_parallel(i ? cores : 1, n, parallel_rounds);
+            if (round == 0 || r.us < parallel[i].us) parallel[i] = r;
+            if (!r.ok) parallel[i].ok = 0;
+        }
+    }
+
+    int failed = 0;
+    double log_sum = 0;
+    fprintf(report, "%-12s %14s %10s %9s\n", "workload", "instructions", "ms", "MIPS");
+    for (size_t i = 0; i < GAME_COUNT + KERNEL_COUNT; ++ i) {
+        const char* name = i < GAME_COUNT ? games[i].file : kernels[i - GAME_COUNT].name;
+        struct result r = best[i];
+        fprintf(report, "%-12s %14llu %10.1f %9.1f%s\n", name, (unsigned long long) r.instructions,
+            r.us / 1000.0, mips(r), r.ok ? "" : "  FAILED");
+        if (!r.ok) failed = 1;
+        /* geometric mean of the MIPS, so no single workload dominates */
+        log_sum += r.us && r.instructions ? log(mips(r)) : 0;
+    }
+    fprintf(report, "%-12s %14s %10s %9.1f\n", "geomean", "", "",
+        exp(log_sum / (GAME_COUNT + KERNEL_COUNT)));
+    /* the parallel kernel is timed by the wall clock and left out of the geomean */
+    for (int i = 0; i < 2; ++ i) {
+        char name[32];
+        snprintf(name, sizeof(name), "parallel x%d", i ? cores : 1);
+        struct result r = parallel[i];
+        fprintf(report, "%-12s %14llu %10.1f %9.1f%s\n", name, (unsigned long long) r.instructions,
+            r.us / 1000.0, mips(r), r.ok ? "" : "  FAILED");
+        if (!r.ok) failed = 1;
+    }
+    fprintf(report, "%-12s %14s %10s %8.2fx\n", "speedup", "", "",
+        parallel[1].us ? (double) parallel[0].us / parallel[1].us : 0.0);
+    fclose(report);
+    return failed;
+}
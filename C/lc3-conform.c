@@ -0,0 +1,1114 @@
+/*ISA conformance suite for the lc3-vm engines*/
+
+/*
+    Checks that every engine in `engines` runs the LC-3 exactly like the reference switch in vm_run:
+    - hand-assembled tests, one group per opcode and trap vector, for the corners that are easy to get
+      wrong: sign extension of every offset size, 16-bit wraparound of PC arithmetic, LEA setting the
+      flags, JSRR with R7 as its base, the keyboard registers
+    - an exhaustive test: every one of the 65,536 instruction words from a few randomized states, each
+      compared against a small model of the ISA written independently of the engines
+    Then one table with the pass/fail counts and the speed (MIPS) of every engine.
+    RTI and the reserved opcode abort the VM, so the exhaustive test leaves them out.
+
+    [Usage]: lc3-conform [--states N] [--seed S] [--budget MILLIONS]
+*/
+
+#include<stdio.h>
+#include<stdint.h>
+#include<string.h>
+/* unix only */
+#include<stdlib.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<time.h>
+
+#include "lc3.h"
+#include "lc3-asm.h"
+
+#define MAX_REPORTED 20 /* failures printed in full, per engine */
+
+struct suite {
+    const struct engine* engine;
+    FILE* report;
+    const char* group;
+    int groups, groups_failed;
+    int cases, cases_failed;
+    int case_failed;       /* the running case has a failed expectation */
+    int group_failed;
+    int reported;
+    uint64_t exhaustive, exhaustive_failed;
+};
+
+void expect(struct suite* s, int ok, const char* what, int line) {
+    if (ok) return;
+    s->case_failed = 1;
+    if (s->reported ++ < MAX_REPORTED) {
+        fprintf(s->report, "FAIL %s %s, line %d: %s\n", s->engine->name, s->group, line, what);
+    }
+}
+#define EXPECT(cond) expect(s, (cond), #cond, __LINE__)
+
+// HARNESS
+/* keys for GETC/IN/KBSR: `keys` then the end of input, or nothing at all yet when `open` is set */
+int key_fds[2] = { -1, -1 };
+
+void keys(const char* keys, int open) {
+    if (key_fds[0] >= 0) close(key_fds[0]);
+    if (key_fds[1] >= 0) close(key_fds[1]);
+    if (pipe(key_fds) != 0) {
+        printf("Failed to create a pipe\n");
+        exit(1);
+    }
+    if (write(key_fds[1], keys, strlen(keys)) != (ssize_t) strlen(keys)) exit(1);
+    if (!open) {
+        close(key_fds[1]);
+        key_fds[1] = -1;
+    }
+    input_open(key_fds[0]);
+}
+
+/* a fresh image with `code` at `origin` and a VM about to run it, starts one case */
+struct vm* load(struct suite* s, uint16_t origin, const uint16_t* code, size_t n) {
+    if (!image_alloc()) {
+        printf("Failed to allocate memory\n");
+        exit(1);
+    }
+    image_load_words(origin, code, n);
+    image_seal();
+    struct vm* vm = vm_create();
+    if (!vm) {
+        printf("Failed to allocate memory\n");
+        exit(1);
+    }
+    vm->reg[R_PC] = origin;
+    s->case_failed = 0;
+    return vm;
+}
+
+/* ends the case */
+void unload(struct suite* s, struct vm* vm) {
+    vm_destroy(vm);
+    image_free();
+    s->cases ++;
+    if (s->case_failed) {
+        s->cases_failed ++;
+        s->group_failed = 1;
+    }
+    keys("", 0);
+}
+
+int run(struct suite* s, struct vm* vm, uint64_t steps) {
+    return s->engine->run(vm, steps);
+}
+
+/* what the guest printed since `mark` */
+int printed(size_t mark, const char* expected) {
+    size_t size;
+    const char* data = out_captured(&size);
+    return size - mark == strlen(expected) && memcmp(data + mark, expected, size - mark) == 0;
+}
+
+size_t output_mark() {
+    size_t size;
+    out_captured(&size);
+    return size;
+}
+
+#define PROGRAM(...) (const uint16_t[]) { __VA_ARGS__ }, sizeof((const uint16_t[]) { __VA_ARGS__ }) / sizeof(uint16_t)
+#define NOP ASM_BR(0, 0)
+
+// GROUPS
+void group_add(struct suite* s) {
+    struct vm* vm = load(s, PC_START, PROGRAM(ASM_ADD(R_R0, R_R1, R_R2)));
+    vm->reg[R_R1] = 3;
+    vm->reg[R_R2] = 4;
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_R0] == 7 && vm->reg[R_COND] == FL_POS && vm->reg[R_PC] == PC_START + 1);
+    unload(s, vm);
+
+    /* imm5 = 0x10 is -16 */
+    vm = load(s, PC_START, PROGRAM(ASM_ADDI(R_R0, R_R1, -16)));
+    vm->reg[R_R1] = 10;
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_R0] == 0xFFFA && vm->reg[R_COND] == FL_NEG);
+    unload(s, vm);
+
+    vm = load(s, PC_START, PROGRAM(ASM_ADDI(R_R0, R_R1, 15)));
+    vm->reg[R_R1] = 0xFFF1;
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_R0] == 0 && vm->reg[R_COND] == FL_ZRO);
+    unload(s, vm);
+
+    /* signed overflow just wraps */
+    vm = load(s, PC_START, PROGRAM(ASM_ADDI(R_R0, R_R1, 1)));
+    vm->reg[R_R1] = 0x7FFF;
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_R0] == 0x8000 && vm->reg[R_COND] == FL_NEG);
+    unload(s, vm);
+
+    vm = load(s, PC_START, PROGRAM(ASM_ADD(R_R3, R_R3, R_R3)));
+    vm->reg[R_R3] = 0x4000;
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_R3] == 0x8000 && vm->reg[R_COND] == FL_NEG);
+    unload(s, vm);
+}
+
+void group_and(struct suite* s) {
+    struct vm* vm = load(s, PC_START, PROGRAM(ASM_AND(R_R0, R_R1, R_R2)));
+    vm->reg[R_R1] = 0xF0F0;
+    vm->reg[R_R2] = 0x3C3C;
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_R0] == 0x3030 && vm->reg[R_COND] == FL_POS);
+    unload(s, vm);
+
+    /* imm5 = 0x1F is -1, all ones */
+    vm = load(s, PC_START, PROGRAM(ASM_ANDI(R_R0, R_R1, -1)));
+    vm->reg[R_R1] = 0x8001;
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_R0] == 0x8001 && vm->reg[R_COND] == FL_NEG);
+    unload(s, vm);
+
+    vm = load(s, PC_START, PROGRAM(ASM_ANDI(R_R0, R_R1, 15)));
+    vm->reg[R_R1] = 0xFFF0;
+    vm->reg[R_COND] = FL_NEG;
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_R0] == 0 && vm->reg[R_COND] == FL_ZRO);
+    unload(s, vm);
+}
+
+void group_not(struct suite* s) {
+    const uint16_t in[] = { 0x0000, 0xFFFF, 0x8000 };
+    const uint16_t out[] = { 0xFFFF, 0x0000, 0x7FFF };
+    const uint16_t cond[] = { FL_NEG, FL_ZRO, FL_POS };
+    for (int i = 0; i < 3; ++ i) {
+        struct vm* vm = load(s, PC_START, PROGRAM(ASM_NOT(R_R0, R_R1)));
+        vm->reg[R_R1] = in[i];
+        run(s, vm, 1);
+        EXPECT(vm->reg[R_R0] == out[i] && vm->reg[R_COND] == cond[i]);
+        unload(s, vm);
+    }
+}
+
+void group_br(struct suite* s) {
+    /* every condition mask against every flag, BR with no bits set never branches */
+    const uint16_t flags[] = { FL_NEG, FL_ZRO, FL_POS };
+    for (int nzp = 0; nzp < 8; ++ nzp) {
+        for (int f = 0; f < 3; ++ f) {
+            struct vm* vm = load(s, PC_START, PROGRAM(ASM_BR(nzp, 5)));
+            vm->reg[R_COND] = flags[f];
+            run(s, vm, 1);
+            /* FL_NEG, FL_ZRO and FL_POS line up with the n, z and p bits */
+            int taken = (nzp & flags[f]) != 0;
+            EXPECT(vm->reg[R_PC] == (taken ? PC_START + 6 : PC_START + 1));
+            EXPECT(vm->reg[R_COND] == flags[f]);
+            unload(s, vm);
+        }
+    }
+
+    /* the most negative offset, -256 */
+    struct vm* vm = load(s, PC_START, PROGRAM(ASM_BR(BR_NZP, -256)));
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_PC] == PC_START + 1 - 256);
+    unload(s, vm);
+
+    /* the PC wraps around both ways */
+    vm = load(s, 0x0000, PROGRAM(ASM_BR(BR_NZP, -2)));
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_PC] == 0xFFFF);
+    unload(s, vm);
+
+    vm = load(s, 0xFFFF, PROGRAM(NOP));
+    mem_write(vm, 0x0000, ASM_ADDI(R_R1, R_R1, 5));
+    run(s, vm, 2);
+    EXPECT(vm->reg[R_R1] == 5 && vm->reg[R_PC] == 0x0001);
+    unload(s, vm);
+}
+
+void group_jmp(struct suite* s) {
+    struct vm* vm = load(s, PC_START, PROGRAM(ASM_JMP(R_R3)));
+    vm->reg[R_R3] = 0x1234;
+    vm->reg[R_COND] = FL_NEG;
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_PC] == 0x1234 && vm->reg[R_COND] == FL_NEG);
+    unload(s, vm);
+
+    vm = load(s, PC_START, PROGRAM(ASM_RET));
+    vm->reg[R_R7] = 0x4000;
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_PC] == 0x4000 && vm->reg[R_R7] == 0x4000);
+    unload(s, vm);
+}
+
+void group_jsr(struct suite* s) {
+    struct vm* vm = load(s, PC_START, PROGRAM(ASM_JSR(0x10)));
+    vm->reg[R_COND] = FL_POS;
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_R7] == PC_START + 1 && vm->reg[R_PC] == PC_START + 0x11 && vm->reg[R_COND] == FL_POS);
+    unload(s, vm);
+
+    /* PCoffset11 = 0x400 is -1024 */
+    vm = load(s, PC_START, PROGRAM(ASM_JSR(-1024)));
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_R7] == PC_START + 1 && vm->reg[R_PC] == PC_START + 1 - 1024);
+    unload(s, vm);
+
+    vm = load(s, PC_START, PROGRAM(ASM_JSRR(R_R2)));
+    vm->reg[R_R2] = 0x5000;
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_R7] == PC_START + 1 && vm->reg[R_PC] == 0x5000 && vm->reg[R_R2] == 0x5000);
+    unload(s, vm);
+
+    /* the switch saves the return address before reading the base, so JSRR R7 falls through */
+    vm = load(s, PC_START, PROGRAM(ASM_JSRR(R_R7)));
+    vm->reg[R_R7] = 0x5000;
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_R7] == PC_START + 1 && vm->reg[R_PC] == PC_START + 1);
+    unload(s, vm);
+}
+
+void group_ld(struct suite* s) {
+    struct vm* vm = load(s, PC_START, PROGRAM(ASM_LD(R_R0, 1), NOP, 0x8005));
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_R0] == 0x8005 && vm->reg[R_COND] == FL_NEG);
+    unload(s, vm);
+
+    /* offset -1 reads the instruction itself */
+    vm = load(s, PC_START, PROGRAM(ASM_LD(R_R0, -1)));
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_R0] == ASM_LD(R_R0, -1) && vm->reg[R_COND] == FL_POS);
+    unload(s, vm);
+
+    vm = load(s, PC_START, PROGRAM(ASM_LD(R_R0, 0), 0));
+    vm->reg[R_R0] = 9;
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_R0] == 0 && vm->reg[R_COND] == FL_ZRO);
+    unload(s, vm);
+
+    /* the address wraps below zero */
+    vm = load(s, 0x0000, PROGRAM(ASM_LD(R_R0, -2)));
+    mem_write(vm, 0xFFFF, 0x1357);
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_R0] == 0x1357);
+    unload(s, vm);
+}
+
+void group_ldi(struct suite* s) {
+    struct vm* vm = load(s, PC_START, PROGRAM(ASM_LDI(R_R0, 1), NOP, 0x4000));
+    mem_write(vm, 0x4000, 0xABCD);
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_R0] == 0xABCD && vm->reg[R_COND] == FL_NEG);
+    unload(s, vm);
+
+    vm = load(s, PC_START, PROGRAM(ASM_LDI(R_R0, -256)));
+    mem_write(vm, PC_START + 1 - 256, 0x4000);
+    mem_write(vm, 0x4000, 0);
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_R0] == 0 && vm->reg[R_COND] == FL_ZRO);
+    unload(s, vm);
+}
+
+void group_ldr(struct suite* s) {
+    /* offset6 = 0x20 is -32 */
+    struct vm* vm = load(s, PC_START, PROGRAM(ASM_LDR(R_R0, R_R1, -32), ASM_LDR(R_R2, R_R1, 31)));
+    vm->reg[R_R1] = 0x4000;
+    mem_write(vm, 0x4000 - 32, 0x0042);
+    mem_write(vm, 0x4000 + 31, 0x9000);
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_R0] == 0x0042 && vm->reg[R_COND] == FL_POS);
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_R2] == 0x9000 && vm->reg[R_COND] == FL_NEG);
+    unload(s, vm);
+
+    /* base + offset wraps past 0xFFFF */
+    vm = load(s, PC_START, PROGRAM(ASM_LDR(R_R0, R_R1, 2)));
+    vm->reg[R_R1] = 0xFFFF;
+    mem_write(vm, 0x0001, 7);
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_R0] == 7);
+    unload(s, vm);
+}
+
+void group_lea(struct suite* s) {
+    /* this LEA sets the condition flags, like the other loads */
+    struct vm* vm = load(s, PC_START, PROGRAM(ASM_LEA(R_R0, 5)));
+    vm->reg[R_COND] = FL_NEG;
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_R0] == PC_START + 6 && vm->reg[R_COND] == FL_POS);
+    unload(s, vm);
+
+    vm = load(s, 0x0000, PROGRAM(ASM_LEA(R_R0, -2)));
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_R0] == 0xFFFF && vm->reg[R_COND] == FL_NEG);
+    unload(s, vm);
+
+    vm = load(s, 0x0000, PROGRAM(ASM_LEA(R_R0, -1)));
+    vm->reg[R_R0] = 3;
+    vm->reg[R_COND] = FL_POS;
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_R0] == 0 && vm->reg[R_COND] == FL_ZRO);
+    unload(s, vm);
+}
+
+void group_st(struct suite* s) {
+    struct vm* vm = load(s, PC_START, PROGRAM(ASM_ST(R_R1, 2)));
+    vm->reg[R_R1] = 0xBEEF;
+    vm->reg[R_COND] = FL_ZRO;
+    run(s, vm, 1);
+    EXPECT(mem_read(vm, PC_START + 3) == 0xBEEF && vm->reg[R_COND] == FL_ZRO);
+    unload(s, vm);
+
+    vm = load(s, 0x0000, PROGRAM(ASM_ST(R_R1, -2)));
+    vm->reg[R_R1] = 0x0101;
+    run(s, vm, 1);
+    EXPECT(mem_read(vm, 0xFFFF) == 0x0101);
+    unload(s, vm);
+}
+
+void group_sti(struct suite* s) {
+    struct vm* vm = load(s, PC_START, PROGRAM(ASM_STI(R_R1, 1), NOP, 0x4000));
+    vm->reg[R_R1] = 0x1234;
+    run(s, vm, 1);
+    EXPECT(mem_read(vm, 0x4000) == 0x1234 && mem_read(vm, PC_START + 2) == 0x4000);
+    unload(s, vm);
+
+    /* through a pointer to the keyboard data register */
+    vm = load(s, PC_START, PROGRAM(ASM_STI(R_R1, 1), NOP, MR_KBDR));
+    vm->reg[R_R1] = 0x0077;
+    run(s, vm, 1);
+    EXPECT(vm->kbdr == 0x0077);
+    unload(s, vm);
+}
+
+void group_str(struct suite* s) {
+    struct vm* vm = load(s, PC_START, PROGRAM(ASM_STR(R_R1, R_R2, -32), ASM_STR(R_R1, R_R2, 31)));
+    vm->reg[R_R1] = 0x5555;
+    vm->reg[R_R2] = 0x4000;
+    run(s, vm, 2);
+    EXPECT(mem_read(vm, 0x4000 - 32) == 0x5555 && mem_read(vm, 0x4000 + 31) == 0x5555);
+    unload(s, vm);
+
+    vm = load(s, PC_START, PROGRAM(ASM_STR(R_R1, R_R2, 0)));
+    vm->reg[R_R1] = 0x8000;
+    vm->reg[R_R2] = MR_KBSR;
+    run(s, vm, 1);
+    EXPECT(vm->kbsr == 0x8000);
+    unload(s, vm);
+}
+
+void group_trap(struct suite* s) {
+    /* a vector without a routine only saves the return address */
+    struct vm* vm = load(s, PC_START, PROGRAM(ASM_TRAP(0x30)));
+    vm->reg[R_R0] = 0x1111;
+    vm->reg[R_COND] = FL_NEG;
+    int status = run(s, vm, 1);
+    EXPECT(status == VM_BUDGET);
+    EXPECT(vm->reg[R_R7] == PC_START + 1 && vm->reg[R_PC] == PC_START + 1);
+    EXPECT(vm->reg[R_R0] == 0x1111 && vm->reg[R_COND] == FL_NEG);
+    unload(s, vm);
+}
+
+void group_getc(struct suite* s) {
+    keys("q", 0);
+    size_t mark = output_mark();
+    struct vm* vm = load(s, PC_START, PROGRAM(ASM_TRAP(TRAP_GETC)));
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_R0] == 'q' && vm->reg[R_COND] == FL_POS && vm->reg[R_R7] == PC_START + 1);
+    EXPECT(printed(mark, "")); /* no echo */
+    unload(s, vm);
+
+    /* at the end of input */
+    vm = load(s, PC_START, PROGRAM(ASM_TRAP(TRAP_GETC)));
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_R0] == KEY_EOF && vm->reg[R_COND] == FL_NEG);
+    unload(s, vm);
+}
+
+void group_out(struct suite* s) {
+    size_t mark = output_mark();
+    struct vm* vm = load(s, PC_START, PROGRAM(ASM_TRAP(TRAP_OUT)));
+    vm->reg[R_R0] = 0x1241; /* only the low byte is printed */
+    run(s, vm, 1);
+    EXPECT(printed(mark, "A") && vm->reg[R_R0] == 0x1241);
+    unload(s, vm);
+}
+
+void group_puts(struct suite* s) {
+    size_t mark = output_mark();
+    struct vm* vm = load(s, PC_START, PROGRAM(ASM_TRAP(TRAP_PUTS), 'H', 'i', 0x2100 | '!', 0, 'x'));
+    vm->reg[R_R0] = PC_START + 1;
+    run(s, vm, 1);
+    EXPECT(printed(mark, "Hi!") && vm->reg[R_R0] == PC_START + 1);
+    unload(s, vm);
+
+    mark = output_mark();
+    vm = load(s, PC_START, PROGRAM(ASM_TRAP(TRAP_PUTS), 0));
+    vm->reg[R_R0] = PC_START + 1;
+    run(s, vm, 1);
+    EXPECT(printed(mark, ""));
+    unload(s, vm);
+}
+
+void group_in(struct suite* s) {
+    keys("z", 0);
+    size_t mark = output_mark();
+    struct vm* vm = load(s, PC_START, PROGRAM(ASM_TRAP(TRAP_IN)));
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_R0] == 'z' && vm->reg[R_COND] == FL_POS);
+    EXPECT(printed(mark, "Enter a character: z"));
+    unload(s, vm);
+}
+
+void group_putsp(struct suite* s) {
+    /* low byte first, a zero high byte is skipped: only a zero word ends the string */
+    size_t mark = output_mark();
+    struct vm* vm = load(s, PC_START, PROGRAM(ASM_TRAP(TRAP_PUTSP), 0x6948, 0x0021, 0x7878, 0));
+    vm->reg[R_R0] = PC_START + 1;
+    run(s, vm, 1);
+    EXPECT(printed(mark, "Hi!xx"));
+    unload(s, vm);
+
+    mark = output_mark();
+    vm = load(s, PC_START, PROGRAM(ASM_TRAP(TRAP_PUTSP), 0x6261, 0x6463, 0));
+    vm->reg[R_R0] = PC_START + 1;
+    run(s, vm, 1);
+    EXPECT(printed(mark, "abcd"));
+    unload(s, vm);
+}
+
+void group_halt(struct suite* s) {
+    size_t mark = output_mark();
+    struct vm* vm = load(s, PC_START, PROGRAM(ASM_ADDI(R_R0, R_R0, 1), ASM_TRAP(TRAP_HALT), ASM_ADDI(R_R0, R_R0, 1)));
+    int status = run(s, vm, 100);
+    EXPECT(status == VM_HALTED && vm->instructions == 2);
+    EXPECT(vm->reg[R_R0] == 1 && vm->reg[R_PC] == PC_START + 2 && vm->reg[R_R7] == PC_START + 2);
+    EXPECT(printed(mark, "HALT\n"));
+    unload(s, vm);
+}
+
+void group_mmio(struct suite* s) {
+    /* a key is waiting: KBSR has its ready bit and KBDR the key */
+    keys("k", 0);
+    struct vm* vm = load(s, PC_START, PROGRAM(ASM_LDI(R_R0, 2), ASM_LDI(R_R1, 2), NOP, MR_KBSR, MR_KBDR));
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_R0] == 0x8000 && vm->reg[R_COND] == FL_NEG);
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_R1] == 'k' && vm->reg[R_COND] == FL_POS);
+    unload(s, vm);
+
+    /* nothing typed yet */
+    keys("", 1);
+    vm = load(s, PC_START, PROGRAM(ASM_LDI(R_R0, 1), NOP, MR_KBSR));
+    vm->reg[R_R0] = 5;
+    run(s, vm, 1);
+    EXPECT(vm->reg[R_R0] == 0 && vm->reg[R_COND] == FL_ZRO);
+    unload(s, vm);
+}
+
+void group_perf(struct suite* s) {
+    /* the first access switches the counters on, what runs from then on is counted */
+    struct vm* vm = load(s, PC_START, PROGRAM(
+        ASM_LDI(R_R0, 8),           /* instructions retired, this one included */
+        ASM_STI(R_R4, 8),           /* select ADD */
+        ASM_ADDI(R_R2, R_R2, 1),
+        ASM_ADDI(R_R2, R_R2, 1),
+        ASM_ADDI(R_R2, R_R2, 1),
+        ASM_LDI(R_R1, 5),
+        ASM_LDI(R_R5, 5),           /* ADDs since the first access */
+        ASM_LDI(R_R6, 5),           /* cycles: STI, 3 ADD, 3 LDI */
+        ASM_LDI(R_R7, 5),           /* and their high word */
+        MR_PERF_INSN_LO, MR_PERF_SELECT, MR_PERF_INSN_LO, MR_PERF_OP_LO, MR_PERF_CYCLE_LO, MR_PERF_CYCLE_HI));
+    vm->reg[R_R4] = OP_ADD;
+    run(s, vm, 9);
+    EXPECT(vm->reg[R_R0] == 1 && vm->reg[R_R1] == 6);
+    EXPECT(vm->reg[R_R5] == 3);
+    EXPECT(vm->reg[R_R6] == 21 + 3 * 9 + 3 * 21 && vm->reg[R_R7] == 0);
+    EXPECT(vm->private_pages == 0); /* the registers are not memory */
+    unload(s, vm);
+}
+
+void group_atomic(struct suite* s) {
+    /* a VM on its own is core 0 of 1, and the atomics work on its memory */
+    struct vm* vm = load(s, PC_START, PROGRAM(
+        ASM_LDI(R_R0, 7),           /* core number */
+        ASM_LDI(R_R1, 7),           /* cores */
+        ASM_STI(R_R4, 7),           /* the atomics work on R4 */
+        ASM_LDI(R_R2, 7),           /* test-and-set: was 0 */
+        ASM_LDI(R_R3, 6),           /* and now is 1 */
+        ASM_STI(R_R5, 6),           /* fetch-add adds R5 */
+        ASM_LDI(R_R6, 6),           /* fetch-add: was 1 */
+        ASM_STI(R_R5, 5),           /* and a plain add */
+        MR_CORE_ID, MR_CORE_COUNT, MR_ATOMIC_ADDR, MR_ATOMIC_TAS, MR_ATOMIC_VALUE, MR_ATOMIC_FADD));
+    vm->reg[R_R4] = 0x4000;
+    vm->reg[R_R5] = 5;
+    run(s, vm, 8);
+    EXPECT(vm->reg[R_R0] == 0 && vm->reg[R_R1] == 1);
+    EXPECT(vm->reg[R_R2] == 0 && vm->reg[R_R3] == 1 && vm->reg[R_R6] == 1);
+    EXPECT(mem_read(vm, 0x4000) == 11);
+    unload(s, vm);
+}
+
+/* one command to the block device, then wait for its status to show ready */
+struct vm* block_case(struct suite* s, uint16_t block, uint16_t address, uint16_t cmd) {
+    struct vm* vm = load(s, PC_START, PROGRAM(
+        ASM_STI(R_R1, 5),
+        ASM_STI(R_R2, 5),
+        ASM_STI(R_R3, 5),
+        ASM_LDI(R_R4, 5),           /* 3: poll the status */
+        ASM_BR(BR_Z | BR_P, -2),    /* back to 3 until ready */
+        ASM_TRAP(TRAP_HALT),
+        MR_BLK_BLOCK, MR_BLK_ADDR, MR_BLK_CMD, MR_BLK_STATUS));
+    vm->reg[R_R1] = block;
+    vm->reg[R_R2] = address;
+    vm->reg[R_R3] = cmd;
+    EXPECT(run(s, vm, 100000000) == VM_HALTED);
+    return vm;
+}
+
+void group_block(struct suite* s) {
+    /* a disk of 4 blocks, word i of block b holds b * 1000 + i */
+    char path[] = "/tmp/lc3-conform-XXXXXX";
+    int fd = mkstemp(path);
+    uint16_t data[4][PAGE_SIZE];
+    for (int b = 0; b < 4; ++ b) {
+        for (int i = 0; i < PAGE_SIZE; ++ i) data[b][i] = b * 1000 + i;
+    }
+    EXPECT(fd >= 0 && write(fd, data, sizeof(data)) == (ssize_t) sizeof(data));
+    EXPECT(block_open(path));
+
+    /* a read lands in the two pages the buffer spans */
+    struct vm* vm = block_case(s, 1, 0x4080, BLK_READ);
+    EXPECT(vm->reg[R_R4] == BLK_READY && mem_read(vm, 0x4080) == 1000 && mem_read(vm, 0x417F) == 1255);
+    EXPECT(vm->private_pages == 2 && mem_read(vm, 0x4180) == 0);
+    unload(s, vm);
+
+    /* a write takes the block from memory, here the image */
+    vm = block_case(s, 2, PC_START, BLK_WRITE);
+    uint16_t block[PAGE_SIZE];
+    EXPECT(vm->reg[R_R4] == BLK_READY && pread(fd, block, sizeof(block), 2 * sizeof(block[0]) * PAGE_SIZE) == sizeof(block));
+    EXPECT(block[0] == image[PC_START] && block[9] == MR_BLK_STATUS && block[PAGE_SIZE - 1] == 0);
+    unload(s, vm);
+
+    /* asynchronous: the guest polls, the block is in memory once the status shows ready */
+    vm = block_case(s, 3, 0x5000, BLK_READ | BLK_ASYNC);
+    EXPECT(vm->reg[R_R4] == BLK_READY && mem_read(vm, 0x5000) == 3000 && mem_read(vm, 0x50FF) == 3255);
+    unload(s, vm);
+
+    /* past the end of the disk, or a buffer running into the device page */
+    vm = block_case(s, 4, 0x5000, BLK_READ);
+    EXPECT(vm->reg[R_R4] == (BLK_READY | BLK_FAILED) && vm->private_pages == 0);
+    unload(s, vm);
+    vm = block_case(s, 0, 0xFD01, BLK_READ | BLK_ASYNC);
+    EXPECT(vm->reg[R_R4] == (BLK_READY | BLK_FAILED));
+    unload(s, vm);
+
+    block_close();
+    if (fd >= 0) close(fd);
+    unlink(path);
+}
+
+void group_xmem(struct suite* s) {
+    /* the same call into the window runs the code of whichever bank is mapped */
+    EXPECT(xmem_enable(4));
+    uint16_t* bank0 = xmem_bank(0);
+    uint16_t* bank1 = xmem_bank(1);
+    EXPECT(bank0 && bank1 && !xmem_bank(4));
+    if (!bank0 || !bank1) return;
+    bank0[0] = ASM_ADDI(R_R0, R_R0, 1);
+    bank0[1] = ASM_RET;
+    bank1[0] = ASM_ADDI(R_R0, R_R0, 2);
+    bank1[1] = ASM_RET;
+    struct vm* vm = load(s, PC_START, PROGRAM(
+        ASM_STI(R_R1, 7),           /* map bank 0 */
+        ASM_JSRR(R_R2),
+        ASM_STI(R_R3, 5),           /* map bank 1 */
+        ASM_JSRR(R_R2),
+        ASM_STR(R_R0, R_R2, 2),     /* a store into the bank */
+        ASM_STI(R_R4, 2),           /* a bank past the end is ignored */
+        ASM_LDI(R_R5, 1),
+        ASM_TRAP(TRAP_HALT),
+        MR_XMEM_BANK));
+    vm->reg[R_R1] = 0;
+    vm->reg[R_R2] = XMEM_WINDOW;
+    vm->reg[R_R3] = 1;
+    vm->reg[R_R4] = 4;
+    EXPECT(run(s, vm, 100) == VM_HALTED);
+    EXPECT(vm->reg[R_R0] == 3 && vm->reg[R_R5] == 1);
+    EXPECT(bank1[2] == 3 && vm->private_pages == 0); /* written in place, no copy */
+    /* unmapped, the window is the VM's own memory again */
+    EXPECT(xmem_map(vm, XMEM_NONE) && mem_read(vm, XMEM_WINDOW + 2) == 0);
+    unload(s, vm);
+    xmem_free();
+}
+
+/* what the embedding host got so far is `expected`, and it takes it */
+int embed_took(struct vm* vm, const char* expected) {
+    size_t size;
+    const char* data = embed_output(vm, &size);
+    int ok = size == strlen(expected) && memcmp(data, expected, size) == 0;
+    embed_output_clear(vm);
+    return ok;
+}
+
+void group_embed(struct suite* s) {
+    /* an echo loop, run by a host that feeds keys piecewise and never blocks */
+    struct vm* vm = load(s, PC_START, PROGRAM(
+        ASM_TRAP(TRAP_GETC),        /* 0: loop */
+        ASM_BR(BR_N, 2),            /* the end of input is negative */
+        ASM_TRAP(TRAP_OUT),
+        ASM_BR(BR_NZP, -4),         /* back to 0 */
+        ASM_TRAP(TRAP_HALT)));
+    EXPECT(embed_open(vm));
+    EXPECT(embed_run(vm, s->engine, 1000) == VM_INPUT && vm->reg[R_PC] == PC_START);
+    EXPECT(embed_feed(vm, "ab", 2));
+    EXPECT(embed_run(vm, s->engine, 1000) == VM_OUTPUT && embed_took(vm, "a"));
+    /* a second VM of the same host has its own keys and output */
+    struct vm* other = vm_fork(vm);
+    EXPECT(other && embed_open(other) && embed_feed(other, "x", 1));
+    EXPECT(embed_run(other, s->engine, 1000) == VM_OUTPUT && embed_took(other, "x") && embed_took(vm, ""));
+    EXPECT(embed_run(other, s->engine, 1000) == VM_INPUT);
+    if (other) vm_destroy(other);
+    EXPECT(embed_run(vm, s->engine, 1000) == VM_OUTPUT && embed_took(vm, "b"));
+    EXPECT(embed_run(vm, s->engine, 1000) == VM_INPUT && embed_took(vm, ""));
+    EXPECT(embed_run(vm, s->engine, 2) == VM_INPUT && embed_took(vm, "")); /* still nothing fed */
+    EXPECT(embed_feed(vm, "c", 1));
+    embed_feed_end(vm);
+    EXPECT(embed_run(vm, s->engine, 1000) == VM_OUTPUT && embed_took(vm, "c"));
+    EXPECT(embed_run(vm, s->engine, 1000) == VM_HALTED && embed_took(vm, "HALT\n"));
+    EXPECT(vm->instructions == 3 * 4 + 3);
+    embed_close(vm);
+    EXPECT(!vm->embed);
+    unload(s, vm);
+
+    /* an instruction fetched from the keyboard status register with nothing fed stops on it, like a load */
+    vm = load(s, PC_START, PROGRAM(ASM_TRAP(TRAP_HALT)));
+    vm->reg[R_PC] = MR_KBSR;
+    EXPECT(embed_open(vm));
+    EXPECT(embed_run(vm, s->engine, 1000) == VM_INPUT && vm->reg[R_PC] == MR_KBSR && vm->instructions == 0);
+    embed_close(vm);
+    unload(s, vm);
+}
+
+void group_quota(struct suite* s) {
+    /* a loop that never ends is cut at the end of the block the tokens ran out in */
+    const uint16_t loop[] = { ASM_ADDI(R_R0, R_R0, 1), ASM_ADDI(R_R1, R_R1, 1), ASM_BR(BR_NZP, -3) };
+    struct vm* vm = load(s, PC_START, loop, 3);
+    EXPECT(quota_set(vm, 1000, 100, 0));
+    EXPECT(vm_run_throttled(vm, s->engine, 1000000) == VM_THROTTLED);
+    EXPECT(vm->instructions == 102 && vm->reg[R_PC] == PC_START && quota_ready_us(vm) > now_us());
+    EXPECT(vm_run_throttled(vm, s->engine, 1000000) == VM_THROTTLED && vm->instructions == 102);
+    unload(s, vm);
+
+    /* a total is spent for good */
+    vm = load(s, PC_START, loop, 3);
+    EXPECT(quota_set(vm, 0, 0, 250));
+    EXPECT(vm_run_throttled(vm, s->engine, 100) == VM_BUDGET && vm->instructions == 100);
+    EXPECT(vm_run_throttled(vm, s->engine, 1000000) == VM_QUOTA && vm->instructions == 252);
+    EXPECT(vm_run_throttled(vm, s->engine, 1000000) == VM_QUOTA && quota_ready_us(vm) == UINT64_MAX);
+    unload(s, vm);
+}
+
+/* the bytes of `in` come back unchanged through the codec */
+int lz_round_trip(const uint8_t* in, int n) {
+    uint8_t packed[PAGE_BYTES + 64], unpacked[PAGE_BYTES];
+    int size = lz_compress(in, n, packed, sizeof(packed));
+    return size > 0 && lz_decompress(packed, size, unpacked, sizeof(unpacked)) == n && memcmp(in, unpacked, n) == 0;
+}
+
+void group_park(struct suite* s) {
+    /* private pages of every kind of content: zeros, noise, a short period, noise and then a run to the end */
+    enum { ZEROS = 0x40, NOISE, PERIOD, TAIL };
+    struct vm* vm = load(s, PC_START, PROGRAM(ASM_TRAP(TRAP_HALT)));
+    uint32_t seed = 12345;
+    for (int i = 0; i < PAGE_SIZE; ++ i) {
+        seed = seed * 1103515245 + 12345;
+        mem_write(vm, ZEROS << PAGE_BITS | i, 0);
+        mem_write(vm, NOISE << PAGE_BITS | i, seed >> 16);
+        mem_write(vm, PERIOD << PAGE_BITS | i, "\x12\x34\x56"[i % 3]);
+        mem_write(vm, TAIL << PAGE_BITS | i, i < 37 ? seed >> 8 : 0x7777);
+    }
+    uint16_t before[4][PAGE_SIZE];
+    for (int p = 0; p < 4; ++ p) memcpy(before[p], vm->page[ZEROS + p], PAGE_BYTES);
+    vm_park(vm);
+    EXPECT(vm->page_kind[ZEROS] == PG_PACKED && vm->page_kind[PERIOD] == PG_PACKED && vm->page_kind[TAIL] == PG_PACKED);
+    EXPECT(vm->page_kind[NOISE] == PG_PRIVATE); /* does not compress, kept as it is */
+    vm_unpark(vm);
+    for (int p = 0; p < 4; ++ p) {
+        EXPECT(vm->page_kind[ZEROS + p] == PG_PRIVATE && memcmp(before[p], vm->page[ZEROS + p], PAGE_BYTES) == 0);
+    }
+    /* the codec alone: the same pages, a match ending right at the end (an empty last literal run), inputs shorter than a match */
+    for (int p = 0; p < 4; ++ p) EXPECT(lz_round_trip((const uint8_t*) before[p], PAGE_BYTES));
+    uint8_t run[64];
+    memset(run, 'a', sizeof(run));
+    EXPECT(lz_round_trip(run, sizeof(run)));
+    EXPECT(lz_round_trip((const uint8_t*) "abcdabcd", 8));
+    EXPECT(lz_round_trip((const uint8_t*) "abc", 3) && lz_round_trip((const uint8_t*) "", 0));
+    unload(s, vm);
+}
+
+const struct {
+    const char* name;
+    void (*run)(struct suite* s);
+} groups[] = {
+    { "ADD", group_add },
+    { "AND", group_and },
+    { "NOT", group_not },
+    { "BR", group_br },
+    { "JMP", group_jmp },
+    { "JSR", group_jsr },
+    { "LD", group_ld },
+    { "LDI", group_ldi },
+    { "LDR", group_ldr },
+    { "LEA", group_lea },
+    { "ST", group_st },
+    { "STI", group_sti },
+    { "STR", group_str },
+    { "TRAP", group_trap },
+    { "GETC", group_getc },
+    { "OUT", group_out },
+    { "PUTS", group_puts },
+    { "IN", group_in },
+    { "PUTSP", group_putsp },
+    { "HALT", group_halt },
+    { "MMIO", group_mmio },
+    { "PERF", group_perf },
+    { "ATOMIC", group_atomic },
+    { "BLOCK", group_block },
+    { "XMEM", group_xmem },
+    { "EMBED", group_embed },
+    { "QUOTA", group_quota },
+    { "PARK", group_park },
+};
+#define GROUP_COUNT (sizeof(groups) / sizeof(groups[0]))
+
+// MODEL
+/*
+    The ISA as a plain function of the state, written from the LC-3 description and the notes above
+    rather than from the engines, for one instruction. The keyboard is at the end of input, so KBSR
+    always reads ready and KBDR then holds KEY_EOF. The instruction itself is planted at the PC.
+    The performance counters of a fresh VM have counted nothing but the instruction reading them,
+    except for the clock, so a case that reads the clock is not compared.
+    The VM is core 0 of 1, its atomic registers start at address 0 and value 0, and an atomic one
+    writes memory like a store, so an instruction can write twice (STI through MR_ATOMIC_TAS).
+    There is no disk: the block registers read back what was written, every command fails.
+    There is no extended memory either, so no bank can be mapped.
+*/
+struct model {
+    uint16_t reg[R_COUNT];
+    uint16_t kbsr, kbdr;
+    uint16_t pc, instr;    /* the planted instruction */
+    int wrote;             /* writes, in order */
+    uint16_t write_address[2], write_data[2];
+    int halted;
+    uint16_t perf_select;
+    int read_clock;
+    uint16_t atomic_addr, atomic_value;
+    uint16_t blk_block, blk_addr, blk_cmd, blk_status;
+};
+
+void model_write(struct model* m, uint16_t address, uint16_t data);
+
+uint16_t model_read(struct model* m, uint16_t address) {
+    if (address == MR_KBSR) {
+        m->kbsr = 0x8000;
+        m->kbdr = KEY_EOF;
+        return m->kbsr;
+    }
+    if (address == MR_KBDR) return m->kbdr;
+    if (address >= MR_PERF_INSN_LO && address <= MR_PERF_OP_HI) {
+        if (address == MR_PERF_INSN_LO) return 1;
+        if (address == MR_PERF_USEC_LO) m->read_clock = 1;
+        if (address == MR_PERF_SELECT) return m->perf_select;
+        return 0;
+    }
+    if (address >= MR_CORE_ID && address <= MR_ATOMIC_FADD) {
+        uint16_t old = m->atomic_addr < MR_KBSR ? model_read(m, m->atomic_addr) : 0;
+        switch (address) {
+            case MR_CORE_ID: return 0;
+            case MR_CORE_COUNT: return 1;
+            case MR_ATOMIC_ADDR: return m->atomic_addr;
+            case MR_ATOMIC_VALUE: return m->atomic_value;
+            case MR_ATOMIC_TAS:
+                if (m->atomic_addr < MR_KBSR) model_write(m, m->atomic_addr, 1);
+                return old;
+            default:
+                if (m->atomic_addr < MR_KBSR) model_write(m, m->atomic_addr, old + m->atomic_value);
+                return old;
+        }
+    }
+    switch (address) {
+        case MR_BLK_BLOCK: return m->blk_block;
+        case MR_BLK_ADDR: return m->blk_addr;
+        case MR_BLK_CMD: return m->blk_cmd;
+        case MR_BLK_STATUS: return BLK_READY | m->blk_status;
+        case MR_BLK_COUNT: return 0;
+        case MR_XMEM_BANK: return XMEM_NONE;
+        case MR_XMEM_BANKS: return 0;
+    }
+    for (int w = m->wrote - 1; w >= 0; -- w) {
+        if (m->write_address[w] == address) return m->write_data[w];
+    }
+    if (address == m->pc) return m->instr;
+    return image[address];
+}
+
+void model_write(struct model* m, uint16_t address, uint16_t data) {
+    if (address == MR_KBSR) m->kbsr = data;
+    else if (address == MR_KBDR) m->kbdr = data;
+    else if (address == MR_PERF_SELECT) m->perf_select = data & 0xF;
+    else if (address >= MR_PERF_INSN_LO && address <= MR_PERF_OP_HI) return;
+    else if (address == MR_ATOMIC_ADDR) m->atomic_addr = data;
+    else if (address == MR_ATOMIC_VALUE) m->atomic_value = data;
+    else if (address == MR_ATOMIC_TAS || address == MR_ATOMIC_FADD) {
+        if (m->atomic_addr >= MR_KBSR) return;
+        model_write(m, m->atomic_addr, address == MR_ATOMIC_TAS ? data : model_read(m, m->atomic_addr) + data);
+    } else if (address >= MR_CORE_ID && address <= MR_ATOMIC_FADD) return;
+    else if (address == MR_BLK_BLOCK) m->blk_block = data;
+    else if (address == MR_BLK_ADDR) m->blk_addr = data;
+    else if (address == MR_BLK_CMD) {
+        m->blk_cmd = data;
+        m->blk_status = BLK_FAILED;
+    } else if (address >= MR_BLK_BLOCK && address <= MR_BLK_COUNT) return;
+    else if (address == MR_XMEM_BANK || address == MR_XMEM_BANKS) return;
+    else {
+        m->write_address[m->wrote] = address;
+        m->write_data[m->wrote] = data;
+        m->wrote ++;
+    }
+}
+
+uint16_t sext(uint16_t x, int bits) {
+    return (uint16_t) ((int16_t) (x << (16 - bits)) >> (16 - bits));
+}
+
+void model_setcc(struct model* m, int r) {
+    m->reg[R_COND] = m->reg[r] == 0 ? FL_ZRO : (m->reg[r] & 0x8000) ? FL_NEG : FL_POS;
+}
+
+void model_step(struct model* m) {
+    uint16_t* r = m->reg;
+    uint16_t i = model_read(m, r[R_PC]);
+    r[R_PC] ++;
+    int dr = (i >> 9) & 7, sr1 = (i >> 6) & 7;
+    uint16_t src2 = (i & 0x20) ? sext(i & 0x1F, 5) : r[i & 7];
+    uint16_t pc9 = r[R_PC] + sext(i & 0x1FF, 9);
+    uint16_t base6 = r[sr1] + sext(i & 0x3F, 6);
+    switch (i >> 12) {
+        case OP_ADD: r[dr] = r[sr1] + src2; model_setcc(m, dr); break;
+        case OP_AND: r[dr] = r[sr1] & src2; model_setcc(m, dr); break;
+        case OP_NOT: r[dr] = ~r[sr1]; model_setcc(m, dr); break;
+        case OP_BR: if ((dr & r[R_COND]) != 0) r[R_PC] = pc9; break;
+        case OP_JMP: r[R_PC] = r[sr1]; break;
+        case OP_JSR:
+            r[R_R7] = r[R_PC];
+            r[R_PC] = (i & 0x800) ? r[R_PC] + sext(i & 0x7FF, 11) : r[sr1];
+            break;
+        case OP_LD: r[dr] = model_read(m, pc9); model_setcc(m, dr); break;
+        case OP_LDI: r[dr] = model_read(m, model_read(m, pc9)); model_setcc(m, dr); break;
+        case OP_LDR: r[dr] = model_read(m, base6); model_setcc(m, dr); break;
+        case OP_LEA: r[dr] = pc9; model_setcc(m, dr); break;
+        case OP_ST: model_write(m, pc9, r[dr]); break;
+        case OP_STI: model_write(m, model_read(m, pc9), r[dr]); break;
+        case OP_STR: model_write(m, base6, r[dr]); break;
+        case OP_TRAP:
+            r[R_R7] = r[R_PC];
+            switch (i & 0xFF) {
+                case TRAP_GETC: r[R_R0] = KEY_EOF; model_setcc(m, R_R0); break;
+                case TRAP_IN: r[R_R0] = (uint16_t) (char) KEY_EOF; model_setcc(m, R_R0); break;
+                case TRAP_HALT: m->halted = 1; break;
+            }
+            break;
+    }
+}
+
+// EXHAUSTIVE
+uint64_t rng_state;
+
+uint32_t rng() {
+    /* xorshift64* */
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (uint32_t) ((rng_state * 2685821657736338717ULL) >> 32);
+}
+
+/* one instruction word from one random state, on the engine and on the model */
+int exhaustive_case(struct suite* s, uint16_t instr) {
+    struct model m = {0};
+    for (int r = 0; r < R_R7 + 1; ++ r) m.reg[r] = rng();
+    const uint16_t flags[] = { FL_NEG, FL_ZRO, FL_POS };
+    m.reg[R_COND] = flags[rng() % 3];
+    m.pc = rng() % MR_KBSR; /* planted in ordinary memory, below the keyboard registers */
+    m.reg[R_PC] = m.pc;
+    m.instr = instr;
+
+    struct vm* vm = vm_create();
+    if (!vm) {
+        printf("Failed to allocate memory\n");
+        exit(1);
+    }
+    memcpy(vm->reg, m.reg, sizeof(m.reg));
+    mem_write(vm, m.pc, instr);
+    int status = s->engine->run(vm, 1);
+    model_step(&m);
+
+    int ok = memcmp(vm->reg, m.reg, sizeof(m.reg)) == 0 && vm->kbsr == m.kbsr && vm->kbdr == m.kbdr &&
+        (status == VM_HALTED) == m.halted;
+    /* the only private pages are the one holding the instruction and the one written to */
+    uint32_t pages = 1;
+    for (int w = 0; w < m.wrote; ++ w) {
+        /* a later write to the same word wins */
+        if (w + 1 < m.wrote && m.write_address[w + 1] == m.write_address[w]) continue;
+        ok = ok && mem_read(vm, m.write_address[w]) == m.write_data[w];
+        uint16_t page = m.write_address[w] >> PAGE_BITS;
+        if (page != m.pc >> PAGE_BITS && (w == 0 || page != m.write_address[0] >> PAGE_BITS)) pages ++;
+    }
+    ok = (ok && vm->private_pages == pages) || m.read_clock;
+    if (!ok && s->reported ++ < MAX_REPORTED) {
+        fprintf(s->report, "FAIL %s exhaustive: %04x at pc %04x, got pc %04x cond %x r0 %04x r7 %04x,"
+            " expected pc %04x cond %x r0 %04x r7 %04x\n", s->engine->name, instr, m.pc,
+            vm->reg[R_PC], vm->reg[R_COND], vm->reg[R_R0], vm->reg[R_R7],
+            m.reg[R_PC], m.reg[R_COND], m.reg[R_R0], m.reg[R_R7]);
+    }
+    vm_destroy(vm);
+    return ok;
+}
+
+void exhaustive(struct suite* s, int states, uint64_t seed) {
+    /* random memory, the same for every engine */
+    rng_state = seed;
+    if (!image_alloc()) {
+        printf("Failed to allocate memory\n");
+        exit(1);
+    }
+    for (int a = 0; a < MEMORY_MAX; ++ a) image[a] = rng();
+    image_seal();
+    keys("", 0);
+    for (uint32_t instr = 0; instr < MEMORY_MAX; ++ instr) {
+        uint16_t op = instr >> 12;
+        if (op == OP_RTI || op == OP_RES) continue;
+        for (int i = 0; i < states; ++ i) {
+            s->exhaustive ++;
+            if (!exhaustive_case(s, instr)) s->exhaustive_failed ++;
+        }
+    }
+    image_free();
+}
+
+// SPEED
+/* a loop mixing the common instructions, N times */
+const uint16_t speed_program[] = {
+    ASM_LD(R_R1, 10),            /* 0: R1 = N */
+    ASM_LEA(R_R4, 12),           /* 1: loop, R4 = BUF */
+    ASM_LDR(R_R2, R_R4, 0),
+    ASM_ADD(R_R2, R_R2, R_R1),
+    ASM_STR(R_R2, R_R4, 0),
+    ASM_ANDI(R_R3, R_R2, 7),
+    ASM_NOT(R_R3, R_R3),
+    ASM_JSR(4),                  /* 7: call 12 */
+    ASM_ADDI(R_R1, R_R1, -1),
+    ASM_BR(BR_P, -9),            /* 9: back to 1 */
+    ASM_TRAP(TRAP_HALT),
+    30000,                       /* 11: N */
+    ASM_ADD(R_R0, R_R0, R_R3),   /* 12: the subroutine */
+    ASM_RET,
+    0                            /* 14: BUF */
+};
+
+uint64_t cpu_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+double speed(const struct engine* e, uint64_t budget) {
+    if (!image_alloc()) {
+        printf("Failed to allocate memory\n");
+        exit(1);
+    }
+    image_load_words(PC_START, speed_program, sizeof(speed_program) / sizeof(uint16_t));
+    image_seal();
+    uint64_t instructions = 0, us = 0;
+    while (instructions < budget) {
+        struct vm* vm = vm_create();
+        uint64_t start = cpu_us();
+        e->run(vm, budget - instructions);
+        us += cpu_us() - start;
+        instructions += vm->instructions;
+        vm_destroy(vm);
+    }
+    image_free();
+    return us ? (double) instructions / us : 0.0;
+}
+
+void usage() {
+    printf("[Usage]: lc3-conform [--states N] [--seed S] [--budget MILLIONS]\n");
+    printf("  --states N         random states per instruction word in the exhaustive test (default 4)\n");
+    printf("  --seed S           seed of the random states and memory\n");
+    printf("  --budget M         million instructions for the speed measurement (default 20)\n");
+    exit(2);
+}
+
+int main(int argc, const char* argv[]) {
+    int states = 4;
+    uint64_t seed = 0x5EED1C3;
+    uint64_t budget = 20;
+    for (int j = 1; j < argc; ++ j) {
+        if (strcmp(argv[j], "--states") == 0 && j + 1 < argc) {
+            states = atoi(argv[++ j]);
+        } else if (strcmp(argv[j], "--seed") == 0 && j + 1 < argc) {
+            seed = strtoull(argv[++ j], NULL, 0);
+        } else if (strcmp(argv[j], "--budget") == 0 && j + 1 < argc) {
+            budget = strtoull(argv[++ j], NULL, 10);
+        } else {
+            usage();
+        }
+    }
+    if (states < 0 || budget == 0 || seed == 0) usage();
+
+    /* the guest's output goes nowhere (the tests look at the captured copy), the report to stdout */
+    FILE* report = fdopen(dup(STDOUT_FILENO), "w");
+    int null = open("/dev/null", O_WRONLY);
+    if (!report || null < 0) {
+        printf("Failed to redirect the guest's output\n");
+        exit(1);
+    }
+    fflush(stdout);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+    string_kernels_init();
+
+    struct suite results[engine_count];
+    int failed = 0;
+    for (int e = 0; e < engine_count; ++ e) {
+        struct suite* s = &results[e];
+        memset(s, 0, sizeof(*s));
+        s->engine = &engines[e];
+        s->report = report;
+        out_capture(1);
+        for (size_t g = 0; g < GROUP_COUNT; ++ g) {
+            s->group = groups[g].name;
+            s->group_failed = 0;
+            groups[g].run(s);
+            s->groups ++;
+            if (s->group_failed) s->groups_failed ++;
+        }
+        out_capture(0);
+        s->group = "exhaustive";
+        exhaustive(s, states, seed);
+        if (s->groups_failed || s->exhaustive_failed) failed = 1;
+    }
+
+    fprintf(report, "%-10s %9s %11s %21s %9s\n", "engine", "groups", "cases", "exhaustive", "MIPS");
+    for (int e = 0; e < engine_count; ++ e) {
+        struct suite* s = &results[e];
+        char g[32], c[32], x[48];
+        snprintf(g, sizeof(g), "%d/%d", s->groups - s->groups_failed, s->groups);
+        snprintf(c, sizeof(c), "%d/%d", s->cases - s->cases_failed, s->cases);
+        snprintf(x, sizeof(x), "%llu/%llu", (unsigned long long) (s->exhaustive - s->exhaustive_failed),
+            (unsigned long long) s->exhaustive);
+        fprintf(report, "%-10s %9s %11s %21s %9.1f  %s\n", s->engine->name, g, c, x,
+            speed(s->engine, budget * 1000000), s->groups_failed || s->exhaustive_failed ? "FAIL" : "pass");
+    }
+    fclose(report);
+    return failed;
+}
@@ -0,0 +1,253 @@
+/*Input-to-output latency harness for lc3-vm*/
+
+/*
+    Runs lc3-vm on a pseudo-terminal, so the VM sees a real terminal (disable_input_buffering and the
+    input layer are exercised exactly as with a user), types keys at a fixed rate and measures how long
+    it takes for the guest's answer to start appearing on the screen.
+    The measurement is repeated under increasing background load (busy processes on every load level),
+    and the p50/p99/p999 latencies are printed as one table.
+
+    [Usage]: lc3-latency [options] [image-file1] ... [-- vm-options]
+*/
+
+#define _GNU_SOURCE /* posix_openpt and friends */
+#include<stdio.h>
+#include<stdint.h>
+#include<string.h>
+#include<signal.h>
+/* unix only */
+#include<stdlib.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<poll.h>
+#include<time.h>
+#include<sys/types.h>
+#include<sys/wait.h>
+#include<sys/ioctl.h>
+#include<termios.h>
+
+#define MAX_ARGS 64
+#define MAX_LOADS 16
+#define MAX_BUSY 256       /* busy processes of one load level */
+#define QUIET_US 20000     /* the answer is complete once the guest is silent this long */
+#define TIMEOUT_US 1000000 /* a key without any answer after this long is counted as lost */
+
+struct options {
+    const char* vm;         /* path of the lc3-vm binary */
+    const char* keys;       /* keys to type, in a cycle */
+    const char* prefix;     /* typed once before measuring, e.g. "y" for 2048.obj */
+    int count;              /* keys per load level */
+    int rate;               /* keys per second */
+    int loads[MAX_LOADS];   /* busy processes running next to the VM */
+    int load_count;
+    const char* args[MAX_ARGS];
+    int arg_count;
+};
+
+uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* start the VM with its stdin, stdout and stderr on the slave side of a new pty */
+pid_t spawn_on_pty(struct options* opt, int* master) {
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0) return -1;
+    const char* slave_name = ptsname(fd);
+    struct winsize ws = { .ws_row = 24, .ws_col = 80 };
+    ioctl(fd, TIOCSWINSZ, &ws);
+
+    pid_t pid = fork();
+    if (pid != 0) {
+        *master = fd;
+        return pid;
+    }
+    /* child: become the session leader of the pty so it is our controlling terminal */
+    setsid();
+    int slave = open(slave_name, O_RDWR);
+    if (slave < 0) _exit(127);
+    ioctl(slave, TIOCSCTTY, 0);
+    dup2(slave, STDIN_FILENO);
+    dup2(slave, STDOUT_FILENO);
+    dup2(slave, STDERR_FILENO);
+    close(slave);
+    close(fd);
+
+    const char* argv[MAX_ARGS + 2];
+    argv[0] = opt->vm;
+    for (int i = 0; i < opt->arg_count; ++ i) argv[i + 1] = opt->args[i];
+    argv[opt->arg_count + 1] = NULL;
+    execv(opt->vm, (char* const*) argv);
+    _exit(127);
+}
+
+/* read whatever the guest prints until it stays quiet for `quiet_us`, returns the bytes read */
+size_t drain(int master, int64_t quiet_us) {
+    char buf[4096];
+    size_t total = 0;
+    struct pollfd pfd = { .fd = master, .events = POLLIN };
+    while (poll(&pfd, 1, quiet_us / 1000) > 0) {
+        ssize_t n = read(master, buf, sizeof(buf));
+        if (n <= 0) break;
+        total += n;
+    }
+    return total;
+}
+
+/* type one key, returns the microseconds until the first byte of the answer, or -1 if none came */
+int64_t measure_key(int master, char key) {
+    drain(master, 0);
+    uint64_t start = now_us();
+    if (write(master, &key, 1) != 1) return -1;
+    struct pollfd pfd = { .fd = master, .events = POLLIN };
+    if (poll(&pfd, 1, TIMEOUT_US / 1000) <= 0) return -1;
+    int64_t latency = now_us() - start;
+    drain(master, QUIET_US);
+    return latency;
+}
+
+/* background load: processes spinning on the CPU until they are killed */
+pid_t spawn_busy() {
+    pid_t pid = fork();
+    if (pid == 0) {
+        volatile uint64_t x = 0;
+        for (;;) x ++;
+    }
+    return pid;
+}
+
+/* the busy processes that were started, a failed fork left -1 */
+void kill_busy(const pid_t* busy, int count) {
+    for (int i = 0; i < count; ++ i) {
+        if (busy[i] <= 0) continue;
+        kill(busy[i], SIGKILL);
+        waitpid(busy[i], NULL, 0);
+    }
+}
+
+int compare_i64(const void* a, const void* b) {
+    int64_t x = *(const int64_t*) a, y = *(const int64_t*) b;
+    return (x > y) - (x < y);
+}
+
+int64_t percentile(const int64_t* sorted, int n, double p) {
+    int i = (int) (p * n);
+    return sorted[i < n ? i : n - 1];
+}
+
+/* one load level: a fresh VM, `count` keys, returns 0 if the VM could not be started */
+int run_level(struct options* opt, int load) {
+    int64_t* samples = malloc(opt->count * sizeof(int64_t));
+    if (!samples) return 0;
+    pid_t busy[MAX_BUSY];
+    for (int i = 0; i < load; ++ i) busy[i] = spawn_busy();
+
+    int master;
+    pid_t vm = spawn_on_pty(opt, &master);
+    if (vm < 0) {
+        kill_busy(busy, load);
+        free(samples);
+        return 0;
+    }
+    drain(master, 200000); /* the boot sequence */
+    for (const char* k = opt->prefix; *k; ++ k) {
+        if (write(master, k, 1) == 1) drain(master, QUIET_US);
+    }
+
+    int n = 0, lost = 0;
+    size_t key_count = strlen(opt->keys);
+    uint64_t interval = 1000000 / opt->rate;
+    uint64_t next = now_us();
+    for (int i = 0; i < opt->count; ++ i) {
+        int64_t latency = measure_key(master, opt->keys[i % key_count]);
+        if (latency < 0) lost ++; else samples[n ++] = latency;
+        next += interval;
+        uint64_t now = now_us();
+        if (next > now) usleep(next - now);
+    }
+
+    kill(vm, SIGINT);
+    drain(master, 50000);
+    kill(vm, SIGKILL);
+    waitpid(vm, NULL, 0);
+    close(master);
+    kill_busy(busy, load);
+
+    qsort(samples, n, sizeof(int64_t), compare_i64);
+    if (n) {
+        printf("%6d %8d %6d %9lld %9lld %9lld %9lld\n", load, n, lost,
+            (long long) percentile(samples, n, 0.50), (long long) percentile(samples, n, 0.99),
+            (long long) percentile(samples, n, 0.999), (long long) samples[n - 1]);
+    } else {
+        printf("%6d %8d %6d %9s %9s %9s %9s\n", load, n, lost, "-", "-", "-", "-");
+    }
+    fflush(stdout);
+    free(samples);
+    return 1;
+}
+
+void usage() {
+    printf("[Usage]: lc3-latency [options] [image-file1] ... [-- vm-options]\n");
+    printf("  --vm PATH          lc3-vm binary (default ./lc3-vm)\n");
+    printf("  --keys KEYS        keys typed in a cycle (default wasd)\n");
+    printf("  --prefix KEYS      typed once before measuring, e.g. y for 2048.obj\n");
+    printf("  --count N          keys per load level (default 200)\n");
+    printf("  --rate HZ          keys per second (default 20)\n");
+    printf("  --loads L1,L2,...  busy processes next to the VM (0 to 256), one run per level (default 0)\n");
+    exit(2);
+}
+
+int main(int argc, const char* argv[]) {
+    struct options opt = { .vm = "./lc3-vm", .keys = "wasd", .prefix = "", .count = 200, .rate = 20 };
+    const char* images[MAX_ARGS];
+    int image_count = 0;
+    int j = 1;
+    for (; j < argc; ++ j) {
+        if (strcmp(argv[j], "--") == 0) {
+            ++ j;
+            break;
+        } else if (strcmp(argv[j], "--vm") == 0 && j + 1 < argc) {
+            opt.vm = argv[++ j];
+        } else if (strcmp(argv[j], "--keys") == 0 && j + 1 < argc) {
+            opt.keys = argv[++ j];
+        } else if (strcmp(argv[j], "--prefix") == 0 && j + 1 < argc) {
+            opt.prefix = argv[++ j];
+        } else if (strcmp(argv[j], "--count") == 0 && j + 1 < argc) {
+            opt.count = atoi(argv[++ j]);
+        } else if (strcmp(argv[j], "--rate") == 0 && j + 1 < argc) {
+            opt.rate = atoi(argv[++ j]);
+        } else if (strcmp(argv[j], "--loads") == 0 && j + 1 < argc) {
+            char buf[256];
+            snprintf(buf, sizeof(buf), "%s", argv[++ j]);
+            for (char* l = strtok(buf, ","); l && opt.load_count < MAX_LOADS; l = strtok(NULL, ",")) {
+                opt.loads[opt.load_count] = atoi(l);
+                if (opt.loads[opt.load_count] < 0 || opt.loads[opt.load_count] > MAX_BUSY) {
+                    printf("A load must be 0 to %d busy processes: %s\n", MAX_BUSY, l);
+                    exit(2);
+                }
+                opt.load_count ++;
+            }
+        } else if (strncmp(argv[j], "--", 2) == 0) {
+            usage();
+        } else if (image_count < MAX_ARGS) {
+            images[image_count ++] = argv[j];
+        }
+    }
+    /* the VM gets its own options first, then the images */
+    for (; j < argc && opt.arg_count < MAX_ARGS; ++ j) opt.args[opt.arg_count ++] = argv[j];
+    for (int i = 0; i < image_count && opt.arg_count < MAX_ARGS; ++ i) opt.args[opt.arg_count ++] = images[i];
+    if (image_count == 0 || !opt.keys[0] || opt.count <= 0 || opt.rate <= 0) usage();
+    if (opt.load_count == 0) opt.loads[opt.load_count ++] = 0;
+
+    signal(SIGPIPE, SIG_IGN);
+    printf("latency in microseconds, %d keys at %d/s\n", opt.count, opt.rate);
+    printf("%6s %8s %6s %9s %9s %9s %9s\n", "load", "samples", "lost", "p50", "p99", "p999", "max");
+    for (int i = 0; i < opt.load_count; ++ i) {
+        if (!run_level(&opt, opt.loads[i])) {
+            printf("Failed to start %s on a pty, or to allocate memory\n", opt.vm);
+            exit(1);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,50 @@
+/*LC-3 static tracepoints*/
+
+#ifndef LC3_PROBES_H
+#define LC3_PROBES_H
+
+/*
+    USDT probes, provider `lc3`, for bpftrace and perf on a binary that was not rebuilt for it:
+        dispatch(pc, instr)               every instruction, before it runs
+        trap(vector, pc)                  every TRAP, pc is the address after it
+        kbsr(value) / kbdr(value)         a guest read of a keyboard register
+        image_load(path, origin, words)   read_image placed an image
+        session_start(vm)                 lc3-vm starts running a VM
+        session_stop(vm, status, instructions)
+    A probe is a single nop until a tracer attaches. Each one also has a semaphore, a counter the
+    kernel raises while the probe is attached, so dispatch can skip even reading its arguments:
+        if (PROBE_ENABLED(dispatch)) PROBE2(dispatch, pc, instr);
+    Built with LC3_USDT when <sys/sdt.h> (systemtap-sdt-dev) is there, otherwise these are empty.
+    scripts/bpftrace has a few ready-made scripts.
+*/
+#ifdef LC3_USDT
+
+#define _SDT_HAS_SEMAPHORES 1
+#include<sys/sdt.h>
+
+#define PROBE_SEMAPHORE(name) unsigned short lc3_##name##_semaphore __attribute__((unused, section(".probes")))
+#define PROBE_ENABLED(name) __builtin_expect(lc3_##name##_semaphore, 0)
+#define PROBE1(name, a) STAP_PROBE1(lc3, name, a)
+#define PROBE2(name, a, b) STAP_PROBE2(lc3, name, a, b)
+#define PROBE3(name, a, b, c) STAP_PROBE3(lc3, name, a, b, c)
+
+/* the semaphores themselves live in lc3.c */
+extern PROBE_SEMAPHORE(dispatch);
+extern PROBE_SEMAPHORE(trap);
+extern PROBE_SEMAPHORE(kbsr);
+extern PROBE_SEMAPHORE(kbdr);
+extern PROBE_SEMAPHORE(image_load);
+extern PROBE_SEMAPHORE(session_start);
+extern PROBE_SEMAPHORE(session_stop);
+
+#else
+
+#define PROBE_ENABLED(name) 0
+/* still "use" the arguments, so nothing is left unused without the probes */
+#define PROBE1(name, a) do { (void) (a); } while (0)
+#define PROBE2(name, a, b) do { (void) (a); (void) (b); } while (0)
+#define PROBE3(name, a, b, c) do { (void) (a); (void) (b); (void) (c); } while (0)
+
+#endif
+
+#endif
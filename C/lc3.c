@@ -2,142 +2,29 @@
 
 #include<stdio.h>
 #include<stdint.h>
-#include<signal.h>
+#include<string.h>
 /* unix only */
 #include<stdlib.h>
-#include<unistd.h>
-#include<fcntl.h>
-#include<sys/time.h>
-#include<sys/types.h>
-#include<sys/termios.h>
+#include<time.h>
 #include<sys/mman.h>
 
-// MEMORY MAPPED REGISTERS
-enum  {
-    MR_KBSR = 0xFE00, /* keyboard status */
-    MR_KBDR = 0xFE02 /* keyboard data */
-};
-
-// REGISTERS
-/*
-    A register is a slot for storing a single value on the CPU.
-    For the CPU to work with a piece of data, it has to be stored in one of the registers.
-    The LC-3 has 10 registers, each of which is 16 bits.
-    - 8 general purposes (R0-R7)
-    - 1 program counter (PC)
-    - 1 condition flags (COND)
-*/
-enum 
-{
-    R_R0 = 0,
-    R_R1,
-    R_R2,
-    R_R3,
-    R_R4,
-    R_R5,
-    R_R6,
-    R_R7,
-    R_PC, /* program counter */
-    R_COND, /* condition flags */
-    R_COUNT
-};
-uint16_t reg[R_COUNT];
-
-// CONDITION FLAGS
-/*
-    The R_COND register stores condition flags which provide information about the most recently executed calculation.
-    This allows programs to check logical condition such as: if (x > 0) { ... }.
-    The LC-3 use only 3 condition flags which indicates sign of the previous calculation.
-*/
-
-enum {
-    FL_POS = 1 << 0, /* positive */
-    FL_ZRO = 1 << 1, /* zero */
-    FL_NEG = 1 << 2 /* negative */
-};
+#include "lc3.h"
+#include "lc3-probes.h"
 
-// INSTRUCTION
-/*
-    An instruction is a command which tells the CPU to do some fundamental task.
-    Intruction include: 
-    - an opcode which indicates the kind of task to perform
-    - a set of parameters which provides input to the task being performed
-    Each instruction is 16 bits long, with the left 4 bits storing the opcode, the rest for parameters 
+#ifdef LC3_USDT
+PROBE_SEMAPHORE(dispatch);
+PROBE_SEMAPHORE(trap);
+PROBE_SEMAPHORE(kbsr);
+PROBE_SEMAPHORE(kbdr);
+PROBE_SEMAPHORE(image_load);
+PROBE_SEMAPHORE(session_start);
+PROBE_SEMAPHORE(session_stop);
+#endif
 
-*/
-
-// OPCODE
-enum {
-    OP_BR = 0, /* branch */
-    OP_ADD, /* add */
-    OP_LD, /* load */
-    OP_ST, /* store*/
-    OP_JSR, /* jump register */
-    OP_AND, /* bitwise and */
-    OP_LDR, /* load register */
-    OP_STR, /* store register */
-    OP_RTI, /* unused */
-    OP_NOT, /* bitwise not */
-    OP_LDI, /* load indirect*/
-    OP_STI, /* store indirect */
-    OP_JMP, /* jump */
-    OP_RES, /* reserved (unused) */
-    OP_LEA, /* load effective address */
-    OP_TRAP /* execute trap */
-};
-
-// TRAP CODEs
-enum {
-    TRAP_GETC = 0x20,  /* get character from keyboard, not echo onto the terminal */
-    TRAP_OUT = 0x21,   /* output a character */
-    TRAP_PUTS = 0x22,  /* output a word string */
-    TRAP_IN = 0x23,    /* get character from keyboard, echo onto the terminal */
-    TRAP_PUTSP = 0x24, /* output a byte string */
-    TRAP_HALT = 0x25   /* halt the program */
-};
-
-/*
-    The LC-3 has (1<<16)=65536 memory locations each of which stores a 16-bit value
-*/
-#define MEMORY_MAX (1 << 16)
-uint16_t memory[MEMORY_MAX];
-
-/* Input Buffering (?? wtf) */
-struct termios original_tio;
-
-void disable_input_buffering()
-{
-    tcgetattr(STDIN_FILENO, &original_tio);
-    struct termios new_tio = original_tio;
-    new_tio.c_lflag &= ~ICANON & ~ECHO;
-    tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
-}
-
-void restore_input_buffering()
-{
-    tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
-}
-
-uint16_t check_key()
-{
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(STDIN_FILENO, &readfds);
-
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 0;
-    return select(1, &readfds, NULL, NULL, &timeout) != 0;
-}
-
-void handle_interrupt(int signal)
-{
-    restore_input_buffering();
-    printf("\n");
-    exit(-2);
-}
+uint16_t* image;
+uint16_t* image_page[PAGE_COUNT];
 
-void update_flags(uint16_t r) {
+void update_flags(uint16_t* reg, uint16_t r) {
     if (reg[r] == 0) {
         reg[R_COND] = FL_ZRO;
     } else if (reg[r] >> 15) { // left-most bit = 1 => negative, read Two's complement
@@ -164,83 +51,367 @@ uint16_t swap16(uint16_t x) {
     return (x << 8) | (x >> 8);
 }
 
-void read_image_file(FILE* file) {
+/* 
+    The image is mapped anonymously, so the kernel only backs the pages a program actually fills,
+    the rest read as its shared zero page.
+*/
+int image_alloc() {
+    void* p = mmap(NULL, MEMORY_MAX * sizeof(uint16_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return 0;
+    image = p;
+    for (int i = 0; i < PAGE_COUNT; ++ i) image_page[i] = image + (i << PAGE_BITS);
+    return 1;
+}
+
+void image_free() {
+    munmap(image, MEMORY_MAX * sizeof(uint16_t));
+    image = NULL;
+}
+
+/* after loading, nobody may write into the image anymore: VMs copy a page before writing */
+void image_seal() {
+    mprotect(image, MEMORY_MAX * sizeof(uint16_t), PROT_READ);
+}
+
+/* place a program that is already in memory, e.g. a hand-assembled one */
+void image_load_words(uint16_t origin, const uint16_t* words, size_t count) {
+    if (count > (size_t) (MEMORY_MAX - origin)) count = MEMORY_MAX - origin;
+    memcpy(image + origin, words, count * sizeof(uint16_t));
+}
+
+/* returns the number of words placed, at *origin_out */
+size_t read_image_file(FILE* file, uint16_t* origin_out) {
     /* the origin tells up where in memory to place the image */
     uint16_t origin;
     fread(&origin, sizeof(origin), 1, file);
     origin = swap16(origin);
     /* we know the maximum file size so we only need one fread */
     uint16_t max_read = MEMORY_MAX - origin;
-    uint16_t* p = memory + origin;
+    uint16_t* p = image + origin;
     size_t len = fread(p, sizeof(uint16_t), max_read, file);
+    size_t words = len;
+    *origin_out = origin;
     /* swap to little-end */
     while (len > 0)  {
         len --;
         *p = swap16(*p);
         ++ p;
     }
+    return words;
 }
 
 int read_image(const char* image_path) {
     FILE* file = fopen(image_path, "rb");
     if (!file) return 0;
-    read_image_file(file);
+    uint16_t origin;
+    size_t words = read_image_file(file, &origin);
+    PROBE3(image_load, image_path, origin, words);
     fclose(file);
     return 1;
 }
 
-/* Memory Access */
-void mem_write(uint16_t address, uint16_t data) {
-    memory[address] = data;
+uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t fnv1a(const void* data, size_t size, uint64_t h) {
+    const uint8_t* b = data;
+    for (size_t i = 0; i < size; ++ i) h = (h ^ b[i]) * FNV_PRIME;
+    return h;
 }
 
-uint16_t mem_read(uint16_t address) {
-    if (address == MR_KBSR) {
-        if (check_key()) {
-            memory[MR_KBSR] = (1 << 15);
-            memory[MR_KBDR] = getchar();
-        } else {
-            memory[MR_KBSR] = 0;
+/* FNV-1a over the words of a page */
+uint64_t page_hash(const uint16_t* data) {
+    uint64_t h = FNV_OFFSET;
+    for (int i = 0; i < PAGE_SIZE; ++ i) {
+        h = (h ^ data[i]) * FNV_PRIME;
+    }
+    return h;
+}
+
+/* Memory Access */
+/*
+    The validator's log: a VM records each device read (the keyboard registers after it and the value
+    it returned), a shadow copy takes them back instead of reading the device.
+*/
+void device_log_step(struct vm* vm, uint16_t* value) {
+    struct device_log* log = vm->device_log;
+    if (!log) return;
+    if (vm->shadow) {
+        if (log->next < log->count && log->next < DEVICE_LOG_MAX) {
+            vm->kbsr = log->kbsr[log->next];
+            vm->kbdr = log->kbdr[log->next];
+            *value = log->value[log->next];
         }
+        log->next ++;
+    } else {
+        if (log->count < DEVICE_LOG_MAX) {
+            log->kbsr[log->count] = vm->kbsr;
+            log->kbdr[log->count] = vm->kbdr;
+            log->value[log->count] = *value;
+        }
+        log->count ++;
+    }
+}
+
+/*
+    A script that promised more keys has run dry (input_dry) and the guest asks for one: the
+    instruction asking is undone and the run ends with VM_INPUT, so that giving the guest more keys
+    and running again continues exactly as if they had been there all along. It is the same point a
+    snapshot is taken at. Nothing has written a register of the instruction yet when this is called,
+    only the PC is past it; the engine stops right after and calls vm_input_undo.
+*/
+void vm_input_stop(struct vm* vm) {
+    memcpy(vm->stop_reg, vm->reg, sizeof(vm->stop_reg));
+    vm->stop_reg[R_PC] -= 1;
+    vm->input_stop = 1;
+}
+
+/* at the end of a run: whether it ended because the guest printed something and output_yield is set */
+int vm_output_stopped(struct vm* vm) {
+    if (!vm->output_stop) return 0;
+    vm->output_stop = 0;
+    return 1;
+}
+
+/* at the end of a run: back to before the instruction that stopped it, returns 1 if there was one */
+int vm_input_undo(struct vm* vm) {
+    if (!vm->input_stop) return 0;
+    vm->input_stop = 0;
+    memcpy(vm->reg, vm->stop_reg, sizeof(vm->reg));
+    if (vm->perf) {
+        uint16_t pc = vm->reg[R_PC];
+        vm->perf->ops[vm->page[pc >> PAGE_BITS][pc & PAGE_MASK] >> 12] --;
+    }
+    return 1;
+}
+
+/* the keyboard registers, for device_read */
+uint16_t keyboard_read(struct vm* vm, uint16_t address) {
+    uint16_t value;
+    switch (address) {
+        case MR_KBSR:
+            if (!vm->shadow) {
+                METRIC_ADD(kbsr_polls, 1);
+                out_frame();
+                snapshot_point(vm);
+                if (input_wait(0)) {
+                    vm->kbsr = (1 << 15);
+                    vm->kbdr = read_key(vm);
+                } else if (input_dry()) {
+                    vm_input_stop(vm);
+                    return 0;
+                } else {
+                    vm->kbsr = 0;
+                    vm_idle(vm);
+                }
+            }
+            value = vm->kbsr;
+            device_log_step(vm, &value);
+            PROBE1(kbsr, value);
+            return value;
+        default:
+            value = vm->kbdr;
+            device_log_step(vm, &value);
+            PROBE1(kbdr, value);
+            return value;
     }
-    return memory[address];
 }
 
-int main(int argc, const char *argv[]) {
-    // LOAD ARGUMENT
-    if (argc < 2) {
-        /* show usage */
-        printf("[Usage]: lc3-vm [image-file1] ...\n");
-        exit(2);
+uint16_t device_read(struct vm* vm, uint16_t address) {
+    uint16_t value;
+    if (address >= PERF_FIRST && address <= PERF_LAST) {
+        value = vm->shadow ? 0 : perf_read(vm, address);
+        device_log_step(vm, &value);
+        return value;
     }
+    if (address >= SMP_FIRST && address <= SMP_LAST) return smp_read(vm, address);
+    if (address >= BLK_FIRST && address <= BLK_LAST) return block_read(vm, address);
+    if (address >= XMEM_FIRST && address <= XMEM_LAST) return xmem_read(vm, address);
+    if (address != MR_KBSR && address != MR_KBDR) return vm->page[address >> PAGE_BITS][address & PAGE_MASK];
+    if (vm->cores < 2) return keyboard_read(vm, address);
+    /* one keyboard for all cores */
+    smp_lock();
+    value = keyboard_read(vm, address);
+    smp_unlock();
+    return value;
+}
 
-    for (int j = 1; j < argc; ++ j) {
-        if (!read_image(argv[j])) {
-            printf("Failed to load image: %s\n", argv[j]);
-            exit(1);
+void mem_write(struct vm* vm, uint16_t address, uint16_t data) {
+    if (address >= DEVICE_BASE) {
+        if (address == MR_KBSR) {
+            vm->kbsr = data;
+            return;
+        }
+        if (address == MR_KBDR) {
+            vm->kbdr = data;
+            return;
+        }
+        if (address >= PERF_FIRST && address <= PERF_LAST) {
+            perf_write(vm, address, data);
+            return;
+        }
+        if (address >= SMP_FIRST && address <= SMP_LAST) {
+            smp_write(vm, address, data);
+            return;
+        }
+        if (address >= BLK_FIRST && address <= BLK_LAST) {
+            block_write(vm, address, data);
+            return;
+        }
+        if (address >= XMEM_FIRST && address <= XMEM_LAST) {
+            xmem_write(vm, address, data);
+            return;
         }
     }
+    uint16_t p = address >> PAGE_BITS;
+    if (vm->page_kind[p] != PG_PRIVATE) page_make_private(vm, p);
+    vm->page_hot[p] = 1;
+    vm->page[p][address & PAGE_MASK] = data;
+}
 
+uint16_t mem_read(struct vm* vm, uint16_t address) {
+    if (address >= DEVICE_BASE) return device_read(vm, address);
+    return vm->page[address >> PAGE_BITS][address & PAGE_MASK];
+}
+
+// TRAP ROUTINES
+/*
+    Set by lc3-vm's SIGINT handler, which does nothing else: a guest waiting for a key halts, and the
+    run loops look at it between slices, so the program leaves through its normal shutdown.
+*/
+volatile sig_atomic_t vm_interrupted;
 
-    // SETUP
-    signal(SIGINT, handle_interrupt);
-    disable_input_buffering();
+/* wait for a key, idle work meanwhile; 0 if the wait was interrupted */
+int vm_wait_input(struct vm* vm) {
+    while (!input_wait(IDLE_TICK_US)) {
+        if (vm_interrupted) return 0;
+        vm_idle(vm);
+    }
+    return 1;
+}
+
+/* runs the trap routine for `vector`, returns 0 when the guest halts (or stops for input) */
+int vm_trap_routine(struct vm* vm, uint16_t vector) {
+    uint16_t* reg = vm->reg;
+    if ((vector == TRAP_GETC || vector == TRAP_IN) && input_dry()) {
+        vm_input_stop(vm);
+        return 0;
+    }
+    PROBE2(trap, vector, reg[R_PC]);
+    METRIC_ADD(traps[vector >= TRAP_GETC && vector <= TRAP_HALT ? vector - TRAP_GETC : METRIC_TRAPS - 1], 1);
+    reg[R_R7] = reg[R_PC];
+    switch (vector) {
+        case TRAP_GETC:
+            {
+                out_frame();
+                snapshot_point(vm);
+                if (!vm_wait_input(vm)) return 0;
+                reg[R_R0] = read_key(vm);
+                update_flags(reg, R_R0);
+            }
+            break;
+        case TRAP_OUT:
+            {
+                out_putc((char) reg[R_R0]);
+                out_flush();
+            }
+            break;
+        case TRAP_PUTS:
+            {
+                vm_puts(vm, reg[R_R0]);
+                out_flush();
+            }
+            break;
+        case TRAP_IN:
+            {
+                snapshot_point(vm);
+                out_write("Enter a character: ", 19);
+                /* the frame with the prompt on it, before the wait */
+                out_frame();
+                if (!vm_wait_input(vm)) return 0;
+                char c = read_key(vm);
+                out_putc(c);
+                out_flush();
+                reg[R_R0] = (uint16_t) c;
+                update_flags(reg, R_R0);
+            }
+            break;
+        case TRAP_PUTSP:
+            {
+                /* one char per byte (two bytes per word), low byte first */
+                vm_putsp(vm, reg[R_R0]);
+                out_flush();
+            }
+            break;
+        case TRAP_HALT:
+            {
+                out_write("HALT\n", 5);
+                out_flush();
+                return 0;
+            }
+            break;                        
+    }
+    if (vm->output_yield && vector >= TRAP_OUT && vector <= TRAP_PUTSP) {
+        /* the trap is done, the run ends after it so the host can take the output */
+        vm->output_stop = 1;
+        return 0;
+    }
+    return 1;
+}
 
-    // MAIN LOOP
-    /* since exactly one conditon flag should be given at any given time, set the Z flag*/
-    reg[R_COND] = FL_ZRO;
+int vm_trap(struct vm* vm, uint16_t vector) {
+    if (vm->cores < 2) return vm_trap_routine(vm, vector);
+    /* the terminal and the key queue are one for all cores */
+    smp_lock();
+    int running = vm_trap_routine(vm, vector);
+    smp_unlock();
+    return running;
+}
 
-    /* set the PC to starting position, which default is 0x3000 */
-    enum {
-        PC_START = 0x3000,
-    };
-    reg[R_PC] = PC_START;
+// EXECUTION
+/*
+    The switch's memory access. Only an access to the device page publishes the instructions run so
+    far (vm->pending, for the performance counters), and once the counters are switched on the plain
+    loop ends after this instruction (its end is moved to it), like DEVICE in threaded.c.
+*/
+#define RUN_DEVICE(access) do { \
+        vm->pending = count; \
+        access; \
+        if (!counting && vm->perf) end = count; \
+    } while (0)
+#define RUN_READ(address) ({ \
+        uint16_t a_ = (address), d_; \
+        if (a_ < DEVICE_BASE) d_ = vm->page[a_ >> PAGE_BITS][a_ & PAGE_MASK]; \
+        else RUN_DEVICE(d_ = device_read(vm, a_)); \
+        d_; \
+    })
+#define RUN_WRITE(address, data) do { \
+        uint16_t a_ = (address); \
+        if (a_ < DEVICE_BASE) mem_write(vm, a_, (data)); \
+        else RUN_DEVICE(mem_write(vm, a_, (data))); \
+    } while (0)
 
+/*
+    The instructions of vm_run from `count` on, up to `budget`, returns the new count. With `counting`
+    (a constant, so there are two copies) each opcode is counted for the performance counters. The
+    plain copy leaves when the guest switches the counters on, and vm_run goes on in the counting one.
+*/
+static inline __attribute__((always_inline))
+uint64_t vm_run_loop(struct vm* vm, uint64_t count, uint64_t budget, int* running_out, const int counting) {
+    uint16_t* reg = vm->reg;
     int running = 1;
-    while (running) {
+    uint64_t end = budget;
+    while (count < end) {
+        ++ count;
         /* FETCH */
-        uint16_t instr = mem_read(reg[R_PC] ++);
+        vm->sample_pc = reg[R_PC];
+        uint16_t instr = RUN_READ(reg[R_PC] ++);
+        if (PROBE_ENABLED(dispatch)) PROBE2(dispatch, (uint16_t) (reg[R_PC] - 1), instr);
         uint16_t op = instr >> 12; /* remember the left 4 bits is for opcode*/
+        if (counting) vm->perf->ops[op] ++;
         switch (op) {
             case OP_ADD:
                 {
@@ -257,7 +428,7 @@ int main(int argc, const char *argv[]) {
                         uint16_t r2 = instr & 0x7;
                         reg[r0] = reg[r1] + reg[r2];
                     }
-                    update_flags(r0);
+                    update_flags(reg, r0);
                 }
                 break;
             case OP_AND:
@@ -275,7 +446,7 @@ int main(int argc, const char *argv[]) {
                         uint16_t r2 = instr & 0x7;
                         reg[r0] = reg[r1] & reg[r2];
                     }
-                    update_flags(r0);
+                    update_flags(reg, r0);
                 }
                 break;
             case OP_NOT:
@@ -283,7 +454,7 @@ int main(int argc, const char *argv[]) {
                     uint16_t r0 = (instr >> 9) & 0x7;
                     uint16_t r1 = (instr >> 6) & 0x7;
                     reg[r0] = ~reg[r1];
-                    update_flags(r0);
+                    update_flags(reg, r0);
                 }
                 break;
             case OP_BR:
@@ -321,8 +492,8 @@ int main(int argc, const char *argv[]) {
                     /* destination register DR */
                     uint16_t r0 = (instr >> 9) & 0x7;
                     uint16_t pc_offset = sign_extend((instr & 0x1FF), 9);
-                    reg[r0] = mem_read(reg[R_PC] + pc_offset);
-                    update_flags(r0);
+                    reg[r0] = RUN_READ(reg[R_PC] + pc_offset);
+                    update_flags(reg, r0);
                 }
                 break;
             case OP_LDI:
@@ -332,8 +503,8 @@ int main(int argc, const char *argv[]) {
                     /* PCoffset 9 */
                     uint16_t pc_offset = sign_extend((instr & 0x1FF), 9); // 0x1FF = 0001 1111 1111 -> right-most 9 bits
                     /* add pc_offsrt to current PC, look at that memory location to get final address */
-                    reg[r0] = mem_read(mem_read(reg[R_PC] + pc_offset));
-                    update_flags(r0);
+                    reg[r0] = RUN_READ(RUN_READ(reg[R_PC] + pc_offset));
+                    update_flags(reg, r0);
                 }
                 break;
             case OP_LDR:
@@ -343,8 +514,8 @@ int main(int argc, const char *argv[]) {
                     /* BaseR */
                     uint16_t r1 = (instr >> 6) & 0x7;
                     uint16_t pc_offset = sign_extend((instr & 0x3F), 6);
-                    reg[r0] = mem_read(reg[r1] + pc_offset);
-                    update_flags(r0);
+                    reg[r0] = RUN_READ(reg[r1] + pc_offset);
+                    update_flags(reg, r0);
                 }
                 break;
             case OP_LEA:
@@ -353,7 +524,7 @@ int main(int argc, const char *argv[]) {
                     uint16_t r0 = (instr >> 9) & 0x7;
                     uint16_t pc_offset = sign_extend((instr & 0x1FF), 9);
                     reg[r0] = reg[R_PC] + pc_offset;
-                    update_flags(r0);
+                    update_flags(reg, r0);
                 }
                 break;
             case OP_ST:
@@ -361,7 +532,7 @@ int main(int argc, const char *argv[]) {
                     /* source register SR */
                     uint16_t r1 = (instr >> 9) & 0x7;
                     uint16_t pc_offset = sign_extend((instr & 0x1FF), 9);
-                    mem_write(reg[R_PC] + pc_offset, reg[r1]);
+                    RUN_WRITE(reg[R_PC] + pc_offset, reg[r1]);
                 }
                 break;
             case OP_STI:
@@ -369,7 +540,7 @@ int main(int argc, const char *argv[]) {
                     /* source register SR */
                     uint16_t r1 = (instr >> 9) & 0x7;
                     uint16_t pc_offset = sign_extend((instr & 0x1FF), 9);
-                    mem_write(mem_read(reg[R_PC] + pc_offset), reg[r1]);
+                    RUN_WRITE(RUN_READ(reg[R_PC] + pc_offset), reg[r1]);
                 }
                 break;
             case OP_STR:
@@ -379,69 +550,12 @@ int main(int argc, const char *argv[]) {
                     /* BaseR */
                     uint16_t r2 = (instr >> 6) & 0x7;
                     uint16_t pc_offset = sign_extend((instr & 0x3F), 6);
-                    mem_write(reg[r2] + pc_offset, reg[r1]);
+                    RUN_WRITE(reg[r2] + pc_offset, reg[r1]);
                 }
                 break;
             case OP_TRAP:
-                {
-                    reg[R_R7] = reg[R_PC];
-                    switch (instr & 0xFF) {
-                        case TRAP_GETC:
-                            {
-                                reg[R_R0] = (uint16_t) getchar();
-                                update_flags(R_R0);
-                            }
-                            break;
-                        case TRAP_OUT:
-                            {
-                                putc((char) reg[R_R0], stdout);
-                                fflush(stdout);   
-                            }
-                            break;
-                        case TRAP_PUTS:
-                            {
-                                uint16_t* c = memory + reg[R_R0];
-                                while (*c) {
-                                    putc((char)*c, stdout);
-                                    ++ c;
-                                }
-                                fflush(stdout);
-                            }
-                            break;
-                        case TRAP_IN:
-                            {
-                                printf("Enter a character: ");
-                                char c = getchar();
-                                putc(c, stdout);
-                                fflush(stdout);
-                                reg[R_R0] = (uint16_t) c;
-                                update_flags(R_R0);
-                            }
-                            break;
-                        case TRAP_PUTSP:
-                            {
-                                /* one char per byte (two bytes per word) -> need swap back to big-end*/
-                                uint16_t *c = memory + reg[R_R0];
-                                while (*c) {
-                                    char char1 = *c & 0xFF; // 1111 1111, take last 8 bits = 1 byte
-                                    putc(char1, stdout);
-                                    char char2 = *c >> 8; // first 8 bits
-                                    if (char2) putc(char2, stdout);
-                                    ++ c;
-                                }
-                                fflush(stdout);
-                                
-                            }
-                            break;
-                        case TRAP_HALT:
-                            {
-                                puts("HALT");
-                                fflush(stdout);
-                                running = 0;
-                            }
-                            break;                        
-                    }
-                }
+                vm->pending = count;
+                running = vm_trap(vm, instr & 0xFF);
                 break;
             case OP_RES:
             case OP_RTI:
@@ -450,9 +564,56 @@ int main(int argc, const char *argv[]) {
                 abort();
                 break;
         }
+        if (!running || vm->input_stop) break;
     }
-    
-    // SHUTDOWN
-    restore_input_buffering();
+    *running_out = running;
+    return count;
+}
 
-}
\ No newline at end of file
+uint64_t vm_run_plain(struct vm* vm, uint64_t count, uint64_t budget, int* running) {
+    return vm_run_loop(vm, count, budget, running, 0);
+}
+
+uint64_t vm_run_counting(struct vm* vm, uint64_t count, uint64_t budget, int* running) {
+    return vm_run_loop(vm, count, budget, running, 1);
+}
+
+#undef RUN_DEVICE
+#undef RUN_READ
+#undef RUN_WRITE
+
+/*
+    Runs the guest until it halts, or for at most `budget` instructions.
+    The state stays in the VM, so calling it again simply continues.
+    A guest that never touches the performance counters pays nothing for them: no opcode count and
+    no store of vm->pending per instruction, it only moves over to the counting copy once it does.
+*/
+int vm_run(struct vm* vm, uint64_t budget) {
+    uint64_t count = 0;
+    int running = 1;
+    SAMPLE_ENTER(vm, ENGINE_SWITCH);
+    while (running && count < budget && !vm->input_stop) {
+        count = vm->perf ? vm_run_counting(vm, count, budget, &running) : vm_run_plain(vm, count, budget, &running);
+    }
+    SAMPLE_LEAVE();
+    int stopped = vm_input_undo(vm);
+    count -= stopped;
+    vm->instructions += count;
+    vm->pending = 0;
+    if (!vm->shadow) METRIC_ADD(instructions, count);
+    if (stopped) return VM_INPUT;
+    if (vm_output_stopped(vm)) return VM_OUTPUT;
+    return running ? VM_BUDGET : VM_HALTED;
+}
+
+/* in the order of ENGINE_SWITCH and friends */
+const struct engine engines[] = {
+    { "switch", vm_run },
+    { "threaded", vm_run_threaded },
+};
+const int engine_count = sizeof(engines) / sizeof(engines[0]);
+
+const char* vm_status_name(int status) {
+    static const char* const names[] = { "halted", "budget", "diverged", "input", "output", "throttled", "quota" };
+    return status >= 0 && status < (int) (sizeof(names) / sizeof(names[0])) ? names[status] : "unknown";
+}
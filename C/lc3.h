@@ -0,0 +1,523 @@
+/*LC-3 Architecture*/
+
+#ifndef LC3_H
+#define LC3_H
+
+#include<stdio.h>
+#include<stdint.h>
+#include<stddef.h>
+#include<signal.h>
+
+// MEMORY MAPPED REGISTERS
+enum  {
+    MR_KBSR = 0xFE00, /* keyboard status */
+    MR_KBDR = 0xFE02, /* keyboard data */
+    /* performance counters (perfctr.c): 32-bit values, reading the low word latches the high one */
+    MR_PERF_INSN_LO = 0xFE10, /* instructions retired */
+    MR_PERF_INSN_HI,
+    MR_PERF_CYCLE_LO,         /* estimated cycles since the guest first touched the counters */
+    MR_PERF_CYCLE_HI,
+    MR_PERF_USEC_LO,          /* host clock in microseconds */
+    MR_PERF_USEC_HI,
+    MR_PERF_SELECT,           /* opcode (0-15) whose count MR_PERF_OP_LO/HI show */
+    MR_PERF_OP_LO,            /* instructions of the selected opcode since the first touch */
+    MR_PERF_OP_HI,
+    /* cores and atomics (smp.c) */
+    MR_CORE_ID = 0xFE20,      /* the number of the core reading it, 0 to MR_CORE_COUNT - 1 */
+    MR_CORE_COUNT,
+    MR_ATOMIC_ADDR,           /* the word the atomic registers work on, one per core */
+    MR_ATOMIC_VALUE,          /* what a read of MR_ATOMIC_FADD adds, one per core */
+    MR_ATOMIC_TAS,            /* read: set the word to 1 and return the old value, write: store */
+    MR_ATOMIC_FADD,           /* read: add MR_ATOMIC_VALUE and return the old value, write: add */
+    /* block storage (block.c) */
+    MR_BLK_BLOCK = 0xFE30,    /* block number */
+    MR_BLK_ADDR,              /* guest address of the 256-word buffer */
+    MR_BLK_CMD,               /* write a command to transfer one block */
+    MR_BLK_STATUS,            /* BLK_READY and BLK_FAILED */
+    MR_BLK_COUNT,             /* blocks on the disk */
+    /* extended memory (xmem.c) */
+    MR_XMEM_BANK = 0xFE40,    /* the bank mapped into the window, XMEM_NONE for none */
+    MR_XMEM_BANKS             /* banks in the store */
+};
+
+/* MR_BLK_CMD and MR_BLK_STATUS */
+enum {
+    BLK_READ = 1,             /* file to memory */
+    BLK_WRITE = 2,            /* memory to file */
+    BLK_COMMAND = 0x00FF,
+    BLK_ASYNC = 0x8000,       /* return at once, MR_BLK_STATUS tells when it is done */
+    BLK_READY = 0x8000,       /* nothing in flight */
+    BLK_FAILED = 0x4000,      /* the last command failed */
+    BLK_BUSY = 0x0001,        /* internal: the worker has the request */
+    BLK_DELIVER = 0x0002      /* internal: read into the bounce buffer, not in memory yet */
+};
+
+// REGISTERS
+/*
+    A register is a slot for storing a single value on the CPU.
+    For the CPU to work with a piece of data, it has to be stored in one of the registers.
+    The LC-3 has 10 registers, each of which is 16 bits.
+    - 8 general purposes (R0-R7)
+    - 1 program counter (PC)
+    - 1 condition flags (COND)
+*/
+enum 
+{
+    R_R0 = 0,
+    R_R1,
+    R_R2,
+    R_R3,
+    R_R4,
+    R_R5,
+    R_R6,
+    R_R7,
+    R_PC, /* program counter */
+    R_COND, /* condition flags */
+    R_COUNT
+};
+
+// CONDITION FLAGS
+/*
+    The R_COND register stores condition flags which provide information about the most recently executed calculation.
+    This allows programs to check logical condition such as: if (x > 0) { ... }.
+    The LC-3 use only 3 condition flags which indicates sign of the previous calculation.
+*/
+
+enum {
+    FL_POS = 1 << 0, /* positive */
+    FL_ZRO = 1 << 1, /* zero */
+    FL_NEG = 1 << 2 /* negative */
+};
+
+// INSTRUCTION
+/*
+    An instruction is a command which tells the CPU to do some fundamental task.
+    Intruction include: 
+    - an opcode which indicates the kind of task to perform
+    - a set of parameters which provides input to the task being performed
+    Each instruction is 16 bits long, with the left 4 bits storing the opcode, the rest for parameters 
+
+*/
+
+// OPCODE
+enum {
+    OP_BR = 0, /* branch */
+    OP_ADD, /* add */
+    OP_LD, /* load */
+    OP_ST, /* store*/
+    OP_JSR, /* jump register */
+    OP_AND, /* bitwise and */
+    OP_LDR, /* load register */
+    OP_STR, /* store register */
+    OP_RTI, /* unused */
+    OP_NOT, /* bitwise not */
+    OP_LDI, /* load indirect*/
+    OP_STI, /* store indirect */
+    OP_JMP, /* jump */
+    OP_RES, /* reserved (unused) */
+    OP_LEA, /* load effective address */
+    OP_TRAP /* execute trap */
+};
+
+// TRAP CODEs
+enum {
+    TRAP_GETC = 0x20,  /* get character from keyboard, not echo onto the terminal */
+    TRAP_OUT = 0x21,   /* output a character */
+    TRAP_PUTS = 0x22,  /* output a word string */
+    TRAP_IN = 0x23,    /* get character from keyboard, echo onto the terminal */
+    TRAP_PUTSP = 0x24, /* output a byte string */
+    TRAP_HALT = 0x25   /* halt the program */
+};
+
+/*
+    The LC-3 has (1<<16)=65536 memory locations each of which stores a 16-bit value
+*/
+#define MEMORY_MAX (1 << 16)
+
+// MEMORY PAGES
+/*
+    Instead of a flat 128 KiB array per VM, memory is split into 256 pages of 256 words.
+    Each VM reads through its own page table, so an access is still a single indirection:
+        page[address >> 8][address & 0xFF]
+    - image pages hold the loaded program, they are read-only and shared by every VM
+    - private pages are copied from the image page the first time a VM writes into it
+    So a VM only pays for the pages it has actually written to.
+*/
+#define PAGE_BITS 8
+#define PAGE_SIZE (1 << PAGE_BITS)
+#define PAGE_MASK (PAGE_SIZE - 1)
+#define PAGE_COUNT (MEMORY_MAX >> PAGE_BITS)
+
+enum {
+    PG_IMAGE = 0, /* points into the shared image */
+    PG_PRIVATE,   /* owned by this VM */
+    PG_SHARED,    /* merged with identical pages of other VMs, copied again on write */
+    PG_MERGED,    /* was private, found identical to the image and pointed back to it */
+    PG_PACKED,    /* private, compressed while the VM is parked */
+    PG_BANK       /* a page of an extended memory bank, written in place */
+};
+
+/* every page that is not part of the image carries a small header in front of its words */
+struct page {
+    struct page* next; /* hash chain of the shared pages */
+    uint64_t hash;
+    uint32_t ref;      /* VMs pointing at a shared page */
+    uint16_t data[PAGE_SIZE];
+};
+#define PAGE_BYTES (PAGE_SIZE * sizeof(uint16_t))
+#define page_of(words) ((struct page*) ((char*) (words) - offsetof(struct page, data)))
+
+/* the loaded program, MEMORY_MAX words, sealed read-only once the images are loaded */
+extern uint16_t* image;
+/* where each VM starts reading a page from, usually into `image` but a snapshot can map its own pages */
+extern uint16_t* image_page[PAGE_COUNT];
+
+/*
+    What the keyboard registers returned to a VM during one validated block: the VM records every read
+    of KBSR/KBDR, and the shadow copy running the same block on the reference engine replays them,
+    so both see the same keys without the copy taking any from the input.
+*/
+#define DEVICE_LOG_MAX 128
+struct device_log {
+    int count; /* reads recorded, more than DEVICE_LOG_MAX means some were lost */
+    int next;  /* the next one to replay */
+    uint16_t kbsr[DEVICE_LOG_MAX], kbdr[DEVICE_LOG_MAX];
+    uint16_t value[DEVICE_LOG_MAX]; /* what the read returned */
+};
+
+/* the block device registers of one VM */
+struct block_regs {
+    uint16_t block, addr, cmd;
+    uint16_t state;        /* BLK_BUSY, BLK_DELIVER, BLK_FAILED; the worker changes it */
+    uint16_t* buf;         /* bounce buffer of asynchronous transfers, allocated by the first */
+    struct vm* next;       /* in the worker's queue */
+};
+
+/* the guest-visible counters, allocated the first time the guest touches one */
+struct perf_counters {
+    uint64_t ops[16];  /* instructions by opcode */
+    uint16_t select;
+    uint16_t latch;    /* high word of the last 32-bit value whose low word was read */
+};
+
+struct vm {
+    uint16_t reg[R_COUNT];
+    uint16_t kbsr, kbdr; /* keyboard device registers */
+    uint16_t* page[PAGE_COUNT];
+    uint8_t page_kind[PAGE_COUNT];
+    uint8_t page_hot[PAGE_COUNT]; /* written since the deduplicator last looked */
+    uint32_t private_pages;
+    uint64_t idle_since; /* when the VM started waiting for a key, 0 = busy */
+    uint64_t instructions; /* executed by vm_run so far */
+    uint64_t pending;      /* executed by the current run but not in `instructions` yet, kept up to date at device reads */
+    volatile uint16_t sample_pc; /* the instruction running, kept up to date by every engine for the sampling profiler's signal handler */
+    struct perf_counters* perf; /* NULL until the guest reads or writes the counter device */
+    struct device_log* device_log; /* set by the validator, see below */
+    int shadow;            /* a copy run by the validator: replays device_log instead of touching the input */
+    int input_stop;        /* the current instruction asked for a key the script does not have yet */
+    int output_yield;      /* end the run with VM_OUTPUT after a trap that printed (embed.c) */
+    int output_stop;
+    uint8_t core, cores;   /* in a multi-core machine (smp.c), cores is 0 otherwise */
+    uint16_t atomic_addr, atomic_value; /* MR_ATOMIC_ADDR and MR_ATOMIC_VALUE */
+    struct block_regs blk;
+    struct xmem_window* xmem; /* NULL until the guest first maps a bank */
+    struct quota* quota;   /* NULL = no limits */
+    struct embed* embed;   /* its own input and output, NULL unless embed_open */
+    uint16_t stop_reg[R_COUNT]; /* the registers from before it, PC on it */
+    struct vm* prev;   /* every live VM is on vm_list */
+    struct vm* next;
+};
+extern struct vm* vm_list;
+
+// EXECUTION
+/* set the PC to starting position, which default is 0x3000 */
+enum {
+    PC_START = 0x3000,
+};
+
+/* why vm_run returned */
+enum {
+    VM_HALTED = 0, /* the guest ran TRAP_HALT */
+    VM_BUDGET,     /* the guest ran all the instructions it was given */
+    VM_DIVERGED,   /* the validator caught an engine disagreeing with the reference */
+    VM_INPUT,      /* the guest wants a key that is not in the script yet, see vm_input_stop */
+    VM_OUTPUT,     /* the guest printed something and output_yield is set, see embed.c */
+    VM_THROTTLED,  /* out of tokens for its rate, see quota.c */
+    VM_QUOTA       /* its total of instructions is spent */
+};
+/* "halted", "budget" and so on, for reports */
+const char* vm_status_name(int status);
+
+/*
+    The version of what the VM does: raise it with any change that makes a guest run differently
+    (an instruction, a trap, a device), so results remembered from an older VM are not reused.
+*/
+#define LC3_VM_VERSION 1
+
+/* how often a VM blocked in GETC/IN wakes up to do idle work */
+#define IDLE_TICK_US 10000
+
+/*
+    An engine is one way of running the guest, with the interface of vm_run.
+    The switch in vm_run (engines[0]) is the reference: every other engine must give exactly the same
+    registers, memory and output, which is what lc3-conform checks for every entry of `engines`.
+*/
+struct engine {
+    const char* name;
+    int (*run)(struct vm* vm, uint64_t budget);
+};
+extern const struct engine engines[];
+extern const int engine_count;
+
+/* the index of each engine in `engines`, for what they publish in sample_slot */
+enum {
+    ENGINE_SWITCH = 0,
+    ENGINE_THREADED
+};
+
+/*
+    What the calling thread is running, for the sampling profiler's signal handler (sample.c):
+    an engine sets it when it starts and clears it when it returns.
+*/
+struct sample_slot {
+    struct vm* volatile vm; /* NULL outside the engines */
+    volatile int engine;
+};
+extern __thread struct sample_slot sample_slot;
+#define SAMPLE_ENTER(v, e) do { sample_slot.engine = (e); sample_slot.vm = (v); } while (0)
+#define SAMPLE_LEAVE() (sample_slot.vm = NULL)
+
+/*
+    The memory mapped registers live at 0xFE00 and above (the device page),
+    so ordinary addresses only pay one compare before the page lookup.
+*/
+#define DEVICE_BASE MR_KBSR
+
+/* lc3.c: the CPU, images and memory access */
+void update_flags(uint16_t* reg, uint16_t r);
+uint16_t sign_extend(uint16_t x, int bit_count);
+uint16_t swap16(uint16_t x);
+int image_alloc();
+void image_free();
+void image_seal();
+void image_load_words(uint16_t origin, const uint16_t* words, size_t count);
+int read_image(const char* image_path);
+uint64_t now_us();
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+uint64_t fnv1a(const void* data, size_t size, uint64_t h);
+uint64_t page_hash(const uint16_t* data);
+void device_log_step(struct vm* vm, uint16_t* value);
+uint16_t device_read(struct vm* vm, uint16_t address);
+uint16_t mem_read(struct vm* vm, uint16_t address);
+void mem_write(struct vm* vm, uint16_t address, uint16_t data);
+void vm_input_stop(struct vm* vm);
+int vm_input_undo(struct vm* vm);
+int vm_output_stopped(struct vm* vm);
+int vm_trap(struct vm* vm, uint16_t vector);
+int vm_run(struct vm* vm, uint64_t budget);
+extern volatile sig_atomic_t vm_interrupted;
+int vm_wait_input(struct vm* vm);
+
+/* perfctr.c: the performance counter device */
+#define PERF_FIRST MR_PERF_INSN_LO
+#define PERF_LAST MR_PERF_OP_HI
+uint16_t perf_read(struct vm* vm, uint16_t address);
+void perf_write(struct vm* vm, uint16_t address, uint16_t data);
+
+/* smp.c: cores on host threads sharing one memory */
+#define SMP_MAX 64
+#define SMP_FIRST MR_CORE_ID
+#define SMP_LAST MR_ATOMIC_FADD
+uint16_t smp_read(struct vm* vm, uint16_t address);
+void smp_write(struct vm* vm, uint16_t address, uint16_t data);
+void smp_lock();
+void smp_unlock();
+struct vm* smp_create(int cores);
+struct vm* smp_core(int c);
+int smp_run(const struct engine* engine);
+void smp_destroy();
+
+/* block.c: the block storage device */
+#define BLK_FIRST MR_BLK_BLOCK
+#define BLK_LAST MR_BLK_COUNT
+int block_open(const char* path);
+void block_close();
+uint16_t block_read(struct vm* vm, uint16_t address);
+void block_write(struct vm* vm, uint16_t address, uint16_t data);
+void block_release(struct vm* vm);
+uint16_t block_settle(struct vm* vm);
+void block_copy(struct vm* to, struct vm* from);
+void block_print_stats(FILE* file);
+
+/* xmem.c: banks of extended memory switched into a window */
+#define XMEM_FIRST MR_XMEM_BANK
+#define XMEM_LAST MR_XMEM_BANKS
+#define XMEM_WINDOW 0xE000
+#define XMEM_BANK_WORDS 4096
+#define XMEM_NONE 0xFFFF
+int xmem_enable(uint32_t banks);
+void xmem_free();
+uint16_t* xmem_bank(uint16_t bank);
+int xmem_map(struct vm* vm, uint16_t bank);
+uint16_t xmem_unmap(struct vm* vm);
+uint16_t xmem_read(struct vm* vm, uint16_t address);
+void xmem_write(struct vm* vm, uint16_t address, uint16_t data);
+void xmem_copy(struct vm* to, struct vm* from, uint16_t bank);
+void xmem_release(struct vm* vm);
+
+/* embed.c: running a VM from a host's event loop, without blocking in traps */
+int embed_open(struct vm* vm);
+void embed_close(struct vm* vm);
+int embed_feed(struct vm* vm, const char* keys, size_t size);
+void embed_feed_end(struct vm* vm);
+int embed_run(struct vm* vm, const struct engine* engine, uint64_t budget);
+const char* embed_output(struct vm* vm, size_t* size);
+void embed_output_clear(struct vm* vm);
+
+/* threaded.c: the computed-goto engine */
+int vm_run_threaded(struct vm* vm, uint64_t budget);
+
+/* validate.c: lockstep checking of an engine against the reference */
+void validate_enable(double percent);
+int vm_run_validated(struct vm* vm, const struct engine* engine, uint64_t budget);
+void validate_print_stats(FILE* file);
+int block_length(struct vm* vm, uint16_t pc, uint16_t* last);
+
+/* quota.c: instruction-rate and total limits per VM */
+int quota_set(struct vm* vm, uint64_t rate, uint64_t burst, uint64_t total);
+int quota_set_mhz(struct vm* vm, double mhz);
+uint64_t quota_ready_us(struct vm* vm);
+int vm_run_throttled(struct vm* vm, const struct engine* engine, uint64_t budget);
+void quota_print_stats(FILE* file);
+
+/* sample.c: statistical profile of the guest PC on a CPU-time timer */
+int sample_enable(const char* path, int hz, const char* symbols);
+void sample_thread_start();
+void sample_thread_stop();
+int sample_finish();
+
+/* memprof.c: memory access heatmap */
+int mem_profile_enable(const char* path);
+int vm_run_profiled(struct vm* vm, const struct engine* engine, uint64_t budget);
+int mem_profile_finish(FILE* summary);
+
+/* timing.c: cycle estimate for real hardware, per function */
+int timing_enable(const char* path);
+int vm_run_timed(struct vm* vm, const struct engine* engine, uint64_t budget);
+void timing_print_report(FILE* file);
+
+/* metrics.c: per-thread counters, served in the Prometheus text format */
+#define METRIC_TRAPS 7    /* GETC, OUT, PUTS, IN, PUTSP, HALT, anything else */
+#define METRIC_BUCKETS 11 /* key wait histogram, plus one for +Inf */
+
+struct metrics {
+    uint64_t instructions;
+    uint64_t traps[METRIC_TRAPS];
+    uint64_t kbsr_polls;
+    uint64_t output_bytes;
+    uint64_t snapshot_restores;
+    uint64_t key_wait[METRIC_BUCKETS + 1];
+    uint64_t key_wait_us;
+    uint64_t scraped_instructions; /* belongs to the endpoint: the count at the previous scrape */
+    char session[32];
+    struct metrics* next;
+} __attribute__((aligned(64)));
+extern __thread struct metrics* metrics_self;
+
+/* count into this thread's block, if it has one */
+#define METRIC_ADD(field, n) do { \
+        struct metrics* m_ = metrics_self; \
+        if (m_) __atomic_store_n(&m_->field, m_->field + (n), __ATOMIC_RELAXED); \
+    } while (0)
+
+void metrics_register(const char* session);
+void metrics_key_wait(uint64_t us);
+size_t metrics_format(char* buf, size_t cap);
+int metrics_serve(const char* path);
+
+/* memory.c: instance pool, copy-on-write pages and deduplication */
+enum {
+    SLAB_PAGE = 0, /* struct page */
+    SLAB_VM,       /* struct vm */
+    SLAB_COUNT
+};
+
+void* slab_alloc(int cls);
+void slab_free(int cls, void* obj);
+struct vm* vm_create();
+struct vm* vm_clone(struct vm* vm);
+struct vm* vm_fork(struct vm* vm);
+void vm_destroy(struct vm* vm);
+void page_make_private(struct vm* vm, uint16_t p);
+int numa_pin_thread(int node);
+void dedup_enable(uint32_t rate);
+void dedup_step();
+void memory_print_stats(FILE* file);
+
+/* park.c: idle work and compression of parked VMs */
+int lz_compress(const uint8_t* in, int n, uint8_t* out, int cap);
+int lz_decompress(const uint8_t* in, int n, uint8_t* out, int cap);
+void park_enable(uint64_t after_us);
+void vm_park(struct vm* vm);
+void vm_unpark(struct vm* vm);
+void vm_idle(struct vm* vm);
+uint16_t read_key(struct vm* vm);
+void park_print_stats(FILE* file);
+
+/* input.c: the terminal and the key queue */
+#define KEY_EOF 0xFFFF /* what getchar used to give at the end of input */
+
+void disable_input_buffering();
+void restore_input_buffering();
+int wait_key(int64_t timeout_us);
+void input_open(int fd);
+void input_script(const char* keys, size_t size, int more);
+int input_feed(const char* keys, size_t size);
+void input_feed_end();
+struct input_state* input_state_new();
+void input_state_free(struct input_state* state);
+void input_swap(struct input_state* other);
+int input_dry();
+size_t input_script_unread();
+int input_wait(int64_t timeout_us);
+uint16_t input_pop();
+int input_parse_keymap(const char* spec);
+
+/* output.c: output layer, screen model and string traps */
+void out_write(const char* buf, size_t n);
+void out_putc(char c);
+void out_flush();
+void out_frame();
+void out_close();
+void out_capture(int on);
+void out_capture_limit(size_t limit);
+void out_quiet(int on);
+void out_capture_truncate(size_t size);
+const char* out_captured(size_t* size);
+struct capture* out_capture_new();
+void out_capture_free(struct capture* other);
+void out_capture_swap(struct capture* other);
+int screen_init();
+void screen_print_stats(FILE* file);
+void string_kernels_init();
+void vm_puts(struct vm* vm, uint16_t address);
+void vm_putsp(struct vm* vm, uint16_t address);
+
+/* snapshot.c */
+struct snapshot_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t page_count;
+    uint16_t reg[R_COUNT];
+    uint16_t kbsr, kbdr;
+    uint32_t output_size;
+    uint64_t checksum;
+};
+
+void snapshot_save_at_input(const char* path);
+int snapshot_save(struct vm* vm, uint16_t pc, const char* path);
+int snapshot_load(const char* path, struct snapshot_header* out);
+void snapshot_point(struct vm* vm);
+
+#endif
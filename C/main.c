@@ -0,0 +1,303 @@
+/*LC-3 virtual machine, command line*/
+
+#include<stdio.h>
+#include<stdint.h>
+#include<string.h>
+#include<signal.h>
+/* unix only */
+#include<stdlib.h>
+#include<unistd.h>
+
+#include "lc3.h"
+#include "lc3-probes.h"
+
+void print_stats() {
+    memory_print_stats(stderr);
+    screen_print_stats(stderr);
+    park_print_stats(stderr);
+    validate_print_stats(stderr);
+    block_print_stats(stderr);
+    quota_print_stats(stderr);
+}
+
+#define RUN_SLICE (1 << 22)
+
+int show_stats;
+
+/* only the flag: the run ends at the next slice or wait for a key and shuts down as usual */
+void handle_interrupt(int signo)
+{
+    (void) signo;
+    vm_interrupted = 1;
+}
+
+int main(int argc, const char *argv[]) {
+    // LOAD ARGUMENT
+    /* options come before the images */
+    const char* load_path = NULL;
+    const char* metrics_path = NULL;
+    const char* mem_profile_path = NULL;
+    const char* timing_path = NULL;
+    const char* disk_path = NULL;
+    const char* sample_path = NULL;
+    const char* symbols_path = NULL;
+    int sample_hz = 0;
+    int xmem_banks = 0;
+    int saving = 0;
+    double mhz = 0;
+    int validating = 0;
+    int use_screen = 0;
+    int cores = 1;
+    int single_core_only = 0; /* an option that follows one VM */
+    const struct engine* engine = &engines[0];
+    int j = 1;
+    for (; j < argc && strncmp(argv[j], "--", 2) == 0; ++ j) {
+        if (strcmp(argv[j], "--stats") == 0) {
+            show_stats = 1;
+        } else if (strcmp(argv[j], "--numa-node") == 0 && j + 1 < argc) {
+            int node = atoi(argv[++ j]);
+            if (!numa_pin_thread(node)) {
+                printf("Failed to pin to NUMA node %d\n", node);
+                exit(1);
+            }
+        } else if (strcmp(argv[j], "--screen") == 0) {
+            use_screen = 1;
+        } else if (strcmp(argv[j], "--keymap") == 0 && j + 1 < argc) {
+            if (!input_parse_keymap(argv[++ j])) {
+                printf("Bad key map: %s\n", argv[j]);
+                exit(2);
+            }
+        } else if (strcmp(argv[j], "--dedup") == 0 && j + 1 < argc) {
+            dedup_enable(atoi(argv[++ j]));
+            single_core_only = 1;
+        } else if (strcmp(argv[j], "--save-state") == 0 && j + 1 < argc) {
+            snapshot_save_at_input(argv[++ j]);
+            saving = 1;
+            single_core_only = 1;
+        } else if (strcmp(argv[j], "--load-state") == 0 && j + 1 < argc) {
+            load_path = argv[++ j];
+            single_core_only = 1;
+        } else if (strcmp(argv[j], "--cores") == 0 && j + 1 < argc) {
+            cores = atoi(argv[++ j]);
+            if (cores < 1 || cores > SMP_MAX) {
+                printf("--cores must be 1 to %d\n", SMP_MAX);
+                exit(2);
+            }
+        } else if (strcmp(argv[j], "--engine") == 0 && j + 1 < argc) {
+            ++ j;
+            engine = NULL;
+            for (int e = 0; e < engine_count; ++ e) {
+                if (strcmp(argv[j], engines[e].name) == 0) engine = &engines[e];
+            }
+            if (!engine) {
+                printf("Unknown engine: %s\n", argv[j]);
+                exit(2);
+            }
+        } else if (strcmp(argv[j], "--validate") == 0 && j + 1 < argc) {
+            validate_enable(atof(argv[++ j]));
+            validating = 1;
+            single_core_only = 1;
+        } else if (strcmp(argv[j], "--mem-profile") == 0 && j + 1 < argc) {
+            mem_profile_path = argv[++ j];
+            single_core_only = 1;
+        } else if (strcmp(argv[j], "--timing") == 0 && j + 1 < argc) {
+            timing_path = argv[++ j];
+            single_core_only = 1;
+        } else if (strcmp(argv[j], "--sample") == 0 && j + 1 < argc) {
+            sample_path = argv[++ j];
+        } else if (strcmp(argv[j], "--sample-hz") == 0 && j + 1 < argc) {
+            sample_hz = atoi(argv[++ j]);
+            if (sample_hz < 1 || sample_hz > 100000) {
+                printf("--sample-hz must be 1 to 100000\n");
+                exit(2);
+            }
+        } else if (strcmp(argv[j], "--symbols") == 0 && j + 1 < argc) {
+            symbols_path = argv[++ j];
+        } else if (strcmp(argv[j], "--disk") == 0 && j + 1 < argc) {
+            disk_path = argv[++ j];
+        } else if (strcmp(argv[j], "--xmem") == 0 && j + 1 < argc) {
+            xmem_banks = atoi(argv[++ j]);
+            if (xmem_banks < 1 || xmem_banks >= XMEM_NONE) {
+                printf("--xmem must be 1 to %d banks\n", XMEM_NONE - 1);
+                exit(2);
+            }
+        } else if (strcmp(argv[j], "--mhz") == 0 && j + 1 < argc) {
+            mhz = atof(argv[++ j]);
+            if (mhz <= 0) {
+                printf("--mhz must be above 0\n");
+                exit(2);
+            }
+            single_core_only = 1;
+        } else if (strcmp(argv[j], "--metrics") == 0 && j + 1 < argc) {
+            metrics_path = argv[++ j];
+        } else if (strcmp(argv[j], "--park-after") == 0 && j + 1 < argc) {
+            park_enable((uint64_t) atoi(argv[++ j]) * 1000);
+            single_core_only = 1;
+        } else {
+            printf("Unknown option: %s\n", argv[j]);
+            exit(2);
+        }
+    }
+    if (j >= argc && !load_path) {
+        /* show usage */
+        printf("[Usage]: lc3-vm [options] [image-file1] ...\n");
+        printf("  --stats            print memory statistics on exit\n");
+        printf("  --numa-node N      run on the CPUs of NUMA node N and allocate memory there\n");
+        printf("  --screen           render output through a virtual screen, sending only changed cells\n");
+        printf("  --keymap MAP       translate keys for the guest, e.g. up=w,down=s,left=a,right=d\n");
+        printf("  --dedup RATE       merge identical pages, scanning RATE pages per second\n");
+        printf("  --park-after MS    compress the memory of a VM waiting longer than MS for a key\n");
+        printf("  --engine NAME      run the guest with engine NAME: switch (default) or threaded\n");
+        printf("  --cores N          run N cores sharing the memory, each on its own thread\n");
+        printf("  --validate PCT     check PCT percent of the blocks against the switch engine\n");
+        printf("  --mem-profile FILE count memory accesses per 16-word line into a heatmap in FILE, summary on exit\n");
+        printf("  --timing MODEL     estimate cycles on real hardware per function, MODEL is a file or \"default\"\n");
+        printf("  --sample FILE      sample the guest PC on a CPU-time timer, profile to FILE on SIGUSR1 and on exit\n");
+        printf("  --sample-hz N      samples per second of CPU time for --sample, 1000 by default\n");
+        printf("  --symbols FILE     name the addresses of the --sample profile with an lc3as symbol file\n");
+        printf("  --disk FILE        back the block device at 0xFE30 with FILE, 256-word blocks\n");
+        printf("  --xmem BANKS       extended memory of BANKS 4K-word banks, mapped at 0xE000 through 0xFE40\n");
+        printf("  --mhz N            run at an emulated clock of N MHz instead of as fast as possible\n");
+        printf("  --metrics SOCKET   serve counters in the Prometheus text format on a unix socket\n");
+        printf("  --save-state FILE  save the VM to FILE when it first asks for input\n");
+        printf("  --load-state FILE  resume a saved VM instead of loading images\n");
+        exit(2);
+    }
+
+    /* before any other thread, they must all leave SIGUSR1 to the profiler */
+    if (sample_path && !sample_enable(sample_path, sample_hz, symbols_path)) {
+        printf("Failed to start the sampling profiler\n");
+        exit(1);
+    }
+    if (metrics_path) {
+        /* the session is named after what it runs */
+        metrics_register(j < argc ? argv[j] : load_path);
+        if (!metrics_serve(metrics_path)) {
+            printf("Failed to serve metrics on %s\n", metrics_path);
+            exit(1);
+        }
+    }
+
+    if (cores > 1 && single_core_only) {
+        printf("--cores cannot be used with --dedup, --park-after, --validate, --mem-profile, --timing, --mhz or the states\n");
+        exit(2);
+    }
+    if (disk_path && (validating || load_path || saving)) {
+        /* the shadow copy would run the transfers a second time, and a state file does not hold the registers */
+        printf("--disk cannot be used with --validate or the states\n");
+        exit(2);
+    }
+    if (xmem_banks && (validating || load_path || saving)) {
+        /* a bank is shared by the shadow copy, and a state file does not hold the store */
+        printf("--xmem cannot be used with --validate or the states\n");
+        exit(2);
+    }
+    if (xmem_banks && !xmem_enable(xmem_banks)) {
+        printf("Failed to allocate memory\n");
+        exit(1);
+    }
+    if (disk_path && !block_open(disk_path)) {
+        printf("Failed to open the disk: %s\n", disk_path);
+        exit(1);
+    }
+    if (mhz && (validating || mem_profile_path || timing_path)) {
+        printf("--mhz cannot be used with --validate, --mem-profile or --timing\n");
+        exit(2);
+    }
+    if (mem_profile_path && timing_path) {
+        printf("--mem-profile and --timing cannot be used together\n");
+        exit(2);
+    }
+    if (timing_path && !timing_enable(strcmp(timing_path, "default") == 0 ? NULL : timing_path)) exit(1);
+    if (mem_profile_path && !mem_profile_enable(mem_profile_path)) {
+        printf("Failed to allocate memory\n");
+        exit(1);
+    }
+    if (!image_alloc()) {
+        printf("Failed to allocate memory\n");
+        exit(1);
+    }
+    for (; j < argc; ++ j) {
+        if (!read_image(argv[j])) {
+            printf("Failed to load image: %s\n", argv[j]);
+            exit(1);
+        }
+    }
+    if (use_screen && !screen_init()) {
+        printf("Failed to allocate memory\n");
+        exit(1);
+    }
+
+    struct snapshot_header state;
+    if (load_path && !snapshot_load(load_path, &state)) {
+        printf("Failed to load state: %s\n", load_path);
+        exit(1);
+    }
+    image_seal();
+
+    struct vm* vm = cores > 1 ? smp_create(cores) : vm_create();
+    if (!vm || (mhz && !quota_set_mhz(vm, mhz))) {
+        printf("Failed to allocate memory\n");
+        exit(1);
+    }
+
+
+    // SETUP
+    signal(SIGINT, handle_interrupt);
+    string_kernels_init();
+    disable_input_buffering();
+
+    // MAIN LOOP
+    if (load_path) {
+        memcpy(vm->reg, state.reg, sizeof(state.reg));
+        vm->kbsr = state.kbsr;
+        vm->kbdr = state.kbdr;
+    }
+
+    PROBE1(session_start, vm);
+    sample_thread_start();
+    /* in slices, so the instruction counters move while the guest runs */
+    int status;
+    if (cores > 1) {
+        /* every core runs to its halt */
+        if (!smp_run(engine)) printf("Failed to start all %d cores\n", cores);
+        status = VM_HALTED;
+    } else if (mhz) {
+        /* the thread sleeps off the time the guest is ahead of its clock, it never spins */
+        do {
+            status = vm_run_throttled(vm, engine, RUN_SLICE);
+            if (status == VM_THROTTLED) {
+                uint64_t ready = quota_ready_us(vm), now = now_us();
+                if (ready > now) usleep(ready - now);
+            }
+        } while ((status == VM_BUDGET || status == VM_THROTTLED) && !vm_interrupted);
+    } else {
+        do {
+            if (mem_profile_path) {
+                status = vm_run_profiled(vm, engine, RUN_SLICE);
+            } else if (timing_path) {
+                status = vm_run_timed(vm, engine, RUN_SLICE);
+            } else {
+                status = vm_run_validated(vm, engine, RUN_SLICE);
+            }
+        } while (status == VM_BUDGET && !vm_interrupted);
+    }
+    if (vm_interrupted) status = -2;
+    PROBE3(session_stop, vm, status, vm->instructions);
+    sample_thread_stop();
+
+    // SHUTDOWN
+    out_close();
+    restore_input_buffering();
+    if (vm_interrupted) printf("\n");
+    if (show_stats) print_stats();
+    if (!mem_profile_finish(stderr)) printf("Failed to write the memory profile: %s\n", mem_profile_path);
+    timing_print_report(stderr);
+    if (!sample_finish()) printf("Failed to write the sample profile: %s\n", sample_path);
+    if (cores > 1) smp_destroy(); else vm_destroy(vm);
+    block_close();
+    xmem_free();
+    if (vm_interrupted) exit(-2);
+    if (status == VM_DIVERGED) exit(3);
+
+}
@@ -0,0 +1,432 @@
+/*LC-3 memory: instance pool, copy-on-write pages and deduplication*/
+
+#define _GNU_SOURCE /* sched_setaffinity, getcpu */
+#include<stdio.h>
+#include<stdint.h>
+#include<string.h>
+/* unix only */
+#include<stdlib.h>
+#include<unistd.h>
+#include<sys/mman.h>
+#include<sys/syscall.h>
+#include<sched.h>
+
+#include "lc3.h"
+
+// INSTANCE POOL
+/*
+    Hosting many VMs means creating and freeing a lot of equally sized objects: VMs and 256-word pages.
+    Each thread gets its own arena:
+    - memory comes in ARENA_CHUNK blocks, aligned to their size and cut into cache-line aligned objects
+    - every object size has its own free list, so allocating is a pop and freeing is a push
+    - the first cache line of a chunk names the arena that owns it: an object freed on another thread
+      goes back to its owner, pushed onto the owner's `remote` list with a compare-and-swap, and the
+      owner takes that whole list at once when its own runs dry, so the slabs need no lock
+    Arenas are never freed, an object freed after its thread ended still has somewhere to go.
+    A chunk is preferably placed on the NUMA node of the thread that first asks for it, and a thread
+    pinned to a node with numa_pin_thread keeps its VMs' memory local.
+*/
+#define ARENA_CHUNK (1 << 20)
+#define CACHE_LINE 64
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+const size_t slab_size[SLAB_COUNT] = {
+    (sizeof(struct page) + CACHE_LINE - 1) & ~(CACHE_LINE - 1),
+    (sizeof(struct vm) + CACHE_LINE - 1) & ~(CACHE_LINE - 1)
+};
+
+struct arena {
+    char* next;              /* bump allocation inside the current chunk */
+    char* end;
+    void* free[SLAB_COUNT];  /* freed objects, linked through their first word */
+    void* remote[SLAB_COUNT]; /* freed by other threads, same links */
+    int node;                /* NUMA node of the thread, -1 if unknown */
+    int ready;
+};
+__thread struct arena* arena_self;
+
+struct arena* arena_get() {
+    if (!arena_self) arena_self = calloc(1, sizeof(struct arena));
+    return arena_self;
+}
+
+#define arena_owner(obj) (*(struct arena**) ((uintptr_t) (obj) & ~(uintptr_t) (ARENA_CHUNK - 1)))
+
+int arena_grow(struct arena* a) {
+    if (!a->ready) {
+        unsigned cpu, node;
+        a->node = syscall(SYS_getcpu, &cpu, &node, NULL) == 0 ? (int) node : -1;
+        a->ready = 1;
+    }
+    /* twice the size, to cut an aligned chunk out of it */
+    char* map = mmap(NULL, 2 * ARENA_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) return 0;
+    char* chunk = (char*) (((uintptr_t) map + ARENA_CHUNK - 1) & ~(uintptr_t) (ARENA_CHUNK - 1));
+    if (chunk > map) munmap(map, chunk - map);
+    munmap(chunk + ARENA_CHUNK, map + ARENA_CHUNK - chunk);
+    if (a->node >= 0 && a->node < 64) {
+        unsigned long mask = 1UL << a->node;
+        /* best effort: without NUMA support the kernel just refuses */
+        syscall(SYS_mbind, chunk, ARENA_CHUNK, MPOL_PREFERRED, &mask, 64, 0);
+    }
+    *(struct arena**) chunk = a;
+    a->next = chunk + CACHE_LINE;
+    a->end = chunk + ARENA_CHUNK;
+    return 1;
+}
+
+void* slab_alloc(int cls) {
+    struct arena* a = arena_get();
+    if (!a) return NULL;
+    void* obj = a->free[cls];
+    if (!obj) obj = __atomic_exchange_n(&a->remote[cls], NULL, __ATOMIC_ACQUIRE);
+    if (obj) {
+        a->free[cls] = *(void**) obj;
+        return obj;
+    }
+    if (a->next + slab_size[cls] > a->end && !arena_grow(a)) return NULL;
+    obj = a->next;
+    a->next += slab_size[cls];
+    return obj;
+}
+
+/* back to the arena of the chunk it was cut from */
+void slab_free(int cls, void* obj) {
+    struct arena* owner = arena_owner(obj);
+    if (owner == arena_self) {
+        *(void**) obj = owner->free[cls];
+        owner->free[cls] = obj;
+        return;
+    }
+    void* head = __atomic_load_n(&owner->remote[cls], __ATOMIC_RELAXED);
+    do {
+        *(void**) obj = head;
+    } while (!__atomic_compare_exchange_n(&owner->remote[cls], &head, obj, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* run the calling thread on the CPUs of one NUMA node, new arena chunks then land on that node */
+int numa_pin_thread(int node) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE* file = fopen(path, "r");
+    if (!file) return 0;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    int lo, hi;
+    /* the list looks like 0-3,8-11 */
+    while (fscanf(file, "%d", &lo) == 1) {
+        hi = lo;
+        int c = fgetc(file);
+        if (c == '-' && fscanf(file, "%d", &hi) == 1) c = fgetc(file);
+        for (int cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; ++ cpu) CPU_SET(cpu, &set);
+        if (c != ',') break;
+    }
+    fclose(file);
+    if (CPU_COUNT(&set) == 0 || sched_setaffinity(0, sizeof(set), &set) != 0) return 0;
+    struct arena* a = arena_get();
+    if (!a) return 0;
+    /* the rest of the current chunk goes to the free lists, new chunks come from the new node */
+    for (int cls = 0; cls < SLAB_COUNT; ++ cls) {
+        while (a->next && a->next + slab_size[cls] <= a->end) {
+            *(void**) a->next = a->free[cls];
+            a->free[cls] = a->next;
+            a->next += slab_size[cls];
+        }
+    }
+    a->node = node;
+    a->ready = 1;
+    a->next = a->end = NULL;
+    return 1;
+}
+
+// PAGE DEDUPLICATION
+/*
+    Many VMs running the same program end up with identical private pages (untouched tables, zeroed buffers).
+    The deduplicator walks the private pages of every VM a few at a time:
+    - a page written since the last visit is hot and skipped
+    - a cold page equal to its image page is pointed back to the image
+    - otherwise it is hashed and merged with an identical shared page, or becomes a shared page itself
+    The next mem_write to a shared page copies it again, so merging is invisible to the guest.
+    The scan only runs from idle points (a VM waiting for a key) and is limited to `rate` pages per second,
+    so it never holds up a running VM.
+*/
+#define SHARED_BUCKETS 4096
+
+struct {
+    struct page* bucket[SHARED_BUCKETS];
+    uint32_t rate;       /* pages per second, 0 = disabled */
+    uint64_t last_us;
+    struct vm* vm;       /* scan cursor */
+    uint16_t page;
+    uint64_t scanned;
+    int64_t saved_pages; /* pages that would be private without deduplication */
+} dedup;
+
+void shared_unlink(struct page* pg) {
+    struct page** it = &dedup.bucket[pg->hash % SHARED_BUCKETS];
+    while (*it != pg) it = &(*it)->next;
+    *it = pg->next;
+}
+
+/* drop one reference to a shared page */
+void shared_release(struct page* pg) {
+    if (-- pg->ref == 0) {
+        shared_unlink(pg);
+        slab_free(SLAB_PAGE, pg);
+    } else {
+        dedup.saved_pages --;
+    }
+}
+
+void dedup_enable(uint32_t rate) {
+    dedup.rate = rate;
+    dedup.last_us = now_us();
+}
+
+// VM INSTANCES
+/*
+    Only the slabs are safe to use from any thread. vm_list and the deduplicator's table are plain
+    lists, so one thread owns them, the first to create a VM: only it may create, fork, clone or
+    destroy VMs, scan for duplicates or take a VM off a shared or merged page. Other threads may
+    run VMs whose pages are all private already, as the cores of smp.c do. vm_owner_check stops
+    the program at the first call from anywhere else, instead of letting the lists break later.
+*/
+struct vm* vm_list;
+struct arena* vm_owner; /* the arena of the owning thread */
+
+void vm_owner_check(const char* what) {
+    struct arena* a = arena_get();
+    if (!vm_owner) vm_owner = a;
+    if (a == vm_owner) return;
+    printf("%s called on a thread that does not own the VMs\n", what);
+    abort();
+}
+
+struct vm* vm_create() {
+    vm_owner_check("vm_create");
+    struct vm* vm = slab_alloc(SLAB_VM);
+    if (!vm) return NULL;
+    memset(vm, 0, sizeof(struct vm)); /* every page starts as PG_IMAGE */
+    memcpy(vm->page, image_page, sizeof(vm->page));
+    /* since exactly one conditon flag should be given at any given time, set the Z flag*/
+    vm->reg[R_COND] = FL_ZRO;
+    vm->reg[R_PC] = PC_START;
+    vm->next = vm_list;
+    if (vm_list) vm_list->prev = vm;
+    vm_list = vm;
+    return vm;
+}
+
+/* a second VM in the same state, with its own copy of every page that is not the image's */
+struct vm* vm_clone(struct vm* vm) {
+    struct vm* copy = vm_create();
+    if (!copy) return NULL;
+    memcpy(copy->reg, vm->reg, sizeof(copy->reg));
+    copy->kbsr = vm->kbsr;
+    copy->kbdr = vm->kbdr;
+    block_copy(copy, vm);
+    uint16_t bank = xmem_unmap(vm);
+    for (int p = 0; p < PAGE_COUNT; ++ p) {
+        uint8_t kind = vm->page_kind[p];
+        if (kind == PG_PRIVATE || kind == PG_SHARED) {
+            page_make_private(copy, p);
+            memcpy(copy->page[p], vm->page[p], PAGE_BYTES);
+        } else {
+            /* image and merged pages both point at an image page, packed ones never run */
+            copy->page[p] = vm->page[p];
+        }
+    }
+    xmem_copy(copy, vm, bank);
+    return copy;
+}
+
+/* make a private page shared, with the VM as its only user so far */
+void page_share(struct vm* vm, uint16_t p) {
+    struct page* pg = page_of(vm->page[p]);
+    pg->hash = page_hash(pg->data);
+    pg->ref = 1;
+    struct page** bucket = &dedup.bucket[pg->hash % SHARED_BUCKETS];
+    pg->next = *bucket;
+    *bucket = pg;
+    vm->page_kind[p] = PG_SHARED;
+    vm->private_pages --;
+}
+
+/*
+    A second VM in the same state that copies nothing yet: private pages become shared ones and
+    both VMs point at them, whichever writes a page first gets its own copy through
+    page_make_private. Forking a VM with a long history costs a pass over the page table, not its memory.
+*/
+struct vm* vm_fork(struct vm* vm) {
+    struct vm* copy = vm_create();
+    if (!copy) return NULL;
+    memcpy(copy->reg, vm->reg, sizeof(copy->reg));
+    copy->kbsr = vm->kbsr;
+    copy->kbdr = vm->kbdr;
+    copy->instructions = vm->instructions;
+    block_copy(copy, vm);
+    uint16_t bank = xmem_unmap(vm);
+    if (vm->perf) {
+        copy->perf = malloc(sizeof(struct perf_counters));
+        if (copy->perf) memcpy(copy->perf, vm->perf, sizeof(struct perf_counters));
+    }
+    for (int p = 0; p < PAGE_COUNT; ++ p) {
+        uint8_t kind = vm->page_kind[p];
+        if (kind == PG_PRIVATE) {
+            page_share(vm, p);
+            kind = PG_SHARED;
+        }
+        if (kind == PG_SHARED) {
+            page_of(vm->page[p])->ref ++;
+            dedup.saved_pages ++;
+        } else if (kind == PG_MERGED) {
+            dedup.saved_pages ++;
+        }
+        /* packed pages never run, a parked VM is not forked */
+        copy->page[p] = vm->page[p];
+        copy->page_kind[p] = kind;
+    }
+    xmem_copy(copy, vm, bank);
+    return copy;
+}
+
+void vm_destroy(struct vm* vm) {
+    vm_owner_check("vm_destroy");
+    /* the disk worker may still be filling the bounce buffer */
+    block_release(vm);
+    free(vm->blk.buf);
+    /* the window's own pages are freed with the others */
+    xmem_release(vm);
+    for (int g = 0; g < PAGE_COUNT; g += 8) {
+        /* most pages are PG_IMAGE (0), skip them eight at a time */
+        uint64_t kinds;
+        memcpy(&kinds, vm->page_kind + g, sizeof(kinds));
+        if (!kinds) continue;
+        for (int i = g; i < g + 8; ++ i) {
+            switch (vm->page_kind[i]) {
+                case PG_PRIVATE: slab_free(SLAB_PAGE, page_of(vm->page[i])); break;
+                case PG_SHARED: shared_release(page_of(vm->page[i])); break;
+                case PG_MERGED: dedup.saved_pages --; break;
+                case PG_PACKED: free(vm->page[i]); break;
+            }
+        }
+    }
+    free(vm->perf);
+    free(vm->quota);
+    embed_close(vm);
+    if (dedup.vm == vm) {
+        dedup.vm = vm->next;
+        dedup.page = 0;
+    }
+    if (vm->prev) vm->prev->next = vm->next; else vm_list = vm->next;
+    if (vm->next) vm->next->prev = vm->prev;
+    slab_free(SLAB_VM, vm);
+}
+
+/* copy-on-write: give the VM its own copy of a page before the first write into it */
+void page_make_private(struct vm* vm, uint16_t p) {
+    uint8_t kind = vm->page_kind[p];
+    struct page* pg;
+    if (kind == PG_BANK) return; /* extended memory is written in place */
+    if (kind == PG_SHARED || kind == PG_MERGED) vm_owner_check("page_make_private");
+    if (kind == PG_SHARED && page_of(vm->page[p])->ref == 1) {
+        /* nobody else uses it anymore, just take it back */
+        pg = page_of(vm->page[p]);
+        shared_unlink(pg);
+    } else {
+        pg = slab_alloc(SLAB_PAGE);
+        if (!pg) {
+            printf("Out of memory\n");
+            exit(1);
+        }
+        memcpy(pg->data, vm->page[p], PAGE_BYTES);
+        if (kind == PG_SHARED) shared_release(page_of(vm->page[p]));
+        if (kind == PG_MERGED) dedup.saved_pages --;
+    }
+    vm->page[p] = pg->data;
+    vm->page_kind[p] = PG_PRIVATE;
+    vm->private_pages ++;
+}
+
+void dedup_page(struct vm* vm, uint16_t p) {
+    dedup.scanned ++;
+    if (vm->page_hot[p]) {
+        vm->page_hot[p] = 0;
+        return;
+    }
+    struct page* pg = page_of(vm->page[p]);
+    uint16_t* base = image_page[p];
+    if (memcmp(pg->data, base, PAGE_BYTES) == 0) {
+        slab_free(SLAB_PAGE, pg);
+        vm->page[p] = base;
+        vm->page_kind[p] = PG_MERGED;
+        vm->private_pages --;
+        dedup.saved_pages ++;
+        return;
+    }
+    uint64_t h = page_hash(pg->data);
+    struct page** bucket = &dedup.bucket[h % SHARED_BUCKETS];
+    for (struct page* it = *bucket; it; it = it->next) {
+        if (it->hash == h && memcmp(it->data, pg->data, PAGE_BYTES) == 0) {
+            slab_free(SLAB_PAGE, pg);
+            it->ref ++;
+            vm->page[p] = it->data;
+            vm->page_kind[p] = PG_SHARED;
+            vm->private_pages --;
+            dedup.saved_pages ++;
+            return;
+        }
+    }
+    /* first of its kind: publish it so later copies can merge into it */
+    pg->hash = h;
+    pg->ref = 1;
+    pg->next = *bucket;
+    *bucket = pg;
+    vm->page_kind[p] = PG_SHARED;
+    vm->private_pages --;
+}
+
+/* called when a VM is idle, scans as many pages as the rate allows since the last call */
+void dedup_step() {
+    if (!dedup.rate || !vm_list) return;
+    vm_owner_check("dedup_step");
+    uint64_t now = now_us();
+    uint64_t budget = (now - dedup.last_us) * dedup.rate / 1000000;
+    if (budget == 0) return;
+    if (budget > dedup.rate) budget = dedup.rate; /* at most one second worth after a long pause */
+    dedup.last_us = now;
+    while (budget) {
+        if (!dedup.vm) {
+            dedup.vm = vm_list;
+            dedup.page = 0;
+        }
+        if (dedup.vm->page_kind[dedup.page] == PG_PRIVATE) {
+            dedup_page(dedup.vm, dedup.page);
+            budget --;
+        }
+        if (++ dedup.page == PAGE_COUNT) {
+            dedup.vm = dedup.vm->next;
+            dedup.page = 0;
+            if (!dedup.vm) break; /* one full pass per call at most */
+        }
+    }
+}
+
+
+void memory_print_stats(FILE* file) {
+    uint64_t private_pages = 0;
+    for (struct vm* vm = vm_list; vm; vm = vm->next) private_pages += vm->private_pages;
+    uint64_t shared_pages = 0;
+    for (int i = 0; i < SHARED_BUCKETS; ++ i) {
+        for (struct page* pg = dedup.bucket[i]; pg; pg = pg->next) shared_pages ++;
+    }
+    fprintf(file, "pages: %llu private, %llu shared (%llu KiB)\n",
+        (unsigned long long) private_pages, (unsigned long long) shared_pages,
+        (unsigned long long) ((private_pages + shared_pages) * PAGE_BYTES / 1024));
+    if (dedup.rate) {
+        fprintf(file, "dedup: %llu pages scanned, %lld bytes saved\n",
+            (unsigned long long) dedup.scanned, (long long) (dedup.saved_pages * (int64_t) PAGE_BYTES));
+    }
+}
@@ -0,0 +1,237 @@
+/*LC-3 memory access profiler*/
+
+#include<stdio.h>
+#include<stdint.h>
+#include<string.h>
+/* unix only */
+#include<stdlib.h>
+
+#include "lc3.h"
+
+// MEMORY PROFILE
+/*
+    With --mem-profile the guest runs one instruction at a time, and before each one the profiler
+    decodes it and counts the words it is about to touch, per 16-word line and per cause:
+        fetch        the instruction itself
+        ld ldi ldr   loads (ldi counts both the pointer and the data)
+        sti.ptr      the pointer read of STI
+        st sti str   stores
+        trap         the strings read by PUTS and PUTSP
+    Decoding ahead needs nothing from the engine, so any engine can be profiled, and without the
+    option nothing here runs at all. Addresses in the device page are counted but never read.
+    At the end the counts go to a binary heatmap (only the lines that were touched) and the hottest
+    ranges plus the working set at a few page sizes are summarised as text.
+*/
+#define LINE_BITS 4
+#define LINE_COUNT (MEMORY_MAX >> LINE_BITS)
+#define HEATMAP_MAGIC 0x484D334C /* "L3MH" */
+#define HEATMAP_VERSION 1
+#define HOT_LINES 64  /* lines considered for the summary */
+#define HOT_RANGES 12 /* ranges printed */
+
+enum {
+    MP_FETCH = 0,
+    MP_LD,
+    MP_LDI,
+    MP_LDR,
+    MP_STI_PTR,
+    MP_TRAP,
+    MP_ST,      /* the kinds from here on are writes */
+    MP_STI,
+    MP_STR,
+    MP_KINDS
+};
+
+const char* mp_names[MP_KINDS] = { "fetch", "ld", "ldi", "ldr", "sti.ptr", "trap", "st", "sti", "str" };
+
+struct {
+    const char* path;
+    uint64_t (*count)[MP_KINDS]; /* [LINE_COUNT] */
+} mem_profile;
+
+/*
+    The file: a header, then for each touched line its number and one count per kind.
+    Little-endian, as written by the host.
+*/
+struct heatmap_header {
+    uint32_t magic;
+    uint16_t version;
+    uint8_t line_bits;
+    uint8_t kinds;
+    uint32_t lines; /* records that follow */
+};
+
+int mem_profile_enable(const char* path) {
+    mem_profile.count = calloc(LINE_COUNT, sizeof(*mem_profile.count));
+    if (!mem_profile.count) return 0;
+    mem_profile.path = path;
+    return 1;
+}
+
+void mem_profile_count(uint16_t address, int kind) {
+    mem_profile.count[address >> LINE_BITS][kind] ++;
+}
+
+/* a word the instruction will read, without waking a device */
+uint16_t mem_profile_peek(struct vm* vm, uint16_t address) {
+    if (address >= DEVICE_BASE) return address == MR_KBSR ? vm->kbsr : address == MR_KBDR ? vm->kbdr : 0;
+    return vm->page[address >> PAGE_BITS][address & PAGE_MASK];
+}
+
+/* count what the instruction at the PC is about to touch */
+void mem_profile_step(struct vm* vm) {
+    uint16_t* reg = vm->reg;
+    uint16_t pc = reg[R_PC];
+    mem_profile_count(pc, MP_FETCH);
+    uint16_t instr = mem_profile_peek(vm, pc);
+    uint16_t next = pc + 1;
+    uint16_t pc_offset = next + sign_extend(instr & 0x1FF, 9);
+    uint16_t base_offset = reg[(instr >> 6) & 0x7] + sign_extend(instr & 0x3F, 6);
+    switch (instr >> 12) {
+        case OP_LD:
+            mem_profile_count(pc_offset, MP_LD);
+            break;
+        case OP_LDI:
+            mem_profile_count(pc_offset, MP_LDI);
+            mem_profile_count(mem_profile_peek(vm, pc_offset), MP_LDI);
+            break;
+        case OP_LDR:
+            mem_profile_count(base_offset, MP_LDR);
+            break;
+        case OP_ST:
+            mem_profile_count(pc_offset, MP_ST);
+            break;
+        case OP_STI:
+            mem_profile_count(pc_offset, MP_STI_PTR);
+            mem_profile_count(mem_profile_peek(vm, pc_offset), MP_STI);
+            break;
+        case OP_STR:
+            mem_profile_count(base_offset, MP_STR);
+            break;
+        case OP_TRAP:
+            if ((instr & 0xFF) == TRAP_PUTS || (instr & 0xFF) == TRAP_PUTSP) {
+                /* the string and its terminating zero */
+                uint16_t a = reg[R_R0];
+                do {
+                    mem_profile_count(a, MP_TRAP);
+                } while (a < DEVICE_BASE && mem_profile_peek(vm, a ++));
+            }
+            break;
+    }
+}
+
+/* like engine->run, one instruction at a time with the profiler looking at each */
+int vm_run_profiled(struct vm* vm, const struct engine* engine, uint64_t budget) {
+    for (uint64_t i = 0; i < budget; ++ i) {
+        mem_profile_step(vm);
+        int status = engine->run(vm, 1);
+        if (status != VM_BUDGET) return status;
+    }
+    return VM_BUDGET;
+}
+
+uint64_t line_total(int line) {
+    uint64_t t = 0;
+    for (int k = 0; k < MP_KINDS; ++ k) t += mem_profile.count[line][k];
+    return t;
+}
+
+struct hot_range {
+    int first, last; /* lines */
+    uint64_t total;
+    uint64_t kind[MP_KINDS];
+};
+
+int compare_hot_ranges(const void* a, const void* b) {
+    uint64_t x = ((const struct hot_range*) a)->total, y = ((const struct hot_range*) b)->total;
+    return (x < y) - (x > y);
+}
+
+/* write the heatmap and print the summary, returns 0 if the file could not be written */
+int mem_profile_finish(FILE* summary) {
+    if (!mem_profile.count) return 1;
+    int ok = 1;
+    FILE* file = fopen(mem_profile.path, "wb");
+    if (file) {
+        struct heatmap_header h = { HEATMAP_MAGIC, HEATMAP_VERSION, LINE_BITS, MP_KINDS, 0 };
+        for (int l = 0; l < LINE_COUNT; ++ l) h.lines += line_total(l) != 0;
+        fwrite(&h, sizeof(h), 1, file);
+        for (int l = 0; l < LINE_COUNT; ++ l) {
+            if (!line_total(l)) continue;
+            uint16_t line = l;
+            fwrite(&line, sizeof(line), 1, file);
+            fwrite(mem_profile.count[l], sizeof(uint64_t), MP_KINDS, file);
+        }
+        ok = fclose(file) == 0;
+    } else {
+        ok = 0;
+    }
+
+    /* the hottest lines, with neighbours that are hot as well merged into one range */
+    struct hot_range* ranges = calloc(LINE_COUNT, sizeof(struct hot_range));
+    if (!ranges) return ok;
+    uint64_t all[MP_KINDS] = { 0 };
+    for (int l = 0; l < LINE_COUNT; ++ l) {
+        ranges[l].first = ranges[l].last = l;
+        ranges[l].total = line_total(l);
+        for (int k = 0; k < MP_KINDS; ++ k) {
+            ranges[l].kind[k] = mem_profile.count[l][k];
+            all[k] += mem_profile.count[l][k];
+        }
+    }
+    qsort(ranges, LINE_COUNT, sizeof(struct hot_range), compare_hot_ranges);
+    int n = 0;
+    while (n < HOT_LINES && ranges[n].total) ++ n;
+    uint8_t hot[LINE_COUNT] = { 0 };
+    for (int i = 0; i < n; ++ i) hot[ranges[i].first] = 1;
+    n = 0;
+    for (int l = 0; l < LINE_COUNT; ++ l) {
+        if (!hot[l]) continue;
+        if (!n || ranges[n - 1].last != l - 1) {
+            memset(&ranges[n], 0, sizeof(struct hot_range));
+            ranges[n].first = l;
+            ++ n;
+        }
+        struct hot_range* r = &ranges[n - 1];
+        r->last = l;
+        for (int k = 0; k < MP_KINDS; ++ k) r->kind[k] += mem_profile.count[l][k];
+        r->total += line_total(l);
+    }
+    qsort(ranges, n, sizeof(struct hot_range), compare_hot_ranges);
+
+    uint64_t reads = 0, writes = 0;
+    for (int k = MP_LD; k < MP_ST; ++ k) reads += all[k];
+    for (int k = MP_ST; k < MP_KINDS; ++ k) writes += all[k];
+    fprintf(summary, "mem-profile: %llu fetches, %llu reads, %llu writes, heatmap in %s\n",
+        (unsigned long long) all[MP_FETCH], (unsigned long long) reads, (unsigned long long) writes, mem_profile.path);
+    fprintf(summary, "  %-11s %12s", "range", "total");
+    for (int k = 0; k < MP_KINDS; ++ k) fprintf(summary, " %10s", mp_names[k]);
+    fprintf(summary, "\n");
+    for (int i = 0; i < n && i < HOT_RANGES; ++ i) {
+        struct hot_range* r = &ranges[i];
+        fprintf(summary, "  %04x-%04x  %12llu", r->first << LINE_BITS, ((r->last + 1) << LINE_BITS) - 1,
+            (unsigned long long) r->total);
+        for (int k = 0; k < MP_KINDS; ++ k) fprintf(summary, " %10llu", (unsigned long long) r->kind[k]);
+        fprintf(summary, "\n");
+    }
+    free(ranges);
+
+    /* how much memory the program touches, and writes, if pages were this big */
+    fprintf(summary, "  pages touched/written, by page size in words:");
+    for (int bits = LINE_BITS; bits <= 12; bits += 2) {
+        int touched = 0, written = 0;
+        int per_page = 1 << (bits - LINE_BITS);
+        for (int first = 0; first < LINE_COUNT; first += per_page) {
+            int t = 0, w = 0;
+            for (int l = first; l < first + per_page; ++ l) {
+                t |= line_total(l) != 0;
+                for (int k = MP_ST; k < MP_KINDS; ++ k) w |= mem_profile.count[l][k] != 0;
+            }
+            touched += t;
+            written += w;
+        }
+        fprintf(summary, " %d: %d/%d", 1 << bits, touched, written);
+    }
+    fprintf(summary, "\n");
+    return ok;
+}
@@ -0,0 +1,198 @@
+/*LC-3 metrics: per-thread counters and a Prometheus endpoint*/
+
+#include<stdio.h>
+#include<stdint.h>
+#include<string.h>
+/* unix only */
+#include<stdlib.h>
+#include<unistd.h>
+#include<pthread.h>
+#include<sys/socket.h>
+#include<sys/time.h>
+#include<sys/un.h>
+
+#include "lc3.h"
+
+// METRICS
+/*
+    Each thread that runs a session registers one block of counters and is the only one writing it:
+    a count is a relaxed load, add and store into its own cache line, no lock and no locked instruction.
+    The blocks are never freed, so a scrape can walk the list at any time and sum them, and the
+    counters of a finished session stay where Prometheus expects them.
+    A thread that never registered (the benchmark, the validator's shadow runs) counts nothing.
+*/
+#define METRICS_BODY_MAX 65536
+
+/* upper bounds of the key wait buckets, in microseconds */
+const uint32_t key_wait_bounds[METRIC_BUCKETS] = { 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000 };
+
+const char* trap_names[METRIC_TRAPS] = { "GETC", "OUT", "PUTS", "IN", "PUTSP", "HALT", "other" };
+
+__thread struct metrics* metrics_self;
+
+struct {
+    struct metrics* list; /* every block ever registered, newest first */
+    const char* path;     /* of the socket, removed at exit */
+    uint64_t last_us;     /* the previous scrape, for the rates */
+    uint64_t last_instructions;
+} metrics_endpoint;
+
+void metrics_register(const char* session) {
+    struct metrics* m = aligned_alloc(64, sizeof(struct metrics));
+    if (!m) return;
+    memset(m, 0, sizeof(struct metrics));
+    snprintf(m->session, sizeof(m->session), "%s", session);
+    m->next = __atomic_load_n(&metrics_endpoint.list, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&metrics_endpoint.list, &m->next, m, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    metrics_self = m;
+}
+
+void metrics_key_wait(uint64_t us) {
+    struct metrics* m = metrics_self;
+    if (!m) return;
+    int b = 0;
+    while (b < METRIC_BUCKETS && us > key_wait_bounds[b]) ++ b;
+    METRIC_ADD(key_wait[b], 1);
+    METRIC_ADD(key_wait_us, us);
+}
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+/* the exposition of every block, in the Prometheus text format */
+size_t metrics_format(char* buf, size_t cap) {
+    size_t n = 0;
+#define EMIT(...) do { \
+        if (n < cap) n += snprintf(buf + n, cap - n, __VA_ARGS__); \
+    } while (0)
+    uint64_t now = now_us();
+    double elapsed = metrics_endpoint.last_us ? (now - metrics_endpoint.last_us) / 1e6 : 0;
+    struct metrics* list = __atomic_load_n(&metrics_endpoint.list, __ATOMIC_ACQUIRE);
+    uint64_t total = 0;
+    int sessions = 0;
+
+    EMIT("# HELP lc3_instructions_total Guest instructions executed.\n# TYPE lc3_instructions_total counter\n");
+    for (struct metrics* m = list; m; m = m->next) {
+        EMIT("lc3_instructions_total{session=\"%s\"} %llu\n", m->session, (unsigned long long) LOAD(m->instructions));
+        total += LOAD(m->instructions);
+        ++ sessions;
+    }
+    EMIT("# HELP lc3_instructions_per_second Guest instructions per second since the previous scrape.\n"
+         "# TYPE lc3_instructions_per_second gauge\n");
+    for (struct metrics* m = list; m; m = m->next) {
+        uint64_t count = LOAD(m->instructions);
+        EMIT("lc3_instructions_per_second{session=\"%s\"} %.0f\n", m->session,
+            elapsed > 0 ? (count - m->scraped_instructions) / elapsed : 0.0);
+        m->scraped_instructions = count;
+    }
+    EMIT("# HELP lc3_traps_total TRAP instructions by vector.\n# TYPE lc3_traps_total counter\n");
+    for (struct metrics* m = list; m; m = m->next) {
+        for (int t = 0; t < METRIC_TRAPS; ++ t) {
+            EMIT("lc3_traps_total{session=\"%s\",vector=\"%s\"} %llu\n", m->session, trap_names[t],
+                (unsigned long long) LOAD(m->traps[t]));
+        }
+    }
+    EMIT("# HELP lc3_kbsr_polls_total Guest reads of the keyboard status register.\n# TYPE lc3_kbsr_polls_total counter\n");
+    for (struct metrics* m = list; m; m = m->next) {
+        EMIT("lc3_kbsr_polls_total{session=\"%s\"} %llu\n", m->session, (unsigned long long) LOAD(m->kbsr_polls));
+    }
+    EMIT("# HELP lc3_output_bytes_total Bytes the guest wrote to its terminal.\n# TYPE lc3_output_bytes_total counter\n");
+    for (struct metrics* m = list; m; m = m->next) {
+        EMIT("lc3_output_bytes_total{session=\"%s\"} %llu\n", m->session, (unsigned long long) LOAD(m->output_bytes));
+    }
+    EMIT("# HELP lc3_snapshot_restores_total Snapshots loaded.\n# TYPE lc3_snapshot_restores_total counter\n");
+    for (struct metrics* m = list; m; m = m->next) {
+        EMIT("lc3_snapshot_restores_total{session=\"%s\"} %llu\n", m->session, (unsigned long long) LOAD(m->snapshot_restores));
+    }
+    EMIT("# HELP lc3_key_wait_seconds Time from a key arriving to the guest taking it.\n# TYPE lc3_key_wait_seconds histogram\n");
+    for (struct metrics* m = list; m; m = m->next) {
+        uint64_t cumulative = 0;
+        for (int b = 0; b <= METRIC_BUCKETS; ++ b) {
+            cumulative += LOAD(m->key_wait[b]);
+            if (b < METRIC_BUCKETS) {
+                EMIT("lc3_key_wait_seconds_bucket{session=\"%s\",le=\"%g\"} %llu\n", m->session,
+                    key_wait_bounds[b] / 1e6, (unsigned long long) cumulative);
+            } else {
+                EMIT("lc3_key_wait_seconds_bucket{session=\"%s\",le=\"+Inf\"} %llu\n", m->session, (unsigned long long) cumulative);
+            }
+        }
+        EMIT("lc3_key_wait_seconds_sum{session=\"%s\"} %g\n", m->session, LOAD(m->key_wait_us) / 1e6);
+        EMIT("lc3_key_wait_seconds_count{session=\"%s\"} %llu\n", m->session, (unsigned long long) cumulative);
+    }
+
+    EMIT("# HELP lc3_process_sessions Sessions this process has run.\n# TYPE lc3_process_sessions gauge\n");
+    EMIT("lc3_process_sessions %d\n", sessions);
+    EMIT("# HELP lc3_process_instructions_total Guest instructions executed by all sessions.\n"
+         "# TYPE lc3_process_instructions_total counter\n");
+    EMIT("lc3_process_instructions_total %llu\n", (unsigned long long) total);
+    EMIT("# HELP lc3_process_instructions_per_second Guest instructions per second of all sessions since the previous scrape.\n"
+         "# TYPE lc3_process_instructions_per_second gauge\n");
+    EMIT("lc3_process_instructions_per_second %.0f\n", elapsed > 0 ? (total - metrics_endpoint.last_instructions) / elapsed : 0.0);
+    metrics_endpoint.last_instructions = total;
+    metrics_endpoint.last_us = now;
+#undef EMIT
+    return n < cap ? n : cap - 1;
+}
+
+#undef LOAD
+
+/* one scrape per connection: plain text, or an HTTP response if it asked with GET */
+void metrics_answer(int fd, char* body) {
+    char request[1024];
+    struct timeval timeout = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    ssize_t got = read(fd, request, sizeof(request));
+    size_t len = metrics_format(body, METRICS_BODY_MAX);
+    if (got >= 4 && memcmp(request, "GET ", 4) == 0) {
+        char header[128];
+        int h = snprintf(header, sizeof(header),
+            "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", len);
+        send(fd, header, h, MSG_NOSIGNAL);
+    }
+    /* a scraper that went away must not take the session down with SIGPIPE */
+    for (size_t off = 0; off < len; ) {
+        ssize_t w = send(fd, body + off, len - off, MSG_NOSIGNAL);
+        if (w <= 0) break;
+        off += w;
+    }
+    close(fd);
+}
+
+void* metrics_thread(void* arg) {
+    int server = (int) (intptr_t) arg;
+    char* body = malloc(METRICS_BODY_MAX);
+    if (!body) return NULL;
+    for (;;) {
+        int fd = accept(server, NULL, NULL);
+        if (fd >= 0) metrics_answer(fd, body);
+    }
+    return NULL;
+}
+
+void metrics_remove_socket() {
+    if (metrics_endpoint.path) unlink(metrics_endpoint.path);
+}
+
+/* serve the metrics on a unix socket at `path`, e.g. curl --unix-socket PATH http://lc3/metrics */
+int metrics_serve(const char* path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) return 0;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server < 0) return 0;
+    unlink(path);
+    if (bind(server, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(server, 8) < 0) {
+        close(server);
+        return 0;
+    }
+    metrics_endpoint.path = path;
+    atexit(metrics_remove_socket);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, metrics_thread, (void*) (intptr_t) server) != 0) {
+        close(server);
+        return 0;
+    }
+    pthread_detach(thread);
+    return 1;
+}
@@ -0,0 +1,577 @@
+/*LC-3 output: the output layer, screen model and string traps*/
+
+#include<stdio.h>
+#include<stdint.h>
+#include<string.h>
+/* unix only */
+#include<stdlib.h>
+#include<unistd.h>
+#include<sys/ioctl.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include<immintrin.h>
+#endif
+
+#include "lc3.h"
+
+// SCREEN MODEL
+/*
+    Games like 2048 clear the screen and redraw everything on every move, which is slow on a remote terminal.
+    With the screen model on, the guest's bytes are not written out directly but played into a virtual
+    terminal (a grid of cells plus the cursor and colors, understanding the usual ANSI sequences).
+    When the guest finishes a frame (it asks for input, or the frame is getting old) only the cells that
+    differ from what the real terminal shows are sent, with the cheapest cursor move to reach them.
+    Escape sequences the model does not know are passed through as they are.
+*/
+#define SCREEN_MAX_DELAY_US 50000
+
+enum {
+    ATTR_DEFAULT_COLOR = 16,
+    ATTR_BOLD = 1 << 10,
+    ATTR_UNDERLINE = 1 << 11,
+    ATTR_REVERSE = 1 << 12,
+    ATTR_DEFAULT = ATTR_DEFAULT_COLOR | (ATTR_DEFAULT_COLOR << 5) /* fg in bits 0-4, bg in bits 5-9 */
+};
+
+struct cell {
+    char ch;
+    uint16_t attr;
+};
+
+/* field by field: the padding byte of a cell is whatever was there */
+int cell_equal(const struct cell* a, const struct cell* b) {
+    return a->ch == b->ch && a->attr == b->attr;
+}
+
+struct {
+    int on;
+    int rows, cols;
+    struct cell* grid;  /* what the guest has drawn */
+    struct cell* shown; /* what the terminal shows */
+    int row, col;       /* guest cursor */
+    uint16_t attr;      /* guest pen */
+    int term_row, term_col; /* terminal cursor, -1 if unknown */
+    uint16_t term_attr;
+    int dirty;
+    uint64_t last_frame;
+    char esc[32];       /* escape sequence being parsed */
+    int esc_len;
+    char* out;          /* bytes for the terminal, written once per frame */
+    size_t out_size, out_cap;
+    uint64_t bytes_in, bytes_out;
+} screen;
+
+void screen_emit(const char* buf, size_t n) {
+    if (screen.out_size + n > screen.out_cap) {
+        size_t cap = screen.out_cap ? screen.out_cap * 2 : 4096;
+        while (cap < screen.out_size + n) cap *= 2;
+        char* out = realloc(screen.out, cap);
+        if (!out) return;
+        screen.out = out;
+        screen.out_cap = cap;
+    }
+    memcpy(screen.out + screen.out_size, buf, n);
+    screen.out_size += n;
+}
+
+int screen_init() {
+    struct winsize ws;
+    screen.rows = 24;
+    screen.cols = 80;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row && ws.ws_col) {
+        screen.rows = ws.ws_row;
+        screen.cols = ws.ws_col;
+    }
+    size_t cells = (size_t) screen.rows * screen.cols;
+    screen.grid = malloc(cells * sizeof(struct cell));
+    screen.shown = malloc(cells * sizeof(struct cell));
+    if (!screen.grid || !screen.shown) return 0;
+    for (size_t i = 0; i < cells; ++ i) {
+        screen.grid[i] = screen.shown[i] = (struct cell) { ' ', ATTR_DEFAULT };
+    }
+    screen.attr = screen.term_attr = ATTR_DEFAULT;
+    /* start from a known, empty terminal */
+    screen_emit("\x1b[0m\x1b[2J\x1b[H", 11);
+    screen.on = 1;
+    return 1;
+}
+
+void screen_clear(int from, int to) {
+    for (int i = from; i < to; ++ i) screen.grid[i] = (struct cell) { ' ', screen.attr };
+}
+
+void screen_newline() {
+    screen.col = 0;
+    if (++ screen.row < screen.rows) return;
+    /* scroll the grid up by one line */
+    screen.row = screen.rows - 1;
+    memmove(screen.grid, screen.grid + screen.cols, (size_t) (screen.rows - 1) * screen.cols * sizeof(struct cell));
+    screen_clear(screen.row * screen.cols, screen.rows * screen.cols);
+}
+
+void screen_sgr(int* params, int n) {
+    if (n == 0) params[n ++] = 0;
+    for (int i = 0; i < n; ++ i) {
+        int p = params[i];
+        uint16_t a = screen.attr;
+        if (p == 0) a = ATTR_DEFAULT;
+        else if (p == 1) a |= ATTR_BOLD;
+        else if (p == 4) a |= ATTR_UNDERLINE;
+        else if (p == 7) a |= ATTR_REVERSE;
+        else if (p == 22) a &= ~ATTR_BOLD;
+        else if (p == 24) a &= ~ATTR_UNDERLINE;
+        else if (p == 27) a &= ~ATTR_REVERSE;
+        else if (p >= 30 && p <= 37) a = (a & ~0x1F) | (p - 30);
+        else if (p == 39) a = (a & ~0x1F) | ATTR_DEFAULT_COLOR;
+        else if (p >= 40 && p <= 47) a = (a & ~(0x1F << 5)) | ((p - 40) << 5);
+        else if (p == 49) a = (a & ~(0x1F << 5)) | (ATTR_DEFAULT_COLOR << 5);
+        else if (p >= 90 && p <= 97) a = (a & ~0x1F) | (p - 90 + 8);
+        else if (p >= 100 && p <= 107) a = (a & ~(0x1F << 5)) | ((p - 100 + 8) << 5);
+        screen.attr = a;
+    }
+}
+
+/* returns 0 if the sequence is not understood and has to be passed through */
+int screen_csi(const char* seq, int len) {
+    int params[8] = {0}, n = 0;
+    char final = seq[len - 1];
+    for (int i = 2; i < len - 1; ++ i) {
+        char c = seq[i];
+        if (c >= '0' && c <= '9') {
+            if (n == 0) n = 1;
+            params[n - 1] = params[n - 1] * 10 + (c - '0');
+        } else if (c == ';' && n < 8) {
+            if (n == 0) n = 1;
+            ++ n;
+        } else {
+            return 0; /* private modes like ?25l */
+        }
+    }
+    int p0 = n ? params[0] : 0;
+    int by = p0 ? p0 : 1;
+    switch (final) {
+        case 'H':
+        case 'f':
+            screen.row = (p0 ? p0 : 1) - 1;
+            screen.col = (n > 1 && params[1] ? params[1] : 1) - 1;
+            break;
+        case 'A': screen.row -= by; break;
+        case 'B': screen.row += by; break;
+        case 'C': screen.col += by; break;
+        case 'D': screen.col -= by; break;
+        case 'J': {
+            int cur = screen.row * screen.cols + screen.col;
+            int end = screen.rows * screen.cols;
+            if (p0 == 0) screen_clear(cur, end);
+            else if (p0 == 1) screen_clear(0, cur + 1);
+            else if (p0 == 2) screen_clear(0, end);
+            /* 3 only clears the scrollback, nothing on screen */
+            break;
+        }
+        case 'K': {
+            int line = screen.row * screen.cols;
+            if (p0 == 0) screen_clear(line + screen.col, line + screen.cols);
+            else if (p0 == 1) screen_clear(line, line + screen.col + 1);
+            else screen_clear(line, line + screen.cols);
+            break;
+        }
+        case 'm':
+            screen_sgr(params, n);
+            break;
+        default:
+            return 0;
+    }
+    if (screen.row < 0) screen.row = 0;
+    if (screen.row >= screen.rows) screen.row = screen.rows - 1;
+    if (screen.col < 0) screen.col = 0;
+    if (screen.col >= screen.cols) screen.col = screen.cols - 1;
+    return 1;
+}
+
+void screen_feed(const char* buf, size_t n) {
+    screen.bytes_in += n;
+    screen.dirty = 1;
+    for (size_t i = 0; i < n; ++ i) {
+        char c = buf[i];
+        if (screen.esc_len) {
+            screen.esc[screen.esc_len ++] = c;
+            int done = 0;
+            if (screen.esc_len == 2 && c != '[') {
+                done = 1; /* a two byte sequence like ESC c */
+            } else if (screen.esc_len > 2 && c >= 0x40 && c <= 0x7E) {
+                done = 1;
+            } else if (screen.esc_len == (int) sizeof(screen.esc)) {
+                done = 1; /* too long, give up on it */
+            }
+            if (done) {
+                if (screen.esc_len < 3 || screen.esc[1] != '[' || !screen_csi(screen.esc, screen.esc_len)) {
+                    screen_emit(screen.esc, screen.esc_len);
+                }
+                screen.esc_len = 0;
+            }
+            continue;
+        }
+        switch (c) {
+            case '\x1b':
+                screen.esc[0] = c;
+                screen.esc_len = 1;
+                break;
+            case '\n':
+                screen_newline();
+                break;
+            case '\r':
+                screen.col = 0;
+                break;
+            case '\b':
+                if (screen.col > 0) screen.col --;
+                break;
+            case '\t':
+                screen.col = (screen.col + 8) & ~7;
+                if (screen.col >= screen.cols) screen.col = screen.cols - 1;
+                break;
+            case '\a':
+                screen_emit(&c, 1);
+                break;
+            default:
+                if ((unsigned char) c < ' ') break;
+                if (screen.col >= screen.cols) screen_newline();
+                screen.grid[screen.row * screen.cols + screen.col] = (struct cell) { c, screen.attr };
+                screen.col ++;
+                break;
+        }
+    }
+}
+
+void screen_set_attr(uint16_t a) {
+    if (a == screen.term_attr) return;
+    char buf[48];
+    int n = sprintf(buf, "\x1b[0");
+    if (a & ATTR_BOLD) n += sprintf(buf + n, ";1");
+    if (a & ATTR_UNDERLINE) n += sprintf(buf + n, ";4");
+    if (a & ATTR_REVERSE) n += sprintf(buf + n, ";7");
+    int fg = a & 0x1F, bg = (a >> 5) & 0x1F;
+    if (fg != ATTR_DEFAULT_COLOR) n += sprintf(buf + n, ";%d", fg < 8 ? 30 + fg : 90 + fg - 8);
+    if (bg != ATTR_DEFAULT_COLOR) n += sprintf(buf + n, ";%d", bg < 8 ? 40 + bg : 100 + bg - 8);
+    buf[n ++] = 'm';
+    screen_emit(buf, n);
+    screen.term_attr = a;
+}
+
+/* move the terminal cursor with as few bytes as possible */
+void screen_move(int row, int col) {
+    if (row == screen.term_row && col == screen.term_col) return;
+    char buf[32];
+    int n;
+    if (row == screen.term_row && col > screen.term_col && col - screen.term_col <= 4) {
+        /* reprinting a few unchanged cells is shorter than any escape sequence */
+        int ok = 1;
+        for (int c = screen.term_col; c < col; ++ c) {
+            struct cell* cell = &screen.shown[row * screen.cols + c];
+            if (cell->attr != screen.term_attr || !cell_equal(cell, &screen.grid[row * screen.cols + c])) ok = 0;
+        }
+        if (ok) {
+            for (int c = screen.term_col; c < col; ++ c) screen_emit(&screen.shown[row * screen.cols + c].ch, 1);
+            screen.term_col = col;
+            return;
+        }
+    }
+    if (col == 0 && row == screen.term_row) {
+        n = sprintf(buf, "\r");
+    } else if (col == 0 && screen.term_row >= 0 && row == screen.term_row + 1) {
+        n = sprintf(buf, "\r\n");
+    } else if (row == screen.term_row && screen.term_col >= 0 && col > screen.term_col) {
+        n = sprintf(buf, "\x1b[%dC", col - screen.term_col);
+    } else if (row == screen.term_row && screen.term_col >= 0) {
+        n = sprintf(buf, "\x1b[%dD", screen.term_col - col);
+    } else if (col == 0) {
+        n = sprintf(buf, "\x1b[%dH", row + 1);
+    } else {
+        n = sprintf(buf, "\x1b[%d;%dH", row + 1, col + 1);
+    }
+    screen_emit(buf, n);
+    screen.term_row = row;
+    screen.term_col = col;
+}
+
+/* send the difference between the guest's screen and the terminal */
+void screen_frame() {
+    if (!screen.dirty) return;
+    screen.dirty = 0;
+    for (int r = 0; r < screen.rows; ++ r) {
+        for (int c = 0; c < screen.cols; ++ c) {
+            int i = r * screen.cols + c;
+            if (cell_equal(&screen.grid[i], &screen.shown[i])) continue;
+            screen_move(r, c);
+            screen_set_attr(screen.grid[i].attr);
+            screen_emit(&screen.grid[i].ch, 1);
+            screen.shown[i] = screen.grid[i];
+            /* after the last column the terminal cursor is in a pending-wrap state */
+            screen.term_col = c + 1 < screen.cols ? c + 1 : -1;
+            if (screen.term_col < 0) screen.term_row = -1;
+        }
+    }
+    screen_move(screen.row, screen.col);
+    screen_set_attr(screen.attr);
+    fwrite(screen.out, 1, screen.out_size, stdout);
+    fflush(stdout);
+    screen.bytes_out += screen.out_size;
+    screen.out_size = 0;
+    screen.last_frame = now_us();
+}
+
+// OUTPUT
+/*
+    Everything the guest prints goes through out_write, so it can also be recorded:
+    until a snapshot is taken the output is kept, and replayed when the snapshot is loaded.
+    An embedding host keeps it without the terminal seeing any of it (out_quiet).
+*/
+struct capture {
+    char* data;
+    size_t size, cap;
+    size_t limit; /* keep at most this much, the newest, 0 = all */
+    int on;
+    int quiet;  /* only kept, not printed */
+} capture;
+
+void out_write(const char* buf, size_t n) {
+    METRIC_ADD(output_bytes, n);
+    if (!capture.quiet) {
+        if (screen.on) screen_feed(buf, n); else fwrite(buf, 1, n, stdout);
+    }
+    if (!capture.on) return;
+    if (capture.limit && capture.size + n > capture.limit) {
+        /* down to half the limit, so the older half is not moved again for every byte */
+        if (n >= capture.limit / 2) {
+            buf += n - capture.limit / 2;
+            n = capture.limit / 2;
+            capture.size = 0;
+        } else {
+            size_t keep = capture.limit / 2 - n;
+            if (keep > capture.size) keep = capture.size;
+            memmove(capture.data, capture.data + capture.size - keep, keep);
+            capture.size = keep;
+        }
+    }
+    if (capture.size + n > capture.cap) {
+        size_t cap = capture.cap ? capture.cap * 2 : 4096;
+        while (cap < capture.size + n) cap *= 2;
+        char* data = realloc(capture.data, cap);
+        if (!data) {
+            capture.on = 0;
+            return;
+        }
+        capture.data = data;
+        capture.cap = cap;
+    }
+    memcpy(capture.data + capture.size, buf, n);
+    capture.size += n;
+}
+
+void out_putc(char c) {
+    out_write(&c, 1);
+}
+
+/* the guest flushed: with the screen model only an old frame is sent, the rest waits for out_frame */
+void out_flush() {
+    if (capture.quiet) return;
+    if (!screen.on) fflush(stdout);
+    else if (now_us() - screen.last_frame > SCREEN_MAX_DELAY_US) screen_frame();
+}
+
+/* the guest finished a frame and waits for input */
+void out_frame() {
+    if (screen.on) screen_frame();
+}
+
+/* the last frame, leaving the terminal with its default colors */
+void out_close() {
+    if (!screen.on) return;
+    screen_frame();
+    fputs("\x1b[0m", stdout);
+    fflush(stdout);
+}
+
+/* keep what the guest prints, or stop keeping it */
+void out_capture(int on) {
+    capture.on = on;
+}
+
+/* keep no more than the last `limit` bytes (at least half of them), 0 = everything */
+void out_capture_limit(size_t limit) {
+    capture.limit = limit;
+}
+
+/* send none of what the guest prints to the terminal (with out_capture it is still kept), or print it again */
+void out_quiet(int on) {
+    capture.quiet = on;
+}
+
+/* forget what was kept after the first `size` bytes, e.g. between the runs of a batch */
+void out_capture_truncate(size_t size) {
+    if (size < capture.size) capture.size = size;
+}
+
+const char* out_captured(size_t* size) {
+    *size = capture.size;
+    return capture.data;
+}
+
+/* a capture of its own, kept and not printed, for a VM whose output goes elsewhere (embed.c) */
+struct capture* out_capture_new() {
+    struct capture* other = calloc(1, sizeof(struct capture));
+    if (!other) return NULL;
+    other->on = 1;
+    other->quiet = 1;
+    return other;
+}
+
+void out_capture_free(struct capture* other) {
+    if (!other) return;
+    free(other->data);
+    free(other);
+}
+
+/* exchange the capture in use with `other`, calling it again swaps them back */
+void out_capture_swap(struct capture* other) {
+    struct capture current = capture;
+    capture = *other;
+    *other = current;
+}
+
+void screen_print_stats(FILE* file) {
+    if (!screen.on) return;
+    fprintf(file, "screen: %llu bytes from the guest, %llu bytes sent\n",
+        (unsigned long long) screen.bytes_in, (unsigned long long) screen.bytes_out);
+}
+
+// STRING OUTPUT
+/*
+    TRAP_PUTS and TRAP_PUTSP print a zero terminated string straight out of guest memory.
+    Instead of a putc per character, the words are turned into bytes in bulk, 8 (SSE2) or 16 (AVX2)
+    words at a time, and the whole string goes to the output layer in one out_write.
+    Inside a page the words are contiguous, so the kernels run page by page.
+    A string without a terminator stops at the top of memory instead of wrapping around.
+    Each kernel returns how many words it consumed: fewer than `n` means it hit the zero word.
+*/
+/* PUTS: one character per word, the low byte */
+size_t puts_scalar(const uint16_t* src, size_t n, char* dst) {
+    size_t i = 0;
+    for (; i < n && src[i]; ++ i) dst[i] = (char) src[i];
+    return i;
+}
+
+/* PUTSP: two characters per word, low byte first, a zero high byte is skipped */
+size_t putsp_scalar(const uint16_t* src, size_t n, char* dst, size_t* len) {
+    size_t i = 0, o = *len;
+    for (; i < n && src[i]; ++ i) {
+        dst[o ++] = src[i] & 0xFF;
+        if (src[i] >> 8) dst[o ++] = src[i] >> 8;
+    }
+    *len = o;
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+size_t puts_sse2(const uint16_t* src, size_t n, char* dst) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i low = _mm_set1_epi16(0xFF);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i w = _mm_loadu_si128((const __m128i*) (src + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(w, zero))) break;
+        /* keep the low bytes and pack 8 words into 8 bytes */
+        __m128i b = _mm_packus_epi16(_mm_and_si128(w, low), zero);
+        _mm_storel_epi64((__m128i*) (dst + i), b);
+    }
+    return i + puts_scalar(src + i, n - i, dst + i);
+}
+
+size_t putsp_sse2(const uint16_t* src, size_t n, char* dst, size_t* len) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i high = _mm_set1_epi16((short) 0xFF00);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i w = _mm_loadu_si128((const __m128i*) (src + i));
+        /* stop at a zero word or a zero high byte (odd length), the scalar loop handles those */
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(w, high), zero))) break;
+        /* little-endian words already hold the bytes in printing order */
+        _mm_storeu_si128((__m128i*) (dst + *len), w);
+        *len += 16;
+    }
+    return i + putsp_scalar(src + i, n - i, dst, len);
+}
+
+__attribute__((target("avx2")))
+size_t puts_avx2(const uint16_t* src, size_t n, char* dst) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i low = _mm256_set1_epi16(0xFF);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i w = _mm256_loadu_si256((const __m256i*) (src + i));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi16(w, zero))) break;
+        /* packus works per 128-bit lane, the permute puts the two halves side by side */
+        __m256i b = _mm256_packus_epi16(_mm256_and_si256(w, low), zero);
+        b = _mm256_permute4x64_epi64(b, 0xD8);
+        _mm_storeu_si128((__m128i*) (dst + i), _mm256_castsi256_si128(b));
+    }
+    return i + puts_sse2(src + i, n - i, dst + i);
+}
+
+__attribute__((target("avx2")))
+size_t putsp_avx2(const uint16_t* src, size_t n, char* dst, size_t* len) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i high = _mm256_set1_epi16((short) 0xFF00);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i w = _mm256_loadu_si256((const __m256i*) (src + i));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_and_si256(w, high), zero))) break;
+        _mm256_storeu_si256((__m256i*) (dst + *len), w);
+        *len += 32;
+    }
+    return i + putsp_sse2(src + i, n - i, dst, len);
+}
+#endif
+
+size_t (*puts_kernel)(const uint16_t*, size_t, char*) = puts_scalar;
+size_t (*putsp_kernel)(const uint16_t*, size_t, char*, size_t*) = putsp_scalar;
+
+/* pick the widest kernels the CPU has */
+void string_kernels_init() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    puts_kernel = puts_sse2;
+    putsp_kernel = putsp_sse2;
+    if (__builtin_cpu_supports("avx2")) {
+        puts_kernel = puts_avx2;
+        putsp_kernel = putsp_avx2;
+    }
+#endif
+}
+
+/* up to two bytes per word of memory */
+char string_buffer[2 * MEMORY_MAX];
+
+void vm_puts(struct vm* vm, uint16_t address) {
+    size_t len = 0;
+    uint32_t a = address;
+    while (a < MEMORY_MAX) {
+        size_t n = PAGE_SIZE - (a & PAGE_MASK);
+        size_t done = puts_kernel(vm->page[a >> PAGE_BITS] + (a & PAGE_MASK), n, string_buffer + len);
+        len += done;
+        if (done < n) break;
+        a += n;
+    }
+    out_write(string_buffer, len);
+}
+
+void vm_putsp(struct vm* vm, uint16_t address) {
+    size_t len = 0;
+    uint32_t a = address;
+    while (a < MEMORY_MAX) {
+        size_t n = PAGE_SIZE - (a & PAGE_MASK);
+        size_t done = putsp_kernel(vm->page[a >> PAGE_BITS] + (a & PAGE_MASK), n, string_buffer, &len);
+        if (done < n) break;
+        a += n;
+    }
+    out_write(string_buffer, len);
+}
+
@@ -0,0 +1,215 @@
+/*LC-3 idle work: compression of parked VMs*/
+
+#include<stdio.h>
+#include<stdint.h>
+#include<string.h>
+/* unix only */
+#include<stdlib.h>
+
+#include "lc3.h"
+
+// LZ CODEC
+/*
+    A small LZ77 codec in the style of LZ4, fast enough to pack a page in a few microseconds.
+    The output is a list of sequences:
+        token | extra literal length | literals | offset (2 bytes) | extra match length
+    The token holds the literal length in its high nibble and the match length - 4 in its low nibble,
+    15 means more length bytes follow (each 255 means keep going). The last sequence has no match.
+*/
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 10
+
+int lz_put_length(uint8_t* out, int op, int cap, int len) {
+    while (len >= 255) {
+        if (op >= cap) return -1;
+        out[op ++] = 255;
+        len -= 255;
+    }
+    if (op >= cap) return -1;
+    out[op ++] = len;
+    return op;
+}
+
+/* one sequence: `lit` literals, then a match of `len` bytes `off` back (len = 0 for the last one) */
+int lz_put_sequence(uint8_t* out, int op, int cap, const uint8_t* lit, int lit_len, int off, int len) {
+    int ml = len ? len - LZ_MIN_MATCH : 0;
+    if (op >= cap) return -1;
+    out[op ++] = ((lit_len < 15 ? lit_len : 15) << 4) | (ml < 15 ? ml : 15);
+    if (lit_len >= 15 && (op = lz_put_length(out, op, cap, lit_len - 15)) < 0) return -1;
+    if (op + lit_len > cap) return -1;
+    memcpy(out + op, lit, lit_len);
+    op += lit_len;
+    if (!len) return op;
+    if (op + 2 > cap) return -1;
+    out[op ++] = off & 0xFF;
+    out[op ++] = off >> 8;
+    if (ml >= 15 && (op = lz_put_length(out, op, cap, ml - 15)) < 0) return -1;
+    return op;
+}
+
+/* returns the compressed size, or 0 if it does not fit in `cap` bytes */
+int lz_compress(const uint8_t* in, int n, uint8_t* out, int cap) {
+    uint16_t table[1 << LZ_HASH_BITS] = {0}; /* position + 1 of the last time a hash was seen */
+    int ip = 0, anchor = 0, op = 0;
+    while (ip + LZ_MIN_MATCH <= n) {
+        uint32_t seq;
+        memcpy(&seq, in + ip, sizeof(seq));
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int cand = table[h] - 1;
+        table[h] = ip + 1;
+        if (cand < 0 || memcmp(in + cand, in + ip, LZ_MIN_MATCH) != 0) {
+            ++ ip;
+            continue;
+        }
+        int len = LZ_MIN_MATCH;
+        while (ip + len < n && in[cand + len] == in[ip + len]) ++ len;
+        op = lz_put_sequence(out, op, cap, in + anchor, ip - anchor, ip - cand, len);
+        if (op < 0) return 0;
+        ip += len;
+        anchor = ip;
+    }
+    op = lz_put_sequence(out, op, cap, in + anchor, n - anchor, 0, 0);
+    return op < 0 ? 0 : op;
+}
+
+/* returns the decompressed size, or -1 if the input is corrupt */
+int lz_decompress(const uint8_t* in, int n, uint8_t* out, int cap) {
+    int ip = 0, op = 0;
+    while (ip < n) {
+        uint8_t token = in[ip ++];
+        int lit = token >> 4;
+        if (lit == 15) {
+            uint8_t b;
+            do {
+                if (ip >= n) return -1;
+                b = in[ip ++];
+                lit += b;
+            } while (b == 255);
+        }
+        if (ip + lit > n || op + lit > cap) return -1;
+        memcpy(out + op, in + ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == n) break; /* the last sequence has no match */
+        if (ip + 2 > n) return -1;
+        int off = in[ip] | (in[ip + 1] << 8);
+        ip += 2;
+        int len = token & 15;
+        if (len == 15) {
+            uint8_t b;
+            do {
+                if (ip >= n) return -1;
+                b = in[ip ++];
+                len += b;
+            } while (b == 255);
+        }
+        len += LZ_MIN_MATCH;
+        if (off == 0 || off > op || op + len > cap) return -1;
+        /* byte by byte: the match may overlap what it is producing */
+        for (int i = 0; i < len; ++ i) out[op + i] = out[op - off + i];
+        op += len;
+    }
+    return op;
+}
+
+// IDLE COMPRESSION
+/*
+    An interactive VM spends most of its life waiting for a key. Once it has waited longer than `after_us`
+    it is parked: its private pages are compressed and the host stops running it until a key arrives.
+    On the next key the pages are unpacked again before the guest sees the input.
+    Shared and image pages are left alone, they already cost nothing per VM.
+*/
+#define PARK_SAMPLES 4096
+
+struct packed_page {
+    uint16_t size;
+    uint8_t bytes[];
+};
+
+struct {
+    uint64_t after_us;   /* 0 = never park */
+    uint64_t parks;
+    uint64_t raw_bytes;  /* bytes of the pages packed so far */
+    uint64_t packed_bytes;
+    uint32_t resume_us[PARK_SAMPLES]; /* ring of recent wake-up latencies */
+    uint64_t resumes;
+} park;
+
+void park_enable(uint64_t after_us) {
+    park.after_us = after_us;
+}
+
+void vm_park(struct vm* vm) {
+    uint8_t buf[PAGE_BYTES];
+    for (int p = 0; p < PAGE_COUNT; ++ p) {
+        if (vm->page_kind[p] != PG_PRIVATE) continue;
+        int size = lz_compress((const uint8_t*) vm->page[p], PAGE_BYTES, buf, PAGE_BYTES - sizeof(struct packed_page));
+        if (!size) continue; /* does not compress, keep it as it is */
+        struct packed_page* pk = malloc(sizeof(struct packed_page) + size);
+        if (!pk) continue;
+        pk->size = size;
+        memcpy(pk->bytes, buf, size);
+        slab_free(SLAB_PAGE, page_of(vm->page[p]));
+        vm->page[p] = (uint16_t*) pk;
+        vm->page_kind[p] = PG_PACKED;
+        park.raw_bytes += PAGE_BYTES;
+        park.packed_bytes += size;
+    }
+    park.parks ++;
+}
+
+void vm_unpark(struct vm* vm) {
+    for (int p = 0; p < PAGE_COUNT; ++ p) {
+        if (vm->page_kind[p] != PG_PACKED) continue;
+        struct packed_page* pk = (struct packed_page*) vm->page[p];
+        struct page* pg = slab_alloc(SLAB_PAGE);
+        if (!pg || lz_decompress(pk->bytes, pk->size, (uint8_t*) pg->data, PAGE_BYTES) != PAGE_BYTES) {
+            printf("Failed to restore a parked page\n");
+            exit(1);
+        }
+        free(pk);
+        vm->page[p] = pg->data;
+        vm->page_kind[p] = PG_PRIVATE;
+    }
+}
+
+
+/* a VM is waiting for a key: a good moment for background work */
+void vm_idle(struct vm* vm) {
+    dedup_step();
+    if (!park.after_us) return;
+    uint64_t now = now_us();
+    if (!vm->idle_since) vm->idle_since = now;
+    if (now - vm->idle_since < park.after_us) return;
+
+    vm_park(vm);
+    input_wait(-1);
+    uint64_t woken = now_us();
+    vm_unpark(vm);
+    park.resume_us[park.resumes ++ % PARK_SAMPLES] = now_us() - woken;
+    vm->idle_since = 0;
+}
+
+/* the VM consumes a key, it is busy again */
+uint16_t read_key(struct vm* vm) {
+    vm->idle_since = 0;
+    return input_pop();
+}
+
+int compare_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+    return (x > y) - (x < y);
+}
+
+void park_print_stats(FILE* file) {
+    if (!park.parks) return;
+    uint32_t n = park.resumes < PARK_SAMPLES ? park.resumes : PARK_SAMPLES;
+    uint32_t sorted[PARK_SAMPLES];
+    memcpy(sorted, park.resume_us, n * sizeof(uint32_t));
+    qsort(sorted, n, sizeof(uint32_t), compare_u32);
+    fprintf(file, "park: %llu parks, %llu -> %llu bytes (ratio %.1f:1)",
+        (unsigned long long) park.parks, (unsigned long long) park.raw_bytes, (unsigned long long) park.packed_bytes,
+        park.packed_bytes ? (double) park.raw_bytes / park.packed_bytes : 0.0);
+    if (n) fprintf(file, ", resume p50 %uus p99 %uus", sorted[n / 2], sorted[n * 99 / 100]);
+    fprintf(file, "\n");
+}
@@ -0,0 +1,91 @@
+/*LC-3 performance counter device*/
+
+#include<stdio.h>
+#include<stdint.h>
+/* unix only */
+#include<stdlib.h>
+
+#include "lc3.h"
+
+// PERFORMANCE COUNTERS
+/*
+    A block of registers at MR_PERF_INSN_LO (0xFE10) for guests that want to time their own code:
+        FE10/FE11  instructions retired, including the one reading it
+        FE12/FE13  estimated LC-3 cycles, since the guest first touched the block
+        FE14/FE15  the host's monotonic clock in microseconds
+        FE16       write an opcode (0-15) to select it, reads back the selection
+        FE17/FE18  instructions of the selected opcode, since the first touch
+    Each value is 32 bits, low word first: reading the low word takes the whole value and keeps its
+    high word for the next read of a high register, so the two halves always belong together.
+    Nothing is counted until the guest first reads or writes one of these registers; from then on
+    the engines count opcodes for this VM. The threaded engine switches to its counting table and the
+    switch to its counting copy of the loop, so a guest that never looks pays nothing.
+    The retired count is vm->instructions plus vm->pending, which the engines publish before every
+    device access.
+*/
+
+/*
+    Cycles per opcode, after the LC-3 state machine in Patt & Patel with a 5-cycle memory:
+    fetch and decode take 3 states plus a memory access (8), ALU ops, branches and jumps one more
+    state, loads and stores two more states plus an access, LDI/STI/RTI two accesses.
+*/
+const uint8_t perf_cycles[16] = {
+    9,  /* BR */
+    9,  /* ADD */
+    15, /* LD */
+    15, /* ST */
+    10, /* JSR */
+    9,  /* AND */
+    15, /* LDR */
+    15, /* STR */
+    21, /* RTI */
+    9,  /* NOT */
+    21, /* LDI */
+    21, /* STI */
+    9,  /* JMP */
+    9,  /* RES */
+    9,  /* LEA */
+    15  /* TRAP: reads the vector table */
+};
+
+/* the counters of `vm`, switched on by the first access */
+struct perf_counters* perf_counters(struct vm* vm) {
+    if (!vm->perf) vm->perf = calloc(1, sizeof(struct perf_counters));
+    return vm->perf;
+}
+
+uint16_t perf_read(struct vm* vm, uint16_t address) {
+    struct perf_counters* perf = perf_counters(vm);
+    if (!perf) return 0;
+    uint32_t value;
+    switch (address) {
+        case MR_PERF_INSN_LO:
+            value = (uint32_t) (vm->instructions + vm->pending);
+            break;
+        case MR_PERF_CYCLE_LO:
+            {
+                uint64_t cycles = 0;
+                for (int op = 0; op < 16; ++ op) cycles += perf->ops[op] * perf_cycles[op];
+                value = (uint32_t) cycles;
+            }
+            break;
+        case MR_PERF_USEC_LO:
+            value = (uint32_t) now_us();
+            break;
+        case MR_PERF_SELECT:
+            return perf->select;
+        case MR_PERF_OP_LO:
+            value = (uint32_t) perf->ops[perf->select];
+            break;
+        default:
+            /* a high word */
+            return perf->latch;
+    }
+    perf->latch = value >> 16;
+    return value & 0xFFFF;
+}
+
+void perf_write(struct vm* vm, uint16_t address, uint16_t data) {
+    struct perf_counters* perf = perf_counters(vm);
+    if (perf && address == MR_PERF_SELECT) perf->select = data & 0xF;
+}
@@ -0,0 +1,122 @@
+/*LC-3 CPU quotas: instruction-rate throttling per VM*/
+
+#include<stdio.h>
+#include<stdint.h>
+#include<string.h>
+/* unix only */
+#include<stdlib.h>
+
+#include "lc3.h"
+
+// QUOTAS
+/*
+    A VM can be given a rate (instructions per second) and a total (instructions in all), so a
+    runaway guest in one session cannot starve the others:
+    - the rate is a token bucket: tokens come in at `rate` per second and are kept up to `burst`,
+      each instruction takes one; with none left the run ends with VM_THROTTLED and quota_ready_us
+      says when it is worth running again
+    - the total ends the run with VM_QUOTA once it is spent, for good
+    vm_run_throttled never sleeps: an exhausted VM just comes back, and the host runs another one
+    (or, for a single VM, sleeps until quota_ready_us itself). A run is cut at the end of the basic
+    block the tokens ran out in (block_length), so a VM is only descheduled at a branch, jump or trap
+    and the bucket (or the total) goes at most a block past its limit, the next refill pays that back.
+    lc3-vm --mhz is the same bucket with a small burst and one VM, see quota_set_mhz.
+*/
+#define QUOTA_CPI 10 /* LC-3 cycles per instruction for --mhz: 9 for ALU ops and branches, 15-21 for memory ops */
+
+struct quota {
+    uint64_t rate;        /* instructions per second, 0 = no limit */
+    uint64_t burst;       /* most tokens kept */
+    int64_t tokens;       /* can go a block below zero */
+    uint64_t total;       /* instructions in all, 0 = no limit */
+    uint64_t used;
+    uint64_t refilled_us;
+};
+
+struct {
+    uint64_t throttled;   /* runs that ended with VM_THROTTLED */
+    uint64_t exhausted;   /* and with VM_QUOTA */
+} quotas;
+
+/* limit `vm` to `rate` instructions per second, bursts of `burst`, and `total` in all (0 = no limit) */
+int quota_set(struct vm* vm, uint64_t rate, uint64_t burst, uint64_t total) {
+    if (!vm->quota) vm->quota = calloc(1, sizeof(struct quota));
+    struct quota* q = vm->quota;
+    if (!q) return 0;
+    q->rate = rate;
+    q->burst = burst ? burst : rate;
+    q->tokens = q->burst;
+    q->total = total;
+    q->refilled_us = now_us();
+    return 1;
+}
+
+/* a clock of `mhz` MHz: a hundredth of a second of it at a time, so output keeps its pace */
+int quota_set_mhz(struct vm* vm, double mhz) {
+    uint64_t rate = (uint64_t) (mhz * 1000000 / QUOTA_CPI);
+    if (rate == 0) rate = 1;
+    return quota_set(vm, rate, rate / 100 ? rate / 100 : 1, 0);
+}
+
+void quota_refill(struct quota* q, uint64_t now) {
+    if (!q->rate || now <= q->refilled_us) return;
+    uint64_t earned = (now - q->refilled_us) * q->rate / 1000000;
+    if (!earned) return; /* keep the fraction for the next refill */
+    q->tokens = q->tokens + (int64_t) earned > (int64_t) q->burst ? (int64_t) q->burst : q->tokens + (int64_t) earned;
+    q->refilled_us += earned * 1000000 / q->rate;
+}
+
+/*
+    When the VM is worth running again: once the bucket is half full, so a throttled VM gets a real
+    slice instead of waking for every token. 0 if it has tokens now, UINT64_MAX if its total is spent.
+*/
+uint64_t quota_ready_us(struct vm* vm) {
+    struct quota* q = vm->quota;
+    if (!q) return 0;
+    if (q->total && q->used >= q->total) return UINT64_MAX;
+    if (!q->rate || q->tokens > 0) return 0;
+    uint64_t want = (uint64_t) -q->tokens + (q->burst + 1) / 2;
+    return q->refilled_us + (want * 1000000 + q->rate - 1) / q->rate;
+}
+
+int vm_run_throttled(struct vm* vm, const struct engine* engine, uint64_t budget) {
+    struct quota* q = vm->quota;
+    if (!q) return engine->run(vm, budget);
+    if (q->total && q->used >= q->total) {
+        quotas.exhausted ++;
+        return VM_QUOTA;
+    }
+    quota_refill(q, now_us());
+    if (q->rate && q->tokens <= 0) {
+        quotas.throttled ++;
+        return VM_THROTTLED;
+    }
+    uint64_t slice = budget;
+    if (q->rate && (uint64_t) q->tokens < slice) slice = q->tokens;
+    if (q->total && q->total - q->used < slice) slice = q->total - q->used;
+    uint64_t start = vm->instructions;
+    int status = engine->run(vm, slice);
+    if (status == VM_BUDGET && slice < budget) {
+        /* out of tokens: on to the end of the block */
+        uint16_t last;
+        uint64_t rest = block_length(vm, vm->reg[R_PC], &last);
+        if (rest > budget - slice) rest = budget - slice;
+        status = engine->run(vm, rest);
+    }
+    uint64_t ran = vm->instructions - start;
+    q->tokens -= (int64_t) ran;
+    q->used += ran;
+    if (status != VM_BUDGET || ran >= budget) return status;
+    if (q->total && q->used >= q->total) {
+        quotas.exhausted ++;
+        return VM_QUOTA;
+    }
+    quotas.throttled ++;
+    return VM_THROTTLED;
+}
+
+void quota_print_stats(FILE* file) {
+    if (!quotas.throttled && !quotas.exhausted) return;
+    fprintf(file, "quota: %llu runs throttled, %llu stopped at their total\n",
+        (unsigned long long) quotas.throttled, (unsigned long long) quotas.exhausted);
+}
@@ -0,0 +1,271 @@
+/*LC-3 sampling profiler: where the guest spends the host's CPU time*/
+
+#include<stdio.h>
+#include<stdint.h>
+#include<string.h>
+#include<signal.h>
+#include<time.h>
+/* unix only */
+#include<stdlib.h>
+#include<unistd.h>
+#include<pthread.h>
+#include<sys/syscall.h>
+
+#include "lc3.h"
+
+// SAMPLING PROFILER
+/*
+    Unlike --mem-profile and --timing, which step the guest one instruction at a time, --sample
+    leaves the engines running at full speed and looks at them now and then: every thread running a
+    guest (lc3-vm's, and each core's with --cores) has a timer on its own CPU time, timer_create on
+    CLOCK_THREAD_CPUTIME_ID delivered to that thread as SIGPROF, 1000 times a second by default.
+    The kernel only checks CPU-time timers at its tick, so the rate is at most CONFIG_HZ (250 on many
+    distributions): what counts is the spread of the samples, not their number.
+    The handler only reads sample_slot, where each engine publishes the VM and itself while it runs,
+    and that VM's PC, and adds one to the count of that PC for that engine with a relaxed atomic add:
+    no lock, nothing allocated, nothing it could find half done. The PC is vm->sample_pc, which every
+    engine stores at each fetch: reg[R_PC] would not do, the switch has already moved it on to the next
+    instruction and the threaded engine keeps it in a local. A sample outside the engines is the
+    host's, between two runs.
+    The counts are the profile: on SIGUSR1, and at the end of the run, a thread of the profiler writes
+    them to the file, per function (the label before the address, from an lc3as symbol file given with
+    --symbols) and then per address, hottest first.
+    No engine generates code, so there is no PC map to keep: the slot is the same for both.
+*/
+#define SAMPLE_HZ 1000
+#define SYMBOL_MAX 4096
+#define SYMBOL_NAME 32
+#define REPORT_LINES 40
+
+__thread struct sample_slot sample_slot;
+__thread timer_t sample_timer;
+__thread int sample_timing;
+
+struct symbol {
+    uint16_t address;
+    char name[SYMBOL_NAME];
+};
+
+struct {
+    const char* path;
+    int hz;
+    uint32_t* count;        /* [engine_count][MEMORY_MAX] */
+    uint32_t host;          /* samples outside the engines */
+    struct symbol* symbol;  /* by address */
+    int symbols;
+    pthread_mutex_t write;  /* one writer of the file at a time */
+} sample = { .write = PTHREAD_MUTEX_INITIALIZER };
+
+void sample_signal(int signo) {
+    (void) signo;
+    struct vm* vm = sample_slot.vm;
+    uint32_t* count = vm ? &sample.count[(size_t) sample_slot.engine * MEMORY_MAX + vm->sample_pc]
+        : &sample.host;
+    __atomic_fetch_add(count, 1, __ATOMIC_RELAXED);
+}
+
+int compare_symbols(const void* a, const void* b) {
+    const struct symbol* x = a;
+    const struct symbol* y = b;
+    return (x->address > y->address) - (x->address < y->address);
+}
+
+/*
+    An lc3as symbol file: "//" comment lines with a name and a hex address each, e.g.
+        //	LOOP               3003
+    Lines without both (the headers) are skipped, and so are lines without the "//".
+*/
+int sample_read_symbols(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) return 0;
+    sample.symbol = malloc(SYMBOL_MAX * sizeof(struct symbol));
+    if (!sample.symbol) {
+        fclose(file);
+        return 0;
+    }
+    char line[256];
+    while (sample.symbols < SYMBOL_MAX && fgets(line, sizeof(line), file)) {
+        char* p = line;
+        if (strncmp(p, "//", 2) == 0) p += 2;
+        char name[SYMBOL_NAME];
+        unsigned address;
+        char end;
+        if (sscanf(p, "%31s %x %c", name, &address, &end) != 2 || address > 0xFFFF) continue;
+        sample.symbol[sample.symbols].address = address;
+        strcpy(sample.symbol[sample.symbols].name, name);
+        sample.symbols ++;
+    }
+    fclose(file);
+    qsort(sample.symbol, sample.symbols, sizeof(struct symbol), compare_symbols);
+    return 1;
+}
+
+/* the label at or before `address`, -1 if there is none */
+int sample_symbol(uint16_t address) {
+    int lo = 0, hi = sample.symbols - 1, found = -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (sample.symbol[mid].address <= address) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return found;
+}
+
+void* sample_dumper(void* arg) {
+    sigset_t* set = arg;
+    for (int signo; sigwait(set, &signo) == 0; ) {
+        if (!sample_finish()) fprintf(stderr, "Failed to write the sample profile: %s\n", sample.path);
+    }
+    return NULL;
+}
+
+/*
+    Profile into `path` at `hz` samples per second of thread CPU time, with the labels of the symbol
+    file `symbols` (NULL = addresses only). Must be called before any other thread is started: SIGUSR1
+    is blocked for all of them and taken by the profiler's own thread, which writes the profile.
+*/
+int sample_enable(const char* path, int hz, const char* symbols) {
+    sample.path = path;
+    sample.hz = hz > 0 ? hz : SAMPLE_HZ;
+    sample.count = calloc((size_t) engine_count * MEMORY_MAX, sizeof(uint32_t));
+    if (!sample.count) return 0;
+    if (symbols && !sample_read_symbols(symbols)) {
+        printf("Failed to read symbols: %s\n", symbols);
+        return 0;
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sample_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) != 0) return 0;
+
+    static sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    pthread_t dumper;
+    if (pthread_create(&dumper, NULL, sample_dumper, &set) != 0) return 0;
+    pthread_detach(dumper);
+    return 1;
+}
+
+/* start the timer of the calling thread, nothing without --sample */
+void sample_thread_start() {
+    if (!sample.count || sample_timing) return;
+    struct sigevent event;
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+#ifdef sigev_notify_thread_id
+    event.sigev_notify_thread_id = syscall(SYS_gettid);
+#else
+    event._sigev_un._tid = syscall(SYS_gettid);
+#endif
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &sample_timer) != 0) return;
+    long ns = 1000000000L / sample.hz;
+    struct itimerspec period = { { ns / 1000000000L, ns % 1000000000L }, { ns / 1000000000L, ns % 1000000000L } };
+    timer_settime(sample_timer, 0, &period, NULL);
+    sample_timing = 1;
+}
+
+void sample_thread_stop() {
+    if (!sample_timing) return;
+    timer_delete(sample_timer);
+    sample_timing = 0;
+}
+
+struct sample_line {
+    uint16_t address;
+    int symbol;
+    uint64_t samples;
+};
+
+int compare_sample_lines(const void* a, const void* b) {
+    uint64_t x = ((const struct sample_line*) a)->samples, y = ((const struct sample_line*) b)->samples;
+    return (x < y) - (x > y);
+}
+
+void sample_print_name(FILE* file, uint16_t address, int symbol) {
+    char name[SYMBOL_NAME + 16];
+    if (symbol < 0) snprintf(name, sizeof(name), "x%04x", address);
+    else if (address == sample.symbol[symbol].address) snprintf(name, sizeof(name), "%s", sample.symbol[symbol].name);
+    else snprintf(name, sizeof(name), "%s+%u", sample.symbol[symbol].name, address - sample.symbol[symbol].address);
+    fprintf(file, "  %-32s", name);
+}
+
+/* sample_finish with the lock taken, releases it */
+int sample_write() {
+    FILE* file = fopen(sample.path, "w");
+    struct sample_line* line = malloc(MEMORY_MAX * sizeof(struct sample_line));
+    struct sample_line* function = malloc((sample.symbols + 1) * sizeof(struct sample_line));
+    if (!file || !line || !function) {
+        if (file) fclose(file);
+        free(line);
+        free(function);
+        pthread_mutex_unlock(&sample.write);
+        return 0;
+    }
+    /* a snapshot of the counts, the engines keep adding to them */
+    uint64_t guest = 0;
+    uint64_t host = __atomic_load_n(&sample.host, __ATOMIC_RELAXED);
+    uint64_t by_engine[engine_count];
+    int lines = 0;
+    /* one line per label, and a last one for the addresses before the first */
+    for (int i = 0; i < sample.symbols; ++ i) function[i] = (struct sample_line) { sample.symbol[i].address, i, 0 };
+    function[sample.symbols] = (struct sample_line) { 0, -1, 0 };
+    for (int e = 0; e < engine_count; ++ e) by_engine[e] = 0;
+    for (uint32_t a = 0; a < MEMORY_MAX; ++ a) {
+        uint64_t n = 0;
+        for (int e = 0; e < engine_count; ++ e) {
+            uint32_t c = __atomic_load_n(&sample.count[(size_t) e * MEMORY_MAX + a], __ATOMIC_RELAXED);
+            by_engine[e] += c;
+            n += c;
+        }
+        if (!n) continue;
+        int symbol = sample_symbol(a);
+        line[lines ++] = (struct sample_line) { a, symbol, n };
+        function[symbol < 0 ? sample.symbols : symbol].samples += n;
+        guest += n;
+    }
+
+    uint64_t total = guest + host;
+    fprintf(file, "sample: %llu samples, %d per second of CPU time asked for, %llu in the host between runs\n",
+        (unsigned long long) total, sample.hz, (unsigned long long) host);
+    fprintf(file, "  engines:");
+    for (int e = 0; e < engine_count; ++ e) fprintf(file, " %s %llu", engines[e].name, (unsigned long long) by_engine[e]);
+    fprintf(file, "\n");
+    if (guest && sample.symbols) {
+        qsort(function, sample.symbols + 1, sizeof(struct sample_line), compare_sample_lines);
+        fprintf(file, "  %-32s %10s %7s\n", "function", "samples", "");
+        for (int i = 0; i <= sample.symbols && i < REPORT_LINES && function[i].samples; ++ i) {
+            if (function[i].symbol < 0) fprintf(file, "  %-32s", "(before the first label)");
+            else sample_print_name(file, function[i].address, function[i].symbol);
+            fprintf(file, " %10llu %6.1f%%\n", (unsigned long long) function[i].samples, 100.0 * function[i].samples / guest);
+        }
+    }
+    if (guest) {
+        qsort(line, lines, sizeof(struct sample_line), compare_sample_lines);
+        fprintf(file, "  %-32s %10s %7s\n", "address", "samples", "");
+        for (int i = 0; i < lines && i < REPORT_LINES; ++ i) {
+            sample_print_name(file, line[i].address, line[i].symbol);
+            fprintf(file, " %10llu %6.1f%%\n", (unsigned long long) line[i].samples, 100.0 * line[i].samples / guest);
+        }
+    }
+    free(line);
+    free(function);
+    int ok = fclose(file) == 0;
+    pthread_mutex_unlock(&sample.write);
+    return ok;
+}
+
+/* write the counts so far to the file, returns 0 if it cannot be written; nothing without --sample */
+int sample_finish() {
+    if (!sample.count) return 1;
+    pthread_mutex_lock(&sample.write);
+    return sample_write();
+}
@@ -0,0 +1,183 @@
+/*LC-3 multi-core: cores on host threads sharing one memory*/
+
+#include<stdio.h>
+#include<stdint.h>
+#include<string.h>
+/* unix only */
+#include<stdlib.h>
+#include<pthread.h>
+
+#include "lc3.h"
+
+// CORES
+/*
+    With --cores N the machine has N cores. Each is a VM of its own (registers, PC, keyboard
+    registers, performance counters) running on its own host thread, and all of them point at the
+    same pages: core 0 makes every page private once, the others take its page table, so a store
+    by one core is a store into the memory of all and the copy-on-write path never runs.
+    Every core starts at PC_START and tells itself apart by reading MR_CORE_ID. The machine stops
+    when every core has halted.
+    The terminal and the key queue are one for all cores: traps and the keyboard registers run one
+    core at a time, and a core waiting in GETC holds them until its key comes.
+
+    Memory model:
+    - plain loads and stores are relaxed: each core sees its own in order, but nothing says when,
+      or in which order, another core sees them
+    - the device registers are sequentially consistent: every access to MR_ATOMIC_TAS and
+      MR_ATOMIC_FADD is one atomic operation on the word at MR_ATOMIC_ADDR, all cores agree on one
+      order of them, and plain stores before one are visible to a core that sees its result
+    So a core publishes with plain stores followed by an atomic one, and waits by reading through
+    the device (a read of MR_ATOMIC_FADD with MR_ATOMIC_VALUE 0 is an atomic load), not by
+    spinning on a plain load.
+    A VM that is not part of a machine is core 0 of 1, and the atomics work on its memory alone.
+*/
+struct {
+    int cores;
+    struct vm* core[SMP_MAX];
+    const struct engine* engine;
+    pthread_mutex_t io;
+    pthread_cond_t start;  /* the threads wait on it until all of them exist */
+    int go;                /* 0 while they wait, 1 to run, -1 when a thread could not be started */
+    const char* session;   /* the metrics session of core 0's thread, NULL without metrics */
+} smp = { .io = PTHREAD_MUTEX_INITIALIZER, .start = PTHREAD_COND_INITIALIZER };
+
+void smp_lock() {
+    pthread_mutex_lock(&smp.io);
+}
+
+void smp_unlock() {
+    pthread_mutex_unlock(&smp.io);
+}
+
+/* the word an atomic register works on, NULL for the device page */
+uint16_t* smp_word(struct vm* vm) {
+    uint16_t address = vm->atomic_addr;
+    if (address >= DEVICE_BASE) return NULL;
+    uint16_t p = address >> PAGE_BITS;
+    /* only a VM on its own gets here, in a machine every page is private already */
+    if (vm->page_kind[p] != PG_PRIVATE) page_make_private(vm, p);
+    vm->page_hot[p] = 1;
+    return &vm->page[p][address & PAGE_MASK];
+}
+
+uint16_t smp_read(struct vm* vm, uint16_t address) {
+    uint16_t* word;
+    switch (address) {
+        case MR_CORE_ID:
+            return vm->core;
+        case MR_CORE_COUNT:
+            return vm->cores ? vm->cores : 1;
+        case MR_ATOMIC_ADDR:
+            return vm->atomic_addr;
+        case MR_ATOMIC_VALUE:
+            return vm->atomic_value;
+        case MR_ATOMIC_TAS:
+            word = smp_word(vm);
+            return word ? __atomic_exchange_n(word, 1, __ATOMIC_SEQ_CST) : 0;
+        default:
+            word = smp_word(vm);
+            return word ? __atomic_fetch_add(word, vm->atomic_value, __ATOMIC_SEQ_CST) : 0;
+    }
+}
+
+void smp_write(struct vm* vm, uint16_t address, uint16_t data) {
+    uint16_t* word;
+    switch (address) {
+        case MR_ATOMIC_ADDR:
+            vm->atomic_addr = data;
+            break;
+        case MR_ATOMIC_VALUE:
+            vm->atomic_value = data;
+            break;
+        case MR_ATOMIC_TAS:
+            word = smp_word(vm);
+            if (word) __atomic_store_n(word, data, __ATOMIC_SEQ_CST);
+            break;
+        case MR_ATOMIC_FADD:
+            word = smp_word(vm);
+            if (word) __atomic_fetch_add(word, data, __ATOMIC_SEQ_CST);
+            break;
+    }
+}
+
+/* a machine of `cores` cores on the loaded image, returns core 0 */
+struct vm* smp_create(int cores) {
+    if (cores < 1 || cores > SMP_MAX) return NULL;
+    struct vm* first = vm_create();
+    if (!first) return NULL;
+    for (int p = 0; p < PAGE_COUNT; ++ p) {
+        if (first->page_kind[p] != PG_PRIVATE) page_make_private(first, p);
+    }
+    smp.cores = cores;
+    smp.core[0] = first;
+    for (int c = 0; c < cores; ++ c) {
+        struct vm* vm = c ? vm_create() : first;
+        if (!vm) return NULL;
+        if (c) {
+            memcpy(vm->page, first->page, sizeof(vm->page));
+            memcpy(vm->page_kind, first->page_kind, sizeof(vm->page_kind));
+        }
+        vm->core = c;
+        vm->cores = cores;
+        smp.core[c] = vm;
+    }
+    return first;
+}
+
+struct vm* smp_core(int c) {
+    return smp.core[c];
+}
+
+void* smp_thread(void* arg) {
+    int c = (int) (intptr_t) arg;
+    struct vm* vm = smp.core[c];
+    pthread_mutex_lock(&smp.io);
+    while (!smp.go) pthread_cond_wait(&smp.start, &smp.io);
+    int go = smp.go;
+    pthread_mutex_unlock(&smp.io);
+    if (go < 0) return NULL;
+    if (c && smp.session) {
+        /* the counters are per thread: every core counts into a block of its own */
+        char name[sizeof(((struct metrics*) 0)->session)];
+        snprintf(name, sizeof(name), "%s/core%d", smp.session, c);
+        metrics_register(name);
+    }
+    sample_thread_start();
+    /* in slices like lc3-vm, so the instruction counters move while it runs */
+    while (smp.engine->run(vm, 1 << 22) == VM_BUDGET && !vm_interrupted);
+    sample_thread_stop();
+    return NULL;
+}
+
+/*
+    Runs every core until it halts, core 0 on the calling thread.
+    No core runs before all threads exist: with some missing the others could wait for them forever,
+    so then nothing runs and it returns 0.
+*/
+int smp_run(const struct engine* engine) {
+    smp.engine = engine;
+    smp.go = 0;
+    smp.session = metrics_self ? metrics_self->session : NULL;
+    pthread_t thread[SMP_MAX];
+    int started = 1;
+    for (; started < smp.cores; ++ started) {
+        if (pthread_create(&thread[started], NULL, smp_thread, (void*) (intptr_t) started) != 0) break;
+    }
+    pthread_mutex_lock(&smp.io);
+    smp.go = started == smp.cores ? 1 : -1;
+    pthread_cond_broadcast(&smp.start);
+    pthread_mutex_unlock(&smp.io);
+    smp_thread((void*) 0);
+    for (int c = 1; c < started; ++ c) pthread_join(thread[c], NULL);
+    return started == smp.cores;
+}
+
+void smp_destroy() {
+    for (int c = smp.cores - 1; c >= 0; -- c) {
+        /* the pages are core 0's, the others only borrowed them */
+        xmem_unmap(smp.core[c]);
+        if (c) memset(smp.core[c]->page_kind, PG_IMAGE, sizeof(smp.core[c]->page_kind));
+        vm_destroy(smp.core[c]);
+    }
+    smp.cores = 0;
+}
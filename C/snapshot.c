@@ -0,0 +1,182 @@
+/*LC-3 snapshots*/
+
+#include<stdio.h>
+#include<stdint.h>
+#include<string.h>
+/* unix only */
+#include<stdlib.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<sys/types.h>
+#include<sys/mman.h>
+
+#include "lc3.h"
+
+// SNAPSHOTS
+/*
+    A snapshot is the whole state of a VM at its first request for input, so a program with a long
+    start-up (tables, the initial board) can be resumed right at its prompt.
+    File layout, host byte order:
+        header    (struct snapshot_header)
+        index     page numbers, one uint16 per page, with SNAPSHOT_ZERO for a page of zeros
+        padding   up to a multiple of PAGE_BYTES
+        pages     PAGE_BYTES each, in index order, none for the zero pages
+        output    the last SNAPSHOT_OUTPUT_MAX bytes the guest printed before the snapshot, replayed on load
+    Every page is in the index, a page of zeros without its words: loading on top of images must not
+    leave an image page where the VM had cleared it. The pages are aligned, so loading maps the file
+    and points the image straight at them, processes resuming the same snapshot share them.
+    The checksum is FNV-1a over the header's fields (not its padding) and the rest of the file.
+*/
+#define SNAPSHOT_MAGIC 0x5333434C /* "LC3S" */
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_ZERO 0x8000
+#define SNAPSHOT_OUTPUT_MAX (1 << 20)
+
+const uint16_t zero_page[PAGE_SIZE];
+
+struct {
+    const char* save_path;
+    int saved;
+} snapshot;
+
+/* take a snapshot at the first request for input, the output until then is recorded for it */
+void snapshot_save_at_input(const char* path) {
+    snapshot.save_path = path;
+    out_capture_limit(SNAPSHOT_OUTPUT_MAX);
+    out_capture(1);
+}
+
+/* FNV-1a over the fields of the header, the checksum taken as zero */
+uint64_t snapshot_header_sum(const struct snapshot_header* h) {
+    uint64_t zero = 0;
+    uint64_t sum = fnv1a(&h->magic, sizeof(h->magic), FNV_OFFSET);
+    sum = fnv1a(&h->version, sizeof(h->version), sum);
+    sum = fnv1a(&h->page_count, sizeof(h->page_count), sum);
+    sum = fnv1a(h->reg, sizeof(h->reg), sum);
+    sum = fnv1a(&h->kbsr, sizeof(h->kbsr), sum);
+    sum = fnv1a(&h->kbdr, sizeof(h->kbdr), sum);
+    sum = fnv1a(&h->output_size, sizeof(h->output_size), sum);
+    return fnv1a(&zero, sizeof(zero), sum);
+}
+
+size_t snapshot_pages_offset(uint16_t page_count) {
+    size_t end = sizeof(struct snapshot_header) + page_count * sizeof(uint16_t);
+    return (end + PAGE_BYTES - 1) / PAGE_BYTES * PAGE_BYTES;
+}
+
+int page_is_zero(const uint16_t* data) {
+    for (int i = 0; i < PAGE_SIZE; ++ i) {
+        if (data[i]) return 0;
+    }
+    return 1;
+}
+
+/* `pc` is the address of the instruction asking for input, the snapshot resumes by running it again */
+int snapshot_save(struct vm* vm, uint16_t pc, const char* path) {
+    struct snapshot_header h;
+    memset(&h, 0, sizeof(h)); /* the padding too, it is written */
+    size_t output_size;
+    const char* output = out_captured(&output_size);
+    uint16_t index[PAGE_COUNT];
+    for (int p = 0; p < PAGE_COUNT; ++ p) {
+        index[h.page_count ++] = page_is_zero(vm->page[p]) ? p | SNAPSHOT_ZERO : p;
+    }
+    h.magic = SNAPSHOT_MAGIC;
+    h.version = SNAPSHOT_VERSION;
+    memcpy(h.reg, vm->reg, sizeof(h.reg));
+    h.reg[R_PC] = pc;
+    h.kbsr = vm->kbsr;
+    h.kbdr = vm->kbdr;
+    h.output_size = output_size;
+
+    size_t offset = snapshot_pages_offset(h.page_count);
+    size_t pad = offset - sizeof(h) - h.page_count * sizeof(uint16_t);
+    static const char zeros[PAGE_BYTES];
+
+    uint64_t sum = snapshot_header_sum(&h);
+    sum = fnv1a(index, h.page_count * sizeof(uint16_t), sum);
+    sum = fnv1a(zeros, pad, sum);
+    for (int i = 0; i < h.page_count; ++ i) {
+        if (!(index[i] & SNAPSHOT_ZERO)) sum = fnv1a(vm->page[index[i]], PAGE_BYTES, sum);
+    }
+    sum = fnv1a(output, output_size, sum);
+    h.checksum = sum;
+
+    FILE* file = fopen(path, "wb");
+    if (!file) return 0;
+    fwrite(&h, sizeof(h), 1, file);
+    fwrite(index, sizeof(uint16_t), h.page_count, file);
+    fwrite(zeros, 1, pad, file);
+    for (int i = 0; i < h.page_count; ++ i) {
+        if (!(index[i] & SNAPSHOT_ZERO)) fwrite(vm->page[index[i]], PAGE_BYTES, 1, file);
+    }
+    fwrite(output, 1, output_size, file);
+    return fclose(file) == 0;
+}
+
+/*
+    Maps a snapshot in place of the images, fills in the header for the caller to restore the registers.
+    The mapping stays for the life of the process.
+*/
+int snapshot_load(const char* path, struct snapshot_header* out) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size < (off_t) sizeof(struct snapshot_header)) {
+        close(fd);
+        return 0;
+    }
+    uint8_t* base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return 0;
+
+    struct snapshot_header h;
+    memcpy(&h, base, sizeof(h));
+    size_t offset = snapshot_pages_offset(h.page_count);
+    const uint16_t* index = (const uint16_t*) (base + sizeof(h));
+    size_t saved = 0; /* pages with their words in the file */
+    if (h.magic == SNAPSHOT_MAGIC && h.version == SNAPSHOT_VERSION && h.page_count <= PAGE_COUNT &&
+        offset <= (size_t) size) {
+        for (int i = 0; i < h.page_count; ++ i) saved += !(index[i] & SNAPSHOT_ZERO);
+    }
+    if (h.magic != SNAPSHOT_MAGIC || h.version != SNAPSHOT_VERSION || h.page_count > PAGE_COUNT ||
+        offset + saved * PAGE_BYTES + h.output_size != (size_t) size) {
+        munmap(base, size);
+        return 0;
+    }
+    uint64_t sum = snapshot_header_sum(&h);
+    sum = fnv1a(base + sizeof(h), size - sizeof(h), sum);
+    if (sum != h.checksum) {
+        munmap(base, size);
+        return 0;
+    }
+
+    const uint8_t* words = base + offset;
+    for (int i = 0; i < h.page_count; ++ i) {
+        uint16_t p = index[i] & ~SNAPSHOT_ZERO & (PAGE_COUNT - 1);
+        if (index[i] & SNAPSHOT_ZERO) {
+            image_page[p] = (uint16_t*) zero_page;
+        } else {
+            image_page[p] = (uint16_t*) words;
+            words += PAGE_BYTES;
+        }
+    }
+    const char* output = (const char*) words;
+    out_write(output, h.output_size);
+    out_flush();
+    METRIC_ADD(snapshot_restores, 1);
+    *out = h;
+    return 1;
+}
+
+/* the guest asks for input: take the snapshot if one was requested */
+void snapshot_point(struct vm* vm) {
+    if (!snapshot.save_path || snapshot.saved) return;
+    snapshot.saved = 1;
+    out_capture(0);
+    out_capture_limit(0);
+    if (!snapshot_save(vm, vm->reg[R_PC] - 1, snapshot.save_path)) {
+        fprintf(stderr, "Failed to save state: %s\n", snapshot.save_path);
+    }
+}
+
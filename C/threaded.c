@@ -0,0 +1,186 @@
+/*LC-3 threaded engine*/
+
+#include<stdio.h>
+#include<stdint.h>
+/* unix only */
+#include<stdlib.h>
+
+#include "lc3.h"
+#include "lc3-probes.h"
+
+// THREADED ENGINE
+/*
+    The same instructions as the switch in vm_run, dispatched with computed gotos (a GCC and Clang extension):
+    every handler ends with its own indirect jump to the next handler, instead of all of them going back
+    through the one jump of the switch, so the branch predictor learns which opcode tends to follow which.
+    The PC stays in a local and is written back before anything that can look at it (traps, the device page),
+    and every fetch also stores it in sample_pc for the sampling profiler (one store, no branch).
+    Loads and stores take the page table directly and only call mem_read/mem_write for the device page or
+    a page that is not private yet.
+    Once the guest has touched the performance counters, dispatch goes through `counting` instead, which
+    counts the opcode and then jumps on to the same handler, so the plain path stays as it was.
+*/
+#define SETCC(r) reg[R_COND] = reg[r] == 0 ? FL_ZRO : (reg[r] >> 15) ? FL_NEG : FL_POS
+#define SEXT(x, bits) ((uint16_t) ((int16_t) ((x) << (16 - (bits))) >> (16 - (bits))))
+
+int vm_run_threaded(struct vm* vm, uint64_t budget) {
+    static void* const dispatch[16] = {
+        &&op_br, &&op_add, &&op_ld, &&op_st, &&op_jsr, &&op_and, &&op_ldr, &&op_str,
+        &&op_bad, &&op_not, &&op_ldi, &&op_sti, &&op_jmp, &&op_bad, &&op_lea, &&op_trap
+    };
+    static void* const counting[16] = {
+        &&op_count, &&op_count, &&op_count, &&op_count, &&op_count, &&op_count, &&op_count, &&op_count,
+        &&op_count, &&op_count, &&op_count, &&op_count, &&op_count, &&op_count, &&op_count, &&op_count
+    };
+    uint16_t* reg = vm->reg;
+    uint16_t** page = vm->page;
+    uint16_t pc = reg[R_PC];
+    uint16_t instr;
+    uint64_t count = 0;
+    int status = VM_BUDGET;
+    void* const* table = vm->perf ? counting : dispatch;
+    SAMPLE_ENTER(vm, ENGINE_THREADED);
+
+/* a device access may have switched the counters on, or stopped for input before the instruction wrote anything */
+#define DEVICE(access) ({ \
+        reg[R_PC] = pc; \
+        vm->pending = count; \
+        uint16_t d_ = (access); \
+        if (vm->input_stop) goto out; \
+        table = vm->perf ? counting : dispatch; \
+        d_; \
+    })
+/* a load: a plain page read unless it is a device register */
+#define LOAD(address) ({ \
+        uint16_t a_ = (address); \
+        a_ < DEVICE_BASE ? page[a_ >> PAGE_BITS][a_ & PAGE_MASK] : DEVICE(device_read(vm, a_)); \
+    })
+#define STORE(address, data) do { \
+        uint16_t a_ = (address); \
+        if (a_ < DEVICE_BASE && vm->page_kind[a_ >> PAGE_BITS] == PG_PRIVATE) { \
+            vm->page_hot[a_ >> PAGE_BITS] = 1; \
+            page[a_ >> PAGE_BITS][a_ & PAGE_MASK] = (data); \
+        } else { \
+            DEVICE((mem_write(vm, a_, (data)), 0)); \
+        } \
+    } while (0)
+/* fetch like vm_run: the PC already points past the instruction while the device page is read */
+#define DISPATCH() do { \
+        if (count == budget) goto out; \
+        ++ count; \
+        uint16_t at_ = pc ++; \
+        vm->sample_pc = at_; \
+        instr = at_ < DEVICE_BASE ? page[at_ >> PAGE_BITS][at_ & PAGE_MASK] : DEVICE(device_read(vm, at_)); \
+        if (PROBE_ENABLED(dispatch)) PROBE2(dispatch, at_, instr); \
+        goto *table[instr >> 12]; \
+    } while (0)
+
+    DISPATCH();
+
+op_add:
+    {
+        uint16_t r0 = (instr >> 9) & 0x7;
+        uint16_t r1 = (instr >> 6) & 0x7;
+        reg[r0] = reg[r1] + ((instr & 0x20) ? SEXT(instr & 0x1F, 5) : reg[instr & 0x7]);
+        SETCC(r0);
+    }
+    DISPATCH();
+op_and:
+    {
+        uint16_t r0 = (instr >> 9) & 0x7;
+        uint16_t r1 = (instr >> 6) & 0x7;
+        reg[r0] = reg[r1] & ((instr & 0x20) ? SEXT(instr & 0x1F, 5) : reg[instr & 0x7]);
+        SETCC(r0);
+    }
+    DISPATCH();
+op_not:
+    {
+        uint16_t r0 = (instr >> 9) & 0x7;
+        reg[r0] = ~reg[(instr >> 6) & 0x7];
+        SETCC(r0);
+    }
+    DISPATCH();
+op_br:
+    if (((instr >> 9) & 0x7) & reg[R_COND]) pc += SEXT(instr & 0x1FF, 9);
+    DISPATCH();
+op_jmp:
+    pc = reg[(instr >> 6) & 0x7];
+    DISPATCH();
+op_jsr:
+    /* R7 first, like the switch: JSRR R7 falls through */
+    reg[R_R7] = pc;
+    if (instr & 0x800) pc += SEXT(instr & 0x7FF, 11); else pc = reg[(instr >> 6) & 0x7];
+    DISPATCH();
+op_ld:
+    {
+        uint16_t r0 = (instr >> 9) & 0x7;
+        reg[r0] = LOAD(pc + SEXT(instr & 0x1FF, 9));
+        SETCC(r0);
+    }
+    DISPATCH();
+op_ldi:
+    {
+        uint16_t r0 = (instr >> 9) & 0x7;
+        uint16_t address = LOAD(pc + SEXT(instr & 0x1FF, 9));
+        reg[r0] = LOAD(address);
+        SETCC(r0);
+    }
+    DISPATCH();
+op_ldr:
+    {
+        uint16_t r0 = (instr >> 9) & 0x7;
+        reg[r0] = LOAD(reg[(instr >> 6) & 0x7] + SEXT(instr & 0x3F, 6));
+        SETCC(r0);
+    }
+    DISPATCH();
+op_lea:
+    {
+        uint16_t r0 = (instr >> 9) & 0x7;
+        reg[r0] = pc + SEXT(instr & 0x1FF, 9);
+        SETCC(r0);
+    }
+    DISPATCH();
+op_st:
+    STORE(pc + SEXT(instr & 0x1FF, 9), reg[(instr >> 9) & 0x7]);
+    DISPATCH();
+op_sti:
+    {
+        uint16_t address = LOAD(pc + SEXT(instr & 0x1FF, 9));
+        STORE(address, reg[(instr >> 9) & 0x7]);
+    }
+    DISPATCH();
+op_str:
+    STORE(reg[(instr >> 6) & 0x7] + SEXT(instr & 0x3F, 6), reg[(instr >> 9) & 0x7]);
+    DISPATCH();
+op_trap:
+    reg[R_PC] = pc;
+    if (!vm_trap(vm, instr & 0xFF)) {
+        status = VM_HALTED;
+        goto out;
+    }
+    DISPATCH();
+op_count:
+    vm->perf->ops[instr >> 12] ++;
+    goto *dispatch[instr >> 12];
+op_bad:
+    // BAD OPCODE
+    abort();
+
+out:
+    SAMPLE_LEAVE();
+    reg[R_PC] = pc;
+    if (vm_input_undo(vm)) {
+        -- count;
+        status = VM_INPUT;
+    } else if (vm_output_stopped(vm)) {
+        status = VM_OUTPUT;
+    }
+    vm->instructions += count;
+    vm->pending = 0;
+    if (!vm->shadow) METRIC_ADD(instructions, count);
+    return status;
+#undef DEVICE
+#undef LOAD
+#undef STORE
+#undef DISPATCH
+}
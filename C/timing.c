@@ -0,0 +1,343 @@
+/*LC-3 timing model: estimated cycles on real hardware, per function*/
+
+#include<stdio.h>
+#include<stdint.h>
+#include<string.h>
+/* unix only */
+#include<stdlib.h>
+
+#include "lc3.h"
+
+// TIMING MODEL
+/*
+    Estimates how long a program would take on an LC-3, not how fast this VM runs it. Like the memory
+    profiler it steps the guest one instruction at a time on any engine and decodes each instruction
+    before it runs:
+        cycles = the opcode's own cost (its states without memory)
+               + every memory access it makes (the fetch included), at the memory latency or
+                 through a small set-associative LRU cache if one is configured
+               + for the traps, which this VM does in the host, a flat cost plus one per character
+    The defaults follow the state machine in Patt & Patel with a 5-cycle memory, the same numbers as
+    the cycle counter of the performance counter device. A file can change any of them:
+        # comment
+        add 4          opcodes: add and not br jmp jsr ld ldi ldr lea st sti str trap rti
+        read 5         memory latency of a read, write: of a write
+        cache_sets 16  0 = no cache
+        cache_ways 2
+        cache_line 4   words per cache line, a power of two
+        cache_hit 1    cycles of an access that hits
+        trap_char 0    cycles per character printed by OUT/PUTS/PUTSP
+        mhz 10         clock, for the time estimate
+    The cycles are attributed to a call tree: JSR/JSRR enter the callee (a node per call path) and a
+    jump to the return address of a frame on the stack leaves it, so RET and unwinding both work.
+*/
+#define CALL_NODES 8192
+#define CALL_DEPTH 256
+#define CACHE_MAX_LINES 4096
+#define REPORT_LINES 60
+
+struct call_node {
+    uint16_t address;       /* of the function */
+    int parent, child, sibling;
+    uint64_t calls;
+    uint64_t self, total;   /* cycles */
+};
+
+struct {
+    int on;
+    uint32_t op[16];
+    uint32_t read, write;
+    uint32_t trap_char;
+    uint32_t cache_sets, cache_ways, cache_line, cache_hit;
+    double mhz;
+
+    uint64_t cycles;
+    uint64_t instructions;
+    uint64_t hits, misses;
+    uint32_t* tag;          /* [sets * ways], 0 = empty, otherwise line number + 1 */
+    uint32_t* used;         /* last access, for LRU */
+    uint32_t clock;
+
+    struct call_node* node;
+    int nodes;
+    int current;
+    int stack[CALL_DEPTH];  /* node of each frame */
+    uint16_t ret[CALL_DEPTH]; /* and where it returns to */
+    int depth;
+    uint64_t overflows;     /* calls not entered because the tree or the stack was full */
+} timing = {
+    .op = { 4, 4, 5, 5, 5, 4, 5, 5, 6, 4, 6, 6, 4, 4, 4, 5 },
+    .read = 5, .write = 5,
+    .trap_char = 0,
+    .cache_sets = 0, .cache_ways = 2, .cache_line = 4, .cache_hit = 1,
+    .mhz = 0.0
+};
+
+const char* timing_op_names[16] = {
+    "br", "add", "ld", "st", "jsr", "and", "ldr", "str", "rti", "not", "ldi", "sti", "jmp", "res", "lea", "trap"
+};
+
+/* a "name value" setting, returns 0 if the name is unknown */
+int timing_set(const char* name, double value) {
+    for (int op = 0; op < 16; ++ op) {
+        if (strcmp(name, timing_op_names[op]) == 0) {
+            timing.op[op] = (uint32_t) value;
+            return 1;
+        }
+    }
+    const struct {
+        const char* name;
+        uint32_t* value;
+    } settings[] = {
+        { "read", &timing.read },
+        { "write", &timing.write },
+        { "trap_char", &timing.trap_char },
+        { "cache_sets", &timing.cache_sets },
+        { "cache_ways", &timing.cache_ways },
+        { "cache_line", &timing.cache_line },
+        { "cache_hit", &timing.cache_hit },
+    };
+    for (size_t i = 0; i < sizeof(settings) / sizeof(settings[0]); ++ i) {
+        if (strcmp(name, settings[i].name) == 0) {
+            *settings[i].value = (uint32_t) value;
+            return 1;
+        }
+    }
+    if (strcmp(name, "mhz") == 0) {
+        timing.mhz = value;
+        return 1;
+    }
+    return 0;
+}
+
+/* switch the model on, with the settings in `path` (NULL = the defaults), returns 0 on a bad file */
+int timing_enable(const char* path) {
+    if (path) {
+        FILE* file = fopen(path, "r");
+        if (!file) {
+            printf("Failed to open timing model: %s\n", path);
+            return 0;
+        }
+        char line[256];
+        int number = 0;
+        while (fgets(line, sizeof(line), file)) {
+            ++ number;
+            char name[64];
+            double value;
+            char* hash = strchr(line, '#');
+            if (hash) *hash = 0;
+            int n = sscanf(line, "%63s %lf", name, &value);
+            if (n <= 0) continue;
+            if (n != 2 || !timing_set(name, value)) {
+                printf("%s:%d: bad setting\n", path, number);
+                fclose(file);
+                return 0;
+            }
+        }
+        fclose(file);
+    }
+    uint32_t lines = timing.cache_sets * timing.cache_ways;
+    if (lines > CACHE_MAX_LINES || (timing.cache_line & (timing.cache_line - 1)) || !timing.cache_line) {
+        printf("Timing model: the cache needs at most %d lines of a power of two words\n", CACHE_MAX_LINES);
+        return 0;
+    }
+    if (lines) {
+        timing.tag = calloc(lines, sizeof(uint32_t));
+        timing.used = calloc(lines, sizeof(uint32_t));
+    }
+    timing.node = calloc(CALL_NODES, sizeof(struct call_node));
+    if (!timing.node || (lines && (!timing.tag || !timing.used))) {
+        printf("Failed to allocate memory\n");
+        return 0;
+    }
+    timing.nodes = 1; /* the root: whatever runs outside any call */
+    timing.node[0].parent = -1;
+    timing.node[0].child = timing.node[0].sibling = -1;
+    timing.node[0].calls = 1;
+    timing.on = 1;
+    return 1;
+}
+
+/* the cost of one memory access */
+uint32_t timing_access(uint16_t address, uint32_t latency) {
+    if (!timing.tag) return latency;
+    uint32_t line = address / timing.cache_line;
+    uint32_t set = line % timing.cache_sets;
+    uint32_t* tag = timing.tag + set * timing.cache_ways;
+    uint32_t* used = timing.used + set * timing.cache_ways;
+    uint32_t victim = 0;
+    ++ timing.clock;
+    for (uint32_t w = 0; w < timing.cache_ways; ++ w) {
+        if (tag[w] == line + 1) {
+            used[w] = timing.clock;
+            timing.hits ++;
+            return timing.cache_hit;
+        }
+        if (used[w] < used[victim]) victim = w;
+    }
+    tag[victim] = line + 1;
+    used[victim] = timing.clock;
+    timing.misses ++;
+    return latency;
+}
+
+/* a word the instruction will read, without waking a device */
+uint16_t timing_peek(struct vm* vm, uint16_t address) {
+    if (address >= DEVICE_BASE) return address == MR_KBSR ? vm->kbsr : address == MR_KBDR ? vm->kbdr : 0;
+    return vm->page[address >> PAGE_BITS][address & PAGE_MASK];
+}
+
+void timing_call(uint16_t target, uint16_t ret) {
+    if (timing.depth == CALL_DEPTH) {
+        timing.overflows ++;
+        return;
+    }
+    int n = timing.node[timing.current].child;
+    while (n >= 0 && timing.node[n].address != target) n = timing.node[n].sibling;
+    if (n < 0) {
+        if (timing.nodes == CALL_NODES) {
+            timing.overflows ++;
+            return;
+        }
+        n = timing.nodes ++;
+        struct call_node* c = &timing.node[n];
+        c->address = target;
+        c->parent = timing.current;
+        c->child = -1;
+        c->sibling = timing.node[timing.current].child;
+        timing.node[timing.current].child = n;
+    }
+    timing.node[n].calls ++;
+    timing.stack[timing.depth] = timing.current;
+    timing.ret[timing.depth] = ret;
+    timing.depth ++;
+    timing.current = n;
+}
+
+/* a jump to the return address of a frame leaves it and everything called from it */
+void timing_jump(uint16_t target) {
+    for (int d = timing.depth - 1; d >= 0; -- d) {
+        if (timing.ret[d] != target) continue;
+        timing.current = timing.stack[d];
+        timing.depth = d;
+        return;
+    }
+}
+
+/* charge the instruction at the PC, before it runs */
+void timing_step(struct vm* vm) {
+    uint16_t* reg = vm->reg;
+    uint16_t pc = reg[R_PC];
+    uint16_t instr = timing_peek(vm, pc);
+    uint16_t op = instr >> 12;
+    uint16_t next = pc + 1;
+    uint16_t pc_offset = next + sign_extend(instr & 0x1FF, 9);
+    uint16_t base_offset = reg[(instr >> 6) & 0x7] + sign_extend(instr & 0x3F, 6);
+    uint64_t cycles = timing.op[op] + timing_access(pc, timing.read);
+    switch (op) {
+        case OP_LD:
+            cycles += timing_access(pc_offset, timing.read);
+            break;
+        case OP_LDI:
+            cycles += timing_access(pc_offset, timing.read);
+            cycles += timing_access(timing_peek(vm, pc_offset), timing.read);
+            break;
+        case OP_LDR:
+            cycles += timing_access(base_offset, timing.read);
+            break;
+        case OP_ST:
+            cycles += timing_access(pc_offset, timing.write);
+            break;
+        case OP_STI:
+            cycles += timing_access(pc_offset, timing.read);
+            cycles += timing_access(timing_peek(vm, pc_offset), timing.write);
+            break;
+        case OP_STR:
+            cycles += timing_access(base_offset, timing.write);
+            break;
+        case OP_TRAP:
+            {
+                /* the vector table, then the characters printed */
+                cycles += timing_access(instr & 0xFF, timing.read);
+                uint16_t vector = instr & 0xFF;
+                if (vector == TRAP_OUT) cycles += timing.trap_char;
+                if (vector == TRAP_PUTS || vector == TRAP_PUTSP) {
+                    for (uint16_t a = reg[R_R0]; a < DEVICE_BASE && timing_peek(vm, a); ++ a) {
+                        uint16_t w = timing_peek(vm, a);
+                        cycles += timing.trap_char * (vector == TRAP_PUTSP && (w >> 8) ? 2 : 1);
+                    }
+                }
+            }
+            break;
+    }
+    timing.cycles += cycles;
+    timing.instructions ++;
+    timing.node[timing.current].self += cycles;
+
+    if (op == OP_JSR) {
+        timing_call((instr & 0x800) ? next + sign_extend(instr & 0x7FF, 11) : reg[(instr >> 6) & 0x7], next);
+    } else if (op == OP_JMP) {
+        timing_jump(reg[(instr >> 6) & 0x7]);
+    }
+}
+
+/* like engine->run, one instruction at a time through the timing model */
+int vm_run_timed(struct vm* vm, const struct engine* engine, uint64_t budget) {
+    for (uint64_t i = 0; i < budget; ++ i) {
+        timing_step(vm);
+        int status = engine->run(vm, 1);
+        if (status != VM_BUDGET) return status;
+    }
+    return VM_BUDGET;
+}
+
+uint64_t timing_total(int n) {
+    uint64_t t = timing.node[n].self;
+    for (int c = timing.node[n].child; c >= 0; c = timing.node[c].sibling) t += timing_total(c);
+    timing.node[n].total = t;
+    return t;
+}
+
+int compare_call_nodes(const void* a, const void* b) {
+    uint64_t x = timing.node[*(const int*) a].total, y = timing.node[*(const int*) b].total;
+    return (x < y) - (x > y);
+}
+
+/* the subtree of `n`, hottest callee first, down to 0.5% of the run */
+void timing_print_node(FILE* file, int n, int depth, int* lines) {
+    struct call_node* c = &timing.node[n];
+    if (*lines >= REPORT_LINES || c->total * 200 < timing.cycles) return;
+    ++ *lines;
+    char name[64];
+    if (n == 0) snprintf(name, sizeof(name), "(top)");
+    else snprintf(name, sizeof(name), "%*sx%04x", 2 * (depth < 24 ? depth : 24), "", c->address);
+    fprintf(file, "  %-32s %10llu %14llu %14llu %6.1f%%\n", name, (unsigned long long) c->calls,
+        (unsigned long long) c->total, (unsigned long long) c->self, 100.0 * c->total / timing.cycles);
+    int k = 0;
+    for (int i = c->child; i >= 0; i = timing.node[i].sibling) ++ k;
+    int* children = malloc(k * sizeof(int) + 1);
+    if (!children) return;
+    k = 0;
+    for (int i = c->child; i >= 0; i = timing.node[i].sibling) children[k ++] = i;
+    qsort(children, k, sizeof(int), compare_call_nodes);
+    for (int i = 0; i < k; ++ i) timing_print_node(file, children[i], depth + 1, lines);
+    free(children);
+}
+
+void timing_print_report(FILE* file) {
+    if (!timing.on || !timing.cycles) return;
+    timing_total(0);
+    fprintf(file, "timing: %llu instructions, %llu cycles (CPI %.2f)", (unsigned long long) timing.instructions,
+        (unsigned long long) timing.cycles, (double) timing.cycles / timing.instructions);
+    if (timing.mhz > 0) fprintf(file, ", %.3f s at %g MHz", timing.cycles / (timing.mhz * 1e6), timing.mhz);
+    fprintf(file, "\n");
+    if (timing.tag) {
+        fprintf(file, "  cache: %u sets x %u ways x %u words, %.1f%% hits\n", timing.cache_sets, timing.cache_ways,
+            timing.cache_line, 100.0 * timing.hits / (timing.hits + timing.misses));
+    }
+    if (timing.overflows) fprintf(file, "  %llu calls beyond the call tree's limits were charged to their caller\n",
+        (unsigned long long) timing.overflows);
+    fprintf(file, "  %-32s %10s %14s %14s %7s\n", "function", "calls", "cycles", "self", "");
+    int lines = 0;
+    timing_print_node(file, 0, 0, &lines);
+}
@@ -0,0 +1,172 @@
+/*LC-3 lockstep validation of execution engines*/
+
+#include<stdio.h>
+#include<stdint.h>
+#include<string.h>
+/* unix only */
+#include<stdlib.h>
+
+#include "lc3.h"
+
+// LOCKSTEP VALIDATION
+/*
+    A faster engine runs the guest, and now and then one basic block (straight-line code up to and
+    including the next BR, JMP, JSR or TRAP) is checked against the reference switch:
+    - the VM is cloned at the start of the block, the clone runs the block on the reference engine
+    - the VM runs the same block on its own engine
+    - the registers, the keyboard registers and every page either of them wrote must match
+    On the first difference the run stops with VM_DIVERGED and the block and both states are dumped.
+    The gap between checked blocks is random, `percent` of the blocks on average, so a check costs
+    a clone and two short runs and a small percentage can stay on in production.
+    The VM runs first and records what KBSR/KBDR returned (struct device_log), the clone replays that,
+    so blocks polling the keyboard are checked too. A block ending in a trap is compared up to the
+    trap, which then runs on the VM alone.
+*/
+#define BLOCK_MAX 64
+#define BLOCK_MEAN 6 /* instructions in a typical block, to turn a percentage into a gap */
+
+struct {
+    uint64_t gap_mean;  /* instructions between checks on average, 0 = off */
+    uint64_t rng;
+    uint64_t checks;
+    uint64_t skipped;   /* blocks that read the keyboard more often than the log holds */
+} validation = { 0, 0x9E3779B97F4A7C15ULL, 0, 0 };
+
+void validate_enable(double percent) {
+    validation.gap_mean = percent > 0 ? (uint64_t) (BLOCK_MEAN * 100.0 / percent) : 0;
+    if (percent > 0 && validation.gap_mean == 0) validation.gap_mean = 1;
+}
+
+/* uniform in [0, 2 * gap_mean], so the checks do not fall into step with a loop */
+uint64_t validate_gap() {
+    validation.rng ^= validation.rng << 13;
+    validation.rng ^= validation.rng >> 7;
+    validation.rng ^= validation.rng << 17;
+    return validation.rng % (2 * validation.gap_mean + 1);
+}
+
+int ends_block(uint16_t instr) {
+    uint16_t op = instr >> 12;
+    return op == OP_BR || op == OP_JMP || op == OP_JSR || op == OP_TRAP || op == OP_RTI || op == OP_RES;
+}
+
+/* instructions from `pc` to the end of its block, read straight from the pages so no device is touched */
+int block_length(struct vm* vm, uint16_t pc, uint16_t* last) {
+    int n = 0;
+    uint16_t instr;
+    do {
+        instr = vm->page[pc >> PAGE_BITS][pc & PAGE_MASK];
+        ++ pc;
+        ++ n;
+    } while (!ends_block(instr) && n < BLOCK_MAX);
+    *last = instr;
+    return n;
+}
+
+/* pages written by either VM that do not hold the same words, the first one or -1 */
+int first_page_mismatch(struct vm* vm, struct vm* ref) {
+    for (int p = 0; p < PAGE_COUNT; ++ p) {
+        if (!vm->page_hot[p] && !ref->page_hot[p]) continue;
+        if (memcmp(vm->page[p], ref->page[p], PAGE_BYTES) != 0) return p;
+    }
+    return -1;
+}
+
+void dump_state(const char* name, struct vm* vm) {
+    fprintf(stderr, "  %-9s", name);
+    for (int r = 0; r < R_COUNT; ++ r) fprintf(stderr, " %04x", vm->reg[r]);
+    fprintf(stderr, " kbsr %04x kbdr %04x wrote", vm->kbsr, vm->kbdr);
+    for (int p = 0; p < PAGE_COUNT; ++ p) {
+        if (vm->page_hot[p]) fprintf(stderr, " %02x", p);
+    }
+    fprintf(stderr, "\n");
+}
+
+void dump_divergence(struct vm* vm, struct vm* ref, const struct engine* engine,
+                     const uint16_t* before, const uint16_t* code, int n) {
+    uint16_t pc = before[R_PC];
+    fprintf(stderr, "Engines diverged: %s against %s in the block at %04x\n", engine->name, engines[0].name, pc);
+    for (int i = 0; i < n; ++ i) fprintf(stderr, "  %04x: %04x\n", (uint16_t) (pc + i), code[i]);
+    fprintf(stderr, "  %-9s", "before");
+    for (int r = 0; r < R_COUNT; ++ r) fprintf(stderr, " %04x", before[r]);
+    fprintf(stderr, "   (R0-R7 PC COND)\n");
+    dump_state(engines[0].name, ref);
+    dump_state(engine->name, vm);
+    int p = first_page_mismatch(vm, ref);
+    if (p < 0) return;
+    for (int i = 0; i < PAGE_SIZE; ++ i) {
+        if (vm->page[p][i] == ref->page[p][i]) continue;
+        fprintf(stderr, "  memory %04x: %04x against %04x\n", (p << PAGE_BITS) | i, ref->page[p][i], vm->page[p][i]);
+        break;
+    }
+}
+
+/* run `n` instructions on both engines and compare, returns the engine's status or VM_DIVERGED */
+int check_block(struct vm* vm, const struct engine* engine, int n) {
+    uint16_t before[R_COUNT], code[BLOCK_MAX];
+    memcpy(before, vm->reg, sizeof(before));
+    for (int i = 0; i < n; ++ i) {
+        uint16_t a = before[R_PC] + i;
+        code[i] = vm->page[a >> PAGE_BITS][a & PAGE_MASK];
+    }
+    struct vm* ref = vm_clone(vm);
+    if (!ref) return engine->run(vm, n); /* no memory for a check is not a divergence */
+    ref->shadow = 1;
+    /* the hot bits mark what the block writes, the deduplicator gets the old ones back afterwards */
+    uint8_t hot[PAGE_COUNT];
+    memcpy(hot, vm->page_hot, sizeof(hot));
+    memset(vm->page_hot, 0, sizeof(vm->page_hot));
+    struct device_log log = { 0 };
+    vm->device_log = ref->device_log = &log;
+
+    int status = engine->run(vm, n);
+    int ref_status = engines[0].run(ref, n);
+    vm->device_log = NULL;
+
+    int ok = 1;
+    if (log.count > DEVICE_LOG_MAX) {
+        validation.skipped ++;
+    } else {
+        validation.checks ++;
+        ok = status == ref_status && log.next == log.count &&
+            memcmp(vm->reg, ref->reg, sizeof(vm->reg)) == 0 &&
+            vm->kbsr == ref->kbsr && vm->kbdr == ref->kbdr &&
+            first_page_mismatch(vm, ref) < 0;
+        if (!ok) dump_divergence(vm, ref, engine, before, code, n);
+    }
+    for (int p = 0; p < PAGE_COUNT; ++ p) vm->page_hot[p] |= hot[p];
+    vm_destroy(ref);
+    return ok ? status : VM_DIVERGED;
+}
+
+/* like engine->run, with sampled blocks checked against the reference; any status but VM_BUDGET ends it */
+int vm_run_validated(struct vm* vm, const struct engine* engine, uint64_t budget) {
+    if (!validation.gap_mean || engine->run == engines[0].run) return engine->run(vm, budget);
+    uint64_t start = vm->instructions;
+    int status;
+    while (vm->instructions - start < budget) {
+        /* run freely for a while, then on to the end of the current block */
+        uint64_t left = budget - (vm->instructions - start);
+        uint64_t gap = validate_gap();
+        if ((status = engine->run(vm, gap < left ? gap : left)) != VM_BUDGET) return status;
+        if (vm->instructions - start >= budget) break;
+        uint16_t last;
+        left = budget - (vm->instructions - start);
+        uint64_t rest = block_length(vm, vm->reg[R_PC], &last);
+        if ((status = engine->run(vm, rest < left ? rest : left)) != VM_BUDGET) return status;
+        if (vm->instructions - start >= budget) break;
+
+        /* the next block is the one checked, without its trap */
+        left = budget - (vm->instructions - start);
+        int n = block_length(vm, vm->reg[R_PC], &last);
+        if (last >> 12 == OP_TRAP || last >> 12 == OP_RTI || last >> 12 == OP_RES) -- n;
+        if (n > 0 && (uint64_t) n <= left && (status = check_block(vm, engine, n)) != VM_BUDGET) return status;
+    }
+    return VM_BUDGET;
+}
+
+void validate_print_stats(FILE* file) {
+    if (!validation.gap_mean) return;
+    fprintf(file, "validate: %llu blocks checked, %llu skipped with too many keyboard reads\n",
+        (unsigned long long) validation.checks, (unsigned long long) validation.skipped);
+}
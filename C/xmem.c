@@ -0,0 +1,128 @@
+/*LC-3 extended memory: banks of a large store switched into a window*/
+
+#include<stdio.h>
+#include<stdint.h>
+#include<string.h>
+/* unix only */
+#include<stdlib.h>
+#include<sys/mman.h>
+
+#include "lc3.h"
+
+// EXTENDED MEMORY
+/*
+    With --xmem BANKS the process has a store of BANKS banks of 4096 words (up to 65,535 of them,
+    half a GiB), and every VM a window at XMEM_WINDOW (0xE000-0xEFFF) it can map one of them into:
+        FE40  write a bank number to map it, XMEM_NONE to give the window its own memory back;
+              reads the mapped bank, a bank past the end of the store is ignored
+        FE41  banks in the store, 0 without one
+    Mapping a bank is a pointer swap: the 16 entries of the page table for the window point into the
+    store, with the kind PG_BANK, and the pages they pointed at before are kept aside until the
+    window is unmapped. A bank page is written in place (page_make_private leaves it alone), so the
+    store is shared by every VM and core mapping the same bank, like memory behind a real bank switch.
+    No engine keeps decoded instructions: both fetch through the page table, so the instruction after
+    the switching store is already fetched from the new bank, even when it is in the window itself.
+    The store is mmapped and untouched banks cost no memory.
+*/
+#define XMEM_PAGES (XMEM_BANK_WORDS / PAGE_SIZE)
+
+struct {
+    uint16_t* words;
+    uint16_t banks;
+} xmem;
+
+/* the window of a VM: which bank it shows and what it showed before */
+struct xmem_window {
+    uint16_t bank;
+    uint16_t* saved_page[XMEM_PAGES];
+    uint8_t saved_kind[XMEM_PAGES];
+};
+
+int xmem_enable(uint32_t banks) {
+    if (banks == 0 || banks >= XMEM_NONE) return 0;
+    void* p = mmap(NULL, (size_t) banks * XMEM_BANK_WORDS * sizeof(uint16_t), PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) return 0;
+    xmem.words = p;
+    xmem.banks = banks;
+    return 1;
+}
+
+/* every VM must have unmapped its window (vm_destroy does) */
+void xmem_free() {
+    if (xmem.words) munmap(xmem.words, (size_t) xmem.banks * XMEM_BANK_WORDS * sizeof(uint16_t));
+    xmem.words = NULL;
+    xmem.banks = 0;
+}
+
+/* the words of a bank, for the host */
+uint16_t* xmem_bank(uint16_t bank) {
+    return bank < xmem.banks ? xmem.words + (size_t) bank * XMEM_BANK_WORDS : NULL;
+}
+
+/* give the window its own pages back, returns the bank that was mapped or XMEM_NONE */
+uint16_t xmem_unmap(struct vm* vm) {
+    struct xmem_window* w = vm->xmem;
+    if (!w || w->bank == XMEM_NONE) return XMEM_NONE;
+    uint16_t first = XMEM_WINDOW >> PAGE_BITS;
+    for (int i = 0; i < XMEM_PAGES; ++ i) {
+        vm->page[first + i] = w->saved_page[i];
+        vm->page_kind[first + i] = w->saved_kind[i];
+        vm->page_hot[first + i] = 1;
+    }
+    uint16_t bank = w->bank;
+    w->bank = XMEM_NONE;
+    return bank;
+}
+
+/* show `bank` in the window, or the VM's own pages for XMEM_NONE; 0 if there is no such bank */
+int xmem_map(struct vm* vm, uint16_t bank) {
+    if (bank != XMEM_NONE && bank >= xmem.banks) return 0;
+    if (!vm->xmem) {
+        if (bank == XMEM_NONE) return 1;
+        vm->xmem = malloc(sizeof(struct xmem_window));
+        if (!vm->xmem) return 0;
+        vm->xmem->bank = XMEM_NONE;
+    }
+    struct xmem_window* w = vm->xmem;
+    if (w->bank == XMEM_NONE) {
+        if (bank == XMEM_NONE) return 1;
+        uint16_t first = XMEM_WINDOW >> PAGE_BITS;
+        memcpy(w->saved_page, vm->page + first, sizeof(w->saved_page));
+        memcpy(w->saved_kind, vm->page_kind + first, sizeof(w->saved_kind));
+    } else if (bank == XMEM_NONE) {
+        xmem_unmap(vm);
+        return 1;
+    }
+    uint16_t* base = xmem_bank(bank);
+    uint16_t first = XMEM_WINDOW >> PAGE_BITS;
+    for (int i = 0; i < XMEM_PAGES; ++ i) {
+        vm->page[first + i] = base + i * PAGE_SIZE;
+        vm->page_kind[first + i] = PG_BANK;
+        vm->page_hot[first + i] = 1;
+    }
+    w->bank = bank;
+    return 1;
+}
+
+uint16_t xmem_read(struct vm* vm, uint16_t address) {
+    if (address == MR_XMEM_BANKS) return xmem.banks;
+    return vm->xmem ? vm->xmem->bank : XMEM_NONE;
+}
+
+void xmem_write(struct vm* vm, uint16_t address, uint16_t data) {
+    if (address == MR_XMEM_BANK) xmem_map(vm, data);
+}
+
+/* the window of `from` in `to`, for vm_clone and vm_fork which copy `from` with the window unmapped */
+void xmem_copy(struct vm* to, struct vm* from, uint16_t bank) {
+    xmem_map(from, bank);
+    xmem_map(to, bank);
+}
+
+/* unmap the window and free it, before the VM's pages go */
+void xmem_release(struct vm* vm) {
+    xmem_unmap(vm);
+    free(vm->xmem);
+    vm->xmem = NULL;
+}
@@ -0,0 +1,56 @@
+#!/bin/sh
+# lc3-batch --tree must report exactly what running every script on its own does, and so must a
+# batch served from the cache, with or without --verify.
+# The scripts share prefixes so the tree splits edges, ends scripts on inner nodes, halts halfway
+# through an edge (the guest stops at 'q') and cuts an escape sequence where two scripts part.
+# Usage: scripts/batch-check.sh path/to/lc3-batch
+set -e
+
+batch=${1:?usage: batch-check.sh LC3_BATCH}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir"
+
+# at x3000: echo each key until the end of input or a 'q'
+#   GETC; BRn halt; OUT; LD R2, -'q'; ADD R1, R0, R2; BRz halt; BR x3000; HALT; halt: HALT; -'q'
+printf '\060\000\360\040\010\006\360\041\044\005\022\002\004\002\017\371\360\045\360\045\377\217' > echo.obj
+
+printf 'abc' > s1
+printf 'abd' > s2
+printf 'ab' > s3
+printf 'abqxyz' > s4
+printf 'abqxyw' > s5
+printf 'ab\033[A1' > s6
+printf 'ab\033[B2' > s7
+printf '' > s8
+printf 'zzzz' > s9
+scripts="s1 s2 s3 s4 s5 s6 s7 s8 s9"
+
+fail() {
+    echo "batch-check: $1" >&2
+    diff "$2" "$3" >&2 || true
+    exit 1
+}
+
+# the report without its last column, where the result came from
+results() {
+    awk '{ print $1, $2, $3, $4 }' "$1"
+}
+
+"$batch" --budget 1 --image echo.obj $scripts > each.txt
+"$batch" --budget 1 --image echo.obj --tree $scripts > tree.txt
+cmp -s each.txt tree.txt || fail "--tree differs from running each script" each.txt tree.txt
+[ "$(wc -l < each.txt)" -eq 9 ] || fail "expected 9 report lines" each.txt tree.txt
+
+"$batch" --budget 1 --image echo.obj --tree --cache cache $scripts > /dev/null
+"$batch" --budget 1 --image echo.obj --cache cache $scripts > cached.txt
+grep -q ' cached$' cached.txt || fail "nothing came from the cache" each.txt cached.txt
+results each.txt > each.results
+results cached.txt > cached.results
+cmp -s each.results cached.results || fail "the cached results differ" each.results cached.results
+
+"$batch" --budget 1 --image echo.obj --tree --cache cache --verify 100 $scripts > verified.txt
+grep -q ' verified$' verified.txt || fail "nothing was verified" each.txt verified.txt
+results verified.txt > verified.results
+cmp -s each.results verified.results || fail "the verified results differ" each.results verified.results
+echo "batch-check: ok"
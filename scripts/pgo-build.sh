@@ -0,0 +1,20 @@
+#!/bin/sh
+# Two-stage PGO + LTO build of lc3-vm:
+#   1. an instrumented build runs the benchmark suite (2048.obj, rogue.obj and the synthetic kernels)
+#   2. the same build directory is rebuilt with the profile and link-time optimization
+# Usage: scripts/pgo-build.sh [build-dir] [extra cmake options...]
+set -e
+
+src=$(cd "$(dirname "$0")/.." && pwd)
+build=${1:-"$src/build-pgo"}
+[ $# -gt 0 ] && shift
+jobs=$(nproc 2>/dev/null || echo 1)
+
+rm -rf "$build/pgo"
+cmake -S "$src" -B "$build" -DCMAKE_BUILD_TYPE=Release -DLC3_LTO=ON -DLC3_PGO=GENERATE "$@"
+cmake --build "$build" -j"$jobs" --clean-first
+cmake --build "$build" --target pgo-train
+
+cmake -S "$src" -B "$build" -DLC3_PGO=USE
+cmake --build "$build" -j"$jobs" --clean-first
+echo "PGO build ready: $build/lc3-vm"